@@ -0,0 +1,131 @@
+#include <avr/pgmspace.h>
+#include "anim.h"
+#include "led.h"
+#include "clock.h"
+
+/*
+LED animation engine. A frame is computed from the main loop every ANIM_FRAME_MS, timed on the Timer1 clock, so
+lighting never runs in the scan or USB interrupts. Every pixel costs the same few table lookups and shifts each
+frame whatever the effect, which keeps the frame budget fixed.
+
+A pixel is a level (0-255) per frame: the base effect level or the reactive flash level, whichever is higher. The
+level goes through the gamma table and is shifted down by the color channel and the global brightness.
+*/
+
+#define ANIM_FRAME_TICKS ((uint32_t)ANIM_FRAME_MS * 1000UL * CLOCK_TICKS_PER_US)
+
+// 255 * (i / 255) ^ 2.2
+static const uint8_t animGamma[256] PROGMEM = {
+	  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   1,
+	  1,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,
+	  3,   3,   3,   3,   3,   4,   4,   4,   4,   5,   5,   5,   5,   6,   6,   6,
+	  6,   7,   7,   7,   8,   8,   8,   9,   9,   9,  10,  10,  11,  11,  11,  12,
+	 12,  13,  13,  13,  14,  14,  15,  15,  16,  16,  17,  17,  18,  18,  19,  19,
+	 20,  20,  21,  22,  22,  23,  23,  24,  25,  25,  26,  26,  27,  28,  28,  29,
+	 30,  30,  31,  32,  33,  33,  34,  35,  35,  36,  37,  38,  39,  39,  40,  41,
+	 42,  43,  43,  44,  45,  46,  47,  48,  49,  49,  50,  51,  52,  53,  54,  55,
+	 56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,  68,  69,  70,  71,
+	 73,  74,  75,  76,  77,  78,  79,  81,  82,  83,  84,  85,  87,  88,  89,  90,
+	 91,  93,  94,  95,  97,  98,  99, 100, 102, 103, 105, 106, 107, 109, 110, 111,
+	113, 114, 116, 117, 119, 120, 121, 123, 124, 126, 127, 129, 130, 132, 133, 135,
+	137, 138, 140, 141, 143, 145, 146, 148, 149, 151, 153, 154, 156, 158, 159, 161,
+	163, 165, 166, 168, 170, 172, 173, 175, 177, 179, 181, 182, 184, 186, 188, 190,
+	192, 194, 196, 197, 199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219, 221,
+	223, 225, 227, 229, 231, 234, 236, 238, 240, 242, 244, 246, 248, 251, 253, 255,
+};
+
+// One breath, 127.5 - 127.5 * cos(2 * pi * i / 256)
+static const uint8_t animWave[256] PROGMEM = {
+	  0,   0,   0,   0,   1,   1,   1,   2,   2,   3,   4,   5,   5,   6,   7,   9,
+	 10,  11,  12,  14,  15,  17,  18,  20,  21,  23,  25,  27,  29,  31,  33,  35,
+	 37,  40,  42,  44,  47,  49,  52,  54,  57,  59,  62,  65,  67,  70,  73,  76,
+	 79,  82,  85,  88,  90,  93,  97, 100, 103, 106, 109, 112, 115, 118, 121, 124,
+	127, 131, 134, 137, 140, 143, 146, 149, 152, 155, 158, 162, 165, 167, 170, 173,
+	176, 179, 182, 185, 188, 190, 193, 196, 198, 201, 203, 206, 208, 211, 213, 215,
+	218, 220, 222, 224, 226, 228, 230, 232, 234, 235, 237, 238, 240, 241, 243, 244,
+	245, 246, 248, 249, 250, 250, 251, 252, 253, 253, 254, 254, 254, 255, 255, 255,
+	255, 255, 255, 255, 254, 254, 254, 253, 253, 252, 251, 250, 250, 249, 248, 246,
+	245, 244, 243, 241, 240, 238, 237, 235, 234, 232, 230, 228, 226, 224, 222, 220,
+	218, 215, 213, 211, 208, 206, 203, 201, 198, 196, 193, 190, 188, 185, 182, 179,
+	176, 173, 170, 167, 165, 162, 158, 155, 152, 149, 146, 143, 140, 137, 134, 131,
+	128, 124, 121, 118, 115, 112, 109, 106, 103, 100,  97,  93,  90,  88,  85,  82,
+	 79,  76,  73,  70,  67,  65,  62,  59,  57,  54,  52,  49,  47,  44,  42,  40,
+	 37,  35,  33,  31,  29,  27,  25,  23,  21,  20,  18,  17,  15,  14,  12,  11,
+	 10,   9,   7,   6,   5,   5,   4,   3,   2,   2,   1,   1,   1,   0,   0,   0,
+};
+
+static uint8_t animEffect;
+static animColor_t animColor;
+static animColor_t animReactiveColor;
+static uint8_t animPhase;
+static uint8_t animReactive[LED_COUNT];
+static uint32_t animFrameStart;
+
+void anim_init(void) {
+	animEffect = ANIM_EFFECT_STATIC;
+	animColor = (animColor_t){ ANIM_FULL, ANIM_NONE, ANIM_NONE };
+	animReactiveColor = (animColor_t){ ANIM_FULL, ANIM_FULL, ANIM_FULL };
+	animPhase = 0;
+	for (uint8_t i = 0; i < LED_COUNT; i++) {
+		animReactive[i] = 0;
+	}
+	animFrameStart = clock_now();
+}
+
+void anim_set_effect(uint8_t effect, animColor_t color) {
+	animEffect = effect;
+	animColor = color;
+	animPhase = 0;
+}
+
+void anim_set_reactive(animColor_t color) {
+	animReactiveColor = color;
+}
+
+// Flash a pixel to full level, it fades back to the base effect over the next frames
+void anim_key_press(uint8_t pixel) {
+	if (pixel < LED_COUNT) {
+		animReactive[pixel] = 0xFF;
+	}
+}
+
+// Compute and queue the next frame once the frame period has passed, otherwise return right away. Call from the main loop.
+void anim_task(void) {
+	uint32_t now = clock_now();
+	uint8_t base;
+
+	if (((now - animFrameStart) & 0xFFFFFFUL) < ANIM_FRAME_TICKS) {
+		return;
+	}
+	// Frames the main loop missed are dropped rather than caught up
+	animFrameStart = now;
+
+	switch (animEffect) {
+		case ANIM_EFFECT_STATIC:
+			base = 0xFF;
+			break;
+		case ANIM_EFFECT_BREATHING:
+			base = pgm_read_byte(&animWave[animPhase]);
+			animPhase += ANIM_BREATHING_STEP;
+			break;
+		default:
+			base = 0;
+			break;
+	}
+
+	for (uint8_t i = 0; i < LED_COUNT; i++) {
+		const animColor_t *color = &animColor;
+		uint8_t level = base;
+		uint8_t reactive = animReactive[i];
+
+		if (reactive > level) {
+			level = reactive;
+			color = &animReactiveColor;
+		}
+		animReactive[i] = (reactive > ANIM_FADE_STEP) ? reactive - ANIM_FADE_STEP : 0;
+
+		level = pgm_read_byte(&animGamma[level]);
+		led_set(i, level >> (color->red + ANIM_BRIGHTNESS), level >> (color->green + ANIM_BRIGHTNESS),
+			level >> (color->blue + ANIM_BRIGHTNESS));
+	}
+}
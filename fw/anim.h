@@ -0,0 +1,34 @@
+#ifndef ANIM_H
+#define ANIM_H
+
+#include <stdint.h>
+
+#define ANIM_FRAME_MS		20	// 50 frames per second
+#define ANIM_BRIGHTNESS		3	// Global brightness as a right shift, 3 is 1/8 of full
+#define ANIM_BREATHING_STEP	2	// Waveform phase advance per frame, 256 / 2 frames = 2.56 s per breath
+#define ANIM_FADE_STEP		12	// Reactive level drop per frame, about 0.4 s from full to off
+
+// Base effect under the reactive key press flashes
+#define ANIM_EFFECT_OFF			0
+#define ANIM_EFFECT_STATIC		1
+#define ANIM_EFFECT_BREATHING	2
+
+// Color channels are right shifts of the pixel level, so colors cost no multiply
+#define ANIM_FULL		0
+#define ANIM_HALF		1
+#define ANIM_QUARTER	2
+#define ANIM_NONE		8
+
+typedef struct {
+	uint8_t red;
+	uint8_t green;
+	uint8_t blue;
+} animColor_t;
+
+void anim_init(void);
+void anim_set_effect(uint8_t effect, animColor_t color);
+void anim_set_reactive(animColor_t color);
+void anim_key_press(uint8_t pixel);
+void anim_task(void);
+
+#endif
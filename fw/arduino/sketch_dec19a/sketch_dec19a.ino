@@ -1,38 +1,106 @@
 #include <Adafruit_NeoPixel.h>
-#include <Keyboard.h>
+#include <HID.h>
+
+// Same debounce, keymap and report builder as the bare-metal firmware, see fw/core/keypad.h. keypad.h goes first so
+// that the core library is on the include path before keyboard.h is looked up.
+extern "C" {
+#include "keypad.h"
+#include "debounce.h"
+#include "event.h"
+#include "keymap.h"
+#include "keyboard.h"
+#include "bench.h"
+}
 
 #define NEOPIXEL_PIN A2
 #define NUM_PIXELS 1
 
-#define SWITCHA_PIN A1
+#define SWITCHA_PIN A1 // PF6, the same pin the bare-metal firmware scans
+
+#define REPORT_ID 2
 
 Adafruit_NeoPixel strip = Adafruit_NeoPixel(NUM_PIXELS, NEOPIXEL_PIN, NEO_GRB + NEO_KHZ800);
 
+// Boot keyboard report behind a report ID, the layout keyboard_build_report() fills in boot protocol
+static const uint8_t reportDescriptor[] PROGMEM = {
+  0x05, 0x01,       // Usage Page (Generic Desktop)
+  0x09, 0x06,       // Usage (Keyboard)
+  0xA1, 0x01,       // Collection (Application)
+  0x85, REPORT_ID,  //   Report ID
+  0x05, 0x07,       //   Usage Page (Keyboard/Keypad)
+  0x19, 0xE0,       //   Usage Minimum (Left Control)
+  0x29, 0xE7,       //   Usage Maximum (Right GUI)
+  0x15, 0x00,       //   Logical Minimum (0)
+  0x25, 0x01,       //   Logical Maximum (1)
+  0x75, 0x01,       //   Report Size (1)
+  0x95, 0x08,       //   Report Count (8)
+  0x81, 0x02,       //   Input (Data, Variable, Absolute), modifiers
+  0x95, 0x01,       //   Report Count (1)
+  0x75, 0x08,       //   Report Size (8)
+  0x81, 0x03,       //   Input (Constant), reserved
+  0x95, 0x06,       //   Report Count (6)
+  0x75, 0x08,       //   Report Size (8)
+  0x15, 0x00,       //   Logical Minimum (0)
+  0x26, 0xDF, 0x00, //   Logical Maximum (223)
+  0x19, 0x00,       //   Usage Minimum (0)
+  0x29, 0xDF,       //   Usage Maximum (223)
+  0x81, 0x00,       //   Input (Data, Array), keys
+  0xC0              // End Collection
+};
+
+static HIDSubDescriptor reportNode(reportDescriptor, sizeof(reportDescriptor));
+
+// Registered before main() attaches the USB, as the Keyboard library does
+static struct ReportRegistration {
+  ReportRegistration() {
+    HID().AppendDescriptor(&reportNode);
+  }
+} reportRegistration;
+
+static keymap_t keymap; // Defaults only, this front-end has no EEPROM store
+static matrixRow_t pressed;
+static unsigned long lastScan;
+
+static void showKey() {
+  strip.setPixelColor(0, pressed ? 0 : strip.Color(0xff, 0, 0)); // Off while pressed
+  strip.show();
+}
+
 void setup() {
   strip.begin();
   strip.setBrightness(25);
-  strip.setPixelColor(0, 0xff, 0, 0);
-  strip.show(); // Initialize all pixels to 'off'
   pinMode(SWITCHA_PIN, INPUT_PULLUP);
 
-  // Initialize each switch pin as an input
-  pinMode(SWITCHA_PIN, INPUT_PULLUP);
-  // Begin keyboard functionality
-  Keyboard.begin();
+  keymap_reset(&keymap);
+  keymap_init(&keymap);
+  debounce_init();
+  event_init();
+  keyboard_set_protocol(KEYBOARD_PROTOCOL_BOOT); // The descriptor above only has the boot layout
+  showKey();
+  lastScan = micros();
+  BENCH_EVENT(BENCH_SITE_READY);
 }
 
+// One scan every MATRIX_SCAN_PERIOD_US instead of a fixed delay, so that the debounce windows of the core hold
 void loop() {
-  strip.setPixelColor(0, 0xff, 0, 0);
-
-  // turn off LED if not pressed!
-  if (!digitalRead(SWITCHA_PIN)) {
-    strip.setPixelColor(0, 0);
-    Keyboard.press('z');
-  } else {
-    Keyboard.release('z');
+  keyboardReport_t report;
+
+  if (micros() - lastScan < MATRIX_SCAN_PERIOD_US) {
+    return;
   }
-  
-  strip.show();
+  lastScan += MATRIX_SCAN_PERIOD_US;
+
+  BENCH_ENTER(BENCH_SITE_SCAN);
+  matrixRow_t state = debounce_row(0, !digitalRead(SWITCHA_PIN));
+  if (state != pressed) {
+    pressed = state;
+    event_push(0, state & 1); // Drained below on every scan, the queue can not fill up
+  }
+  BENCH_EXIT(BENCH_SITE_SCAN);
 
-  delay(10);
+  if (keyboard_build_report(&report, UDFNUM)) {
+    HID().SendReport(REPORT_ID, &report.boot, sizeof(keyboardBootReport_t));
+    BENCH_EVENT(BENCH_SITE_REPORT);
+    showKey();
+  }
 }
@@ -0,0 +1,244 @@
+/*
+Cycle benchmark of the firmware under simavr.
+
+Runs the bench build of the firmware (BENCH defined, see bench.h), enumerates it through the simavr USB model and
+timestamps every marker the firmware writes to GPIOR0. Then it presses the switch on PF6 at different points of the
+USB frame and measures how long it takes until the report is loaded into the keyboard endpoint. Works for both
+front-ends of the core (see core/keypad.h): the keyboard endpoint is 3 in the bare-metal firmware, 4 in the Arduino
+sketch.
+
+Usage: simbench <firmware.obj> [presses] [keyboard endpoint]
+Output: one tab separated line per hot path, cycles at 16 MHz, then the flash and RAM the image takes in bytes.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_io.h>
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_usb.h>
+#include "../core/bench.h"
+
+#define BENCH_F_CPU			16000000UL
+#define BENCH_GPIOR0		0x3E // Data space address of GPIOR0
+#define BENCH_SITES			8
+#define BENCH_EP0_SIZE		32
+#define BENCH_US(cycles)	((double)(cycles) * 1000000.0 / BENCH_F_CPU)
+
+typedef struct {
+	const char *name;
+	avr_cycle_count_t start;
+	avr_cycle_count_t last; // Previous event, for the period of event sites
+	unsigned long count;
+	avr_cycle_count_t min;
+	avr_cycle_count_t max;
+	double total;
+} benchStat_t;
+
+static benchStat_t benchSites[BENCH_SITES] = {
+	[BENCH_SITE_USB_GEN] = { .name = "usb_gen_isr" },
+	[BENCH_SITE_USB_COM] = { .name = "usb_com_isr" },
+	[BENCH_SITE_SCAN] = { .name = "scan_isr" },
+	[BENCH_SITE_LED] = { .name = "led_show" },
+	[BENCH_SITE_MAIN_LOOP] = { .name = "main_loop" },
+	[BENCH_SITE_REPORT] = { .name = "report_period" },
+};
+static benchStat_t benchLatency = { .name = "press_to_report" };
+static avr_cycle_count_t benchReportCycle = 0;
+static avr_cycle_count_t benchReadyCycle = 0; // Reset to USB attached
+static uint8_t benchKeyboardEndpoint = 3;
+
+static void bench_add(benchStat_t *stat, avr_cycle_count_t cycles) {
+	if (!stat->count || cycles < stat->min) {
+		stat->min = cycles;
+	}
+	if (cycles > stat->max) {
+		stat->max = cycles;
+	}
+	stat->total += cycles;
+	stat->count++;
+}
+
+static void bench_marker(struct avr_t *avr, avr_io_addr_t addr, uint8_t value, void *param) {
+	uint8_t site = value >> 1;
+	benchStat_t *stat;
+
+	if (site == BENCH_SITE_READY && !benchReadyCycle) {
+		benchReadyCycle = avr->cycle;
+	}
+	if (site >= BENCH_SITES || !benchSites[site].name) {
+		return;
+	}
+	stat = &benchSites[site];
+	if (site == BENCH_SITE_MAIN_LOOP || site == BENCH_SITE_REPORT) {
+		if (stat->last) {
+			bench_add(stat, avr->cycle - stat->last);
+		}
+		stat->last = avr->cycle;
+		if (site == BENCH_SITE_REPORT) {
+			benchReportCycle = avr->cycle;
+		}
+	} else if (value & 1) {
+		if (stat->start) {
+			bench_add(stat, avr->cycle - stat->start);
+			stat->start = 0;
+		}
+	} else {
+		stat->start = avr->cycle;
+	}
+}
+
+static void bench_run(avr_t *avr, avr_cycle_count_t cycles) {
+	avr_cycle_count_t end = avr->cycle + cycles;
+
+	while (avr->cycle < end) {
+		int state = avr_run(avr);
+		if (state == cpu_Done || state == cpu_Crashed) {
+			fprintf(stderr, "simbench: firmware stopped (state %d) at cycle %llu\n", state, (unsigned long long)avr->cycle);
+			exit(1);
+		}
+	}
+}
+
+// Issue a USB ioctl, letting the firmware run while the endpoint answers NAK
+static int bench_usb(avr_t *avr, uint32_t request, struct avr_io_usb *io) {
+	uint32_t size = io->sz;
+
+	for (int tries = 0; tries < 10000; tries++) {
+		io->sz = size;
+		int result = avr_ioctl(avr, request, io);
+		if (result != AVR_IOCTL_USB_NAK) {
+			return result;
+		}
+		bench_run(avr, 160); // 10 us
+	}
+	return AVR_IOCTL_USB_NAK;
+}
+
+static int bench_control(avr_t *avr, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wLength, uint8_t *data) {
+	uint8_t setup[8] = { bmRequestType, bRequest, wValue, wValue >> 8, 0, 0, wLength, wLength >> 8 };
+	struct avr_io_usb io = { .pipe = 0, .sz = sizeof(setup), .buf = setup };
+	uint16_t total = 0;
+
+	if (bench_usb(avr, AVR_IOCTL_USB_SETUP, &io) != AVR_IOCTL_USB_OK) {
+		return -1;
+	}
+	if (bmRequestType & 0x80) {
+		while (total < wLength) {
+			io.sz = BENCH_EP0_SIZE;
+			io.buf = data + total;
+			if (bench_usb(avr, AVR_IOCTL_USB_READ, &io) != AVR_IOCTL_USB_OK) {
+				return -1;
+			}
+			total += io.sz;
+			if (io.sz < BENCH_EP0_SIZE) {
+				break;
+			}
+		}
+		io.sz = 0;
+		io.buf = NULL;
+		return (bench_usb(avr, AVR_IOCTL_USB_WRITE, &io) == AVR_IOCTL_USB_OK) ? total : -1;
+	}
+	io.sz = 0;
+	io.buf = NULL;
+	return (bench_usb(avr, AVR_IOCTL_USB_READ, &io) == AVR_IOCTL_USB_OK) ? 0 : -1;
+}
+
+// Take whatever report is waiting in the keyboard endpoint, as the host does once per frame
+static void bench_poll_keyboard(avr_t *avr) {
+	uint8_t report[64];
+	struct avr_io_usb io = { .pipe = benchKeyboardEndpoint, .sz = sizeof(report), .buf = report };
+
+	avr_ioctl(avr, AVR_IOCTL_USB_READ, &io);
+}
+
+static void bench_print(const benchStat_t *stat) {
+	if (!stat->count) {
+		printf("%s\t0\t-\t-\t-\t-\n", stat->name);
+		return;
+	}
+	printf("%s\t%lu\t%llu\t%.1f\t%llu\t%.2f\n", stat->name, stat->count, (unsigned long long)stat->min,
+		stat->total / stat->count, (unsigned long long)stat->max, BENCH_US(stat->max));
+}
+
+int main(int argc, char *argv[]) {
+	elf_firmware_t firmware;
+	uint8_t buffer[256];
+	int presses = (argc > 2) ? atoi(argv[2]) : 50;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <firmware.obj> [presses] [keyboard endpoint]\n", argv[0]);
+		return 2;
+	}
+	if (argc > 3) {
+		benchKeyboardEndpoint = atoi(argv[3]);
+	}
+	memset(&firmware, 0, sizeof(firmware));
+	if (elf_read_firmware(argv[1], &firmware)) {
+		fprintf(stderr, "simbench: cannot read %s\n", argv[1]);
+		return 1;
+	}
+
+	avr_t *avr = avr_make_mcu_by_name("atmega32u4");
+	if (!avr) {
+		fprintf(stderr, "simbench: simavr has no atmega32u4 core\n");
+		return 1;
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &firmware);
+	avr->frequency = BENCH_F_CPU;
+	avr->log = LOG_ERROR;
+	avr_register_io_write(avr, BENCH_GPIOR0, bench_marker, NULL);
+
+	avr_irq_t *key = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('F'), 6);
+	avr_raise_irq(key, 1); // Released, the pull-up holds the line high
+
+	// Boot (the first LED frame goes out from the main loop), then attach and enumerate
+	bench_run(avr, BENCH_F_CPU / 10);
+	avr_ioctl(avr, AVR_IOCTL_USB_VBUS, (void *)1);
+	avr_ioctl(avr, AVR_IOCTL_USB_RESET, NULL);
+	bench_run(avr, BENCH_F_CPU / 1000);
+	if (bench_control(avr, 0x80, 0x06, 0x0100, 18, buffer) != 18
+		|| bench_control(avr, 0x00, 0x05, 0x0001, 0, NULL) != 0
+		|| bench_control(avr, 0x80, 0x06, 0x0200, sizeof(buffer), buffer) < 9
+		|| bench_control(avr, 0x00, 0x09, 0x0001, 0, NULL) != 0) {
+		fprintf(stderr, "simbench: enumeration failed\n");
+		return 1;
+	}
+
+	// Press at a different phase of the 1 ms frame every time, so the average covers the whole frame
+	for (int i = 0; i < presses; i++) {
+		bench_run(avr, (BENCH_F_CPU / 1000) * 20 + (i * 997) % (BENCH_F_CPU / 1000));
+		bench_poll_keyboard(avr);
+
+		avr_raise_irq(key, 0);
+		avr_cycle_count_t pressed = avr->cycle;
+		benchReportCycle = 0;
+		while (!benchReportCycle && avr->cycle - pressed < BENCH_F_CPU / 10) {
+			bench_run(avr, 16);
+		}
+		if (benchReportCycle) {
+			bench_add(&benchLatency, benchReportCycle - pressed);
+		}
+		bench_poll_keyboard(avr);
+
+		bench_run(avr, (BENCH_F_CPU / 1000) * 20);
+		avr_raise_irq(key, 1);
+		bench_run(avr, (BENCH_F_CPU / 1000) * 2);
+		bench_poll_keyboard(avr);
+	}
+
+	printf("site\tcount\tmin_cycles\tmean_cycles\tmax_cycles\tmax_us\n");
+	for (int i = 0; i < BENCH_SITES; i++) {
+		if (benchSites[i].name) {
+			bench_print(&benchSites[i]);
+		}
+	}
+	bench_print(&benchLatency);
+	printf("startup\t1\t%llu\t%llu\t%llu\t%.2f\n", (unsigned long long)benchReadyCycle, (unsigned long long)benchReadyCycle,
+		(unsigned long long)benchReadyCycle, BENCH_US(benchReadyCycle));
+	printf("flash_bytes\t%u\n", (unsigned)firmware.flashsize);
+	printf("ram_bytes\t%u\n", (unsigned)(firmware.datasize + firmware.bsssize)); // Static data only, no stack
+	return 0;
+}
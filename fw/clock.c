@@ -0,0 +1,34 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "clock.h"
+
+// Timer 1 runs freely at clk/8 and overflows every 32.768 ms, the overflow count extends it to 24 bits
+static volatile uint8_t clockOverflows = 0;
+
+void clock_init(void) {
+	TCCR1A = 0; // Normal mode
+	TCCR1B = (1 << CS11); // clk/8
+	TCNT1 = 0;
+	TIMSK1 = (1 << TOIE1);
+}
+
+// 24-bit timestamp in clock ticks, wraps after about 8.4 s. Safe to call with interrupts disabled.
+uint32_t clock_now(void) {
+	uint8_t overflows;
+	uint16_t ticks;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		overflows = clockOverflows;
+		ticks = TCNT1;
+		if ((TIFR1 & (1 << TOV1)) && ticks < 0x8000) {
+			overflows++; // Overflow pending but not serviced yet
+		}
+	}
+	return ((uint32_t)overflows << 16) | ticks;
+}
+
+// Timer 1 overflow Interrupt Service Routine
+ISR(TIMER1_OVF_vect) {
+	clockOverflows++;
+}
@@ -0,0 +1,12 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+
+#define CLOCK_PRESCALER		8
+#define CLOCK_TICKS_PER_US	(F_CPU / CLOCK_PRESCALER / 1000000UL) // 2 ticks per microsecond at 16 MHz
+
+void clock_init(void);
+uint32_t clock_now(void);
+
+#endif
@@ -0,0 +1,155 @@
+#include "console.h"
+#include "uart.h"
+#include "profile.h"
+#include "store.h"
+
+#define CONSOLE_ARGUMENTS	3
+#define CONSOLE_IDLE		0xFF // consoleListing value when no listing is in progress
+
+static char consoleLine[CONSOLE_LINE_MAX + 1];
+static uint8_t consoleLength = 0;
+static uint8_t consoleListing = CONSOLE_IDLE; // Next line of the profiler listing
+
+static void console_print_number(uint32_t number) {
+	char digits[11];
+	uint8_t i = sizeof(digits) - 1;
+
+	digits[i] = '\0';
+	do {
+		digits[--i] = '0' + number % 10;
+		number /= 10;
+	} while (number);
+	uart_transmit(' ');
+	uart_print(&digits[i]);
+}
+
+static void console_print_hex(uint8_t number) {
+	static const char hex[] = "0123456789abcdef";
+
+	uart_transmit(' ');
+	uart_transmit(hex[number >> 4]);
+	uart_transmit(hex[number & 0x0F]);
+}
+
+// One line of the profiler listing per call, so the listing never overruns the transmit buffer
+static void console_list_profile(void) {
+	profileReport_t report;
+
+	if (consoleListing < PROFILE_SITES) {
+		profile_copy_report(PROFILE_REPORT_SITE(consoleListing), &report);
+		uart_transmit('0' + consoleListing);
+		console_print_number(report.site.site.count);
+		console_print_number(report.site.site.count ? report.site.site.min : 0);
+		console_print_number(report.site.site.count ? report.site.site.total / report.site.site.count : 0);
+		console_print_number(report.site.site.max);
+		consoleListing++;
+	} else {
+		profile_copy_report(PROFILE_REPORT_COUNTERS, &report);
+		uart_transmit('c');
+		for (uint8_t i = 0; i < PROFILE_COUNTERS; i++) {
+			console_print_number(report.counters.counters[i]);
+		}
+		consoleListing = CONSOLE_IDLE;
+	}
+	uart_print("\r\n");
+}
+
+// Parse up to CONSOLE_ARGUMENTS hexadecimal bytes after the command letter, returns how many there were or
+// CONSOLE_IDLE on a malformed line
+static uint8_t console_arguments(uint8_t *arguments) {
+	uint8_t count = 0;
+	const char *c = &consoleLine[1];
+
+	while (1) {
+		while (*c == ' ') {
+			c++;
+		}
+		if (!*c) {
+			return count;
+		}
+		if (count == CONSOLE_ARGUMENTS) {
+			return CONSOLE_IDLE;
+		}
+		uint16_t value = 0;
+		for (; *c && *c != ' '; c++) {
+			char digit = *c | 0x20; // Lower case
+			if (digit >= '0' && digit <= '9') {
+				value = (value << 4) | (digit - '0');
+			} else if (digit >= 'a' && digit <= 'f') {
+				value = (value << 4) | (digit - 'a' + 10);
+			} else {
+				return CONSOLE_IDLE;
+			}
+			if (value > 0xFF) {
+				return CONSOLE_IDLE;
+			}
+		}
+		arguments[count++] = value;
+	}
+}
+
+static void console_execute(void) {
+	uint8_t arguments[CONSOLE_ARGUMENTS];
+	uint8_t count = console_arguments(arguments);
+
+	switch (consoleLine[0]) {
+		case 'p':
+			if (count == 0) {
+				consoleListing = 0; // Printed by console_task()
+				return;
+			}
+		break;
+		case 'r':
+			if (count == 0) {
+				profile_reset();
+				uart_print("ok\r\n");
+				return;
+			}
+		break;
+		case 'k':
+			if ((count == 2 || count == 3) && arguments[0] < KEYMAP_LAYERS && arguments[1] < KEYMAP_KEYS) {
+				if (count == 3) {
+					storeData.keymap[arguments[0]][arguments[1]] = arguments[2];
+					store_changed();
+				}
+				uart_print("k");
+				console_print_hex(storeData.keymap[arguments[0]][arguments[1]]);
+				uart_print("\r\n");
+				return;
+			}
+		break;
+		case '\0':
+			return; // Empty line
+	}
+	uart_print("?\r\n");
+}
+
+// Called from the main loop: reads the received characters and runs a command on every line end
+void console_task(void) {
+	uint8_t c;
+
+	if (consoleListing != CONSOLE_IDLE) {
+		if (uart_tx_free() >= CONSOLE_REPLY_MAX) {
+			console_list_profile();
+		}
+		return; // The next command waits for the listing
+	}
+	while (uart_tx_free() >= CONSOLE_REPLY_MAX && uart_read(&c)) {
+		if (c == '\r' || c == '\n') {
+			if (c == '\r' || consoleLength) {
+				uart_print("\r\n");
+			}
+			consoleLine[consoleLength] = '\0';
+			consoleLength = 0;
+			console_execute();
+			return;
+		}
+		if ((c == '\b' || c == 0x7F) && consoleLength) {
+			consoleLength--;
+			uart_print("\b \b");
+		} else if (c >= ' ' && consoleLength < CONSOLE_LINE_MAX) {
+			consoleLine[consoleLength++] = c;
+			uart_transmit(c); // Echo
+		}
+	}
+}
@@ -0,0 +1,23 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <stdint.h>
+
+/*
+Line based commands on the serial console (uart.h), one letter and hexadecimal arguments:
+
+  p                    profiler statistics, one line per site: site count min mean max (ticks, see clock.h),
+                       then the counters after a 'c'
+  r                    reset the profiler
+  k <layer> <key>      print the keymap entry
+  k <layer> <key> <code>  remap the key, committed to the EEPROM by store_task()
+
+Every command is answered with one line at least, "?" for anything not understood.
+*/
+
+#define CONSOLE_LINE_MAX		32 // Characters of a command line
+#define CONSOLE_REPLY_MAX		64 // Longest reply line, printed only once the transmit buffer has room for it
+
+void console_task(void);
+
+#endif
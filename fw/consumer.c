@@ -0,0 +1,42 @@
+#include <avr/pgmspace.h>
+#include "consumer.h"
+#include "keyboard.h"
+#include "keymap.h"
+
+// Consumer page usages of KEY_MEDIA(0) to KEY_MEDIA(7), see HID Usage Tables Section 15
+static const uint16_t consumerUsages[] PROGMEM = {
+	0x00E2, // Mute
+	0x00E9, // Volume Increment
+	0x00EA, // Volume Decrement
+	0x00CD, // Play/Pause
+	0x00B5, // Scan Next Track
+	0x00B6, // Scan Previous Track
+	0x00B7, // Stop
+	0x0192, // AL Calculator
+};
+
+static consumerReport_t consumerLastReport;
+
+// The first media key held down wins. Returns the report length in bytes, or zero when nothing changed.
+uint8_t consumer_build_report(consumerReport_t *report) {
+	const uint8_t *codes = keyboard_codes();
+
+	report->usage = 0;
+	for (uint8_t key = 0; key < KEYMAP_KEYS; key++) {
+		if (KEY_IS_MEDIA(codes[key])) {
+			report->usage = pgm_read_word(&consumerUsages[codes[key] & 7]);
+			break;
+		}
+	}
+	if (report->usage == consumerLastReport.usage) {
+		return 0;
+	}
+	consumerLastReport = *report;
+	return sizeof(consumerReport_t);
+}
+
+// Copy of the last report built, for GET_REPORT. Returns its length in bytes.
+uint8_t consumer_copy_report(consumerReport_t *report) {
+	*report = consumerLastReport;
+	return sizeof(consumerReport_t);
+}
@@ -0,0 +1,14 @@
+#ifndef CONSUMER_H
+#define CONSUMER_H
+
+#include <stdint.h>
+
+// Consumer control (media keys) input report: one usage of the Consumer page (0x0C), zero when no key is held
+typedef struct {
+	uint16_t usage;
+} __attribute__((packed)) consumerReport_t;
+
+uint8_t consumer_build_report(consumerReport_t *report);
+uint8_t consumer_copy_report(consumerReport_t *report);
+
+#endif
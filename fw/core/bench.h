@@ -0,0 +1,29 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+Markers for the cycle benchmark (make bench). The simavr harness in bench/ timestamps every write to GPIOR0, an
+enter/exit pair gives the length of a hot path and an event marks a point on the press to report path.
+Outside of the bench build the markers compile to nothing.
+*/
+
+#define BENCH_SITE_USB_GEN		1 // ISR(USB_GEN_vect)
+#define BENCH_SITE_USB_COM		2 // ISR(USB_COM_vect)
+#define BENCH_SITE_SCAN			3 // Matrix scan tick
+#define BENCH_SITE_LED			4 // led_show()
+#define BENCH_SITE_MAIN_LOOP	5 // One pass of the main loop (event)
+#define BENCH_SITE_REPORT		6 // Keyboard report loaded into the endpoint bank (event)
+#define BENCH_SITE_READY		7 // USB attached at the end of the startup (event)
+
+#ifdef BENCH
+#include <avr/io.h>
+#define BENCH_ENTER(site)	(GPIOR0 = ((site) << 1))
+#define BENCH_EXIT(site)	(GPIOR0 = ((site) << 1) | 1)
+#define BENCH_EVENT(site)	BENCH_ENTER(site)
+#else
+#define BENCH_ENTER(site)	do {} while (0)
+#define BENCH_EXIT(site)	do {} while (0)
+#define BENCH_EVENT(site)	do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,96 @@
+#include <stdint.h>
+#include "debounce.h"
+
+#if DEBOUNCE_MODE != DEBOUNCE_EAGER && DEBOUNCE_MODE != DEBOUNCE_DEFERRED
+#error "DEBOUNCE_MODE must be DEBOUNCE_EAGER or DEBOUNCE_DEFERRED"
+#endif
+
+#if DEBOUNCE_TICKS < 1
+#error "DEBOUNCE_MS must cover at least one scan period"
+#elif DEBOUNCE_TICKS <= 3
+#define DEBOUNCE_COUNTER_BITS 2
+#elif DEBOUNCE_TICKS <= 7
+#define DEBOUNCE_COUNTER_BITS 3
+#elif DEBOUNCE_TICKS <= 15
+#define DEBOUNCE_COUNTER_BITS 4
+#else
+#error "DEBOUNCE_MS is too long for the scan period"
+#endif
+
+/*
+Vertical counters: every key of a row owns one bit in each counter plane, so plane[0] holds the
+least significant counter bit of all keys of the row, plane[1] the next one and so on. Counting
+a whole row is then a handful of word wide logic operations, no matter how many columns it has.
+*/
+typedef struct {
+	matrixRow_t plane[DEBOUNCE_COUNTER_BITS];
+	matrixRow_t state; // Debounced key state
+} debounceRow_t;
+
+static debounceRow_t debounceRows[MATRIX_ROWS];
+
+// Mask of the keys whose counter is zero
+static inline matrixRow_t debounce_zero(const debounceRow_t *d) {
+	matrixRow_t any = 0;
+	for (uint8_t i = 0; i < DEBOUNCE_COUNTER_BITS; i++) {
+		any |= d->plane[i];
+	}
+	return ~any;
+}
+
+// Count down by one the keys in mask, their counters must be non-zero
+static inline void debounce_decrement(debounceRow_t *d, matrixRow_t mask) {
+	matrixRow_t borrow = mask;
+	for (uint8_t i = 0; i < DEBOUNCE_COUNTER_BITS; i++) {
+		matrixRow_t bit = d->plane[i];
+		d->plane[i] = bit ^ borrow;
+		borrow &= ~bit; // The borrow ripples further up only through bits that were zero
+	}
+}
+
+// Load the counters of the keys in mask with the full debounce window
+static inline void debounce_reload(debounceRow_t *d, matrixRow_t mask) {
+	for (uint8_t i = 0; i < DEBOUNCE_COUNTER_BITS; i++) {
+		if (DEBOUNCE_TICKS & (1 << i)) {
+			d->plane[i] |= mask;
+		} else {
+			d->plane[i] &= ~mask;
+		}
+	}
+}
+
+void debounce_init(void) {
+	for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+		debounceRows[row].state = 0;
+#if DEBOUNCE_MODE == DEBOUNCE_EAGER
+		for (uint8_t i = 0; i < DEBOUNCE_COUNTER_BITS; i++) {
+			debounceRows[row].plane[i] = 0; // Nothing locked out
+		}
+#else
+		debounce_reload(&debounceRows[row], (matrixRow_t)~0);
+#endif
+	}
+}
+
+// Feed one raw scan of a row and get back its debounced state
+matrixRow_t debounce_row(uint8_t row, matrixRow_t raw) {
+	debounceRow_t *d = &debounceRows[row];
+	matrixRow_t delta = raw ^ d->state;
+
+#if DEBOUNCE_MODE == DEBOUNCE_EAGER
+	matrixRow_t idle = debounce_zero(d);
+	matrixRow_t accept = delta & idle; // First edge of a key that is not locked out
+
+	debounce_decrement(d, ~idle);
+	debounce_reload(d, accept);
+#else
+	debounce_reload(d, ~delta); // Any bounce back restarts the window
+	debounce_decrement(d, delta);
+
+	matrixRow_t accept = delta & debounce_zero(d);
+
+	debounce_reload(d, accept);
+#endif
+	d->state ^= accept;
+	return d->state;
+}
@@ -0,0 +1,22 @@
+#ifndef DEBOUNCE_H
+#define DEBOUNCE_H
+
+#include "keypad.h"
+
+#define DEBOUNCE_EAGER		1 // Report the first edge right away, then ignore the key for the lockout window
+#define DEBOUNCE_DEFERRED	2 // Report a change only once the key has been stable for the whole window
+
+#ifndef DEBOUNCE_MODE
+#define DEBOUNCE_MODE DEBOUNCE_EAGER
+#endif
+
+#ifndef DEBOUNCE_MS
+#define DEBOUNCE_MS 5 // Per-key lockout (eager) or settle (deferred) window
+#endif
+
+#define DEBOUNCE_TICKS ((DEBOUNCE_MS * 1000UL + MATRIX_SCAN_PERIOD_US - 1) / MATRIX_SCAN_PERIOD_US)
+
+void debounce_init(void);
+matrixRow_t debounce_row(uint8_t row, matrixRow_t raw);
+
+#endif
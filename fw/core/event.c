@@ -0,0 +1,64 @@
+#include <avr/io.h>
+#include "event.h"
+#include "keymap.h"
+
+#if EVENT_QUEUE_SIZE & (EVENT_QUEUE_SIZE - 1) || EVENT_QUEUE_SIZE > 128
+#error "EVENT_QUEUE_SIZE must be a power of two no larger than 128"
+#endif
+
+#if KEYMAP_KEYS > 256
+#error "Key numbers do not fit in event_t"
+#endif
+
+static event_t eventQueue[EVENT_QUEUE_SIZE];
+static volatile uint8_t eventHead = 0; // Next slot to write, producer only, free running
+static volatile uint8_t eventTail = 0; // Next slot to read, consumer only, free running
+
+// Only safe while neither side runs, i.e. before the scan timer is started
+void event_init(void) {
+	eventHead = 0;
+	eventTail = 0;
+}
+
+// Producer side. Returns zero if the queue is full and the event was dropped, the caller decides whether that counts.
+uint8_t event_push(uint8_t key, uint8_t pressed) {
+	uint8_t head = eventHead;
+
+	if ((uint8_t)(head - eventTail) == EVENT_QUEUE_SIZE) {
+		return 0;
+	}
+	event_t *event = &eventQueue[head & (EVENT_QUEUE_SIZE - 1)];
+	event->key = key;
+	event->pressed = pressed;
+	event->frame = UDFNUM & EVENT_FRAME_MASK;
+	eventHead = head + 1; // Publish only once the slot is complete
+	return 1;
+}
+
+// Non-zero while events wait, for the main loop, which only looks
+uint8_t event_pending(void) {
+	return eventHead != eventTail;
+}
+
+// Consumer side, the oldest event without taking it. Returns zero if there is no event.
+uint8_t event_peek(event_t *event) {
+	uint8_t tail = eventTail;
+
+	if (tail == eventHead) {
+		return 0;
+	}
+	*event = eventQueue[tail & (EVENT_QUEUE_SIZE - 1)];
+	return 1;
+}
+
+// Consumer side. Returns zero if there is no event.
+uint8_t event_pop(event_t *event) {
+	uint8_t tail = eventTail;
+
+	if (tail == eventHead) {
+		return 0;
+	}
+	*event = eventQueue[tail & (EVENT_QUEUE_SIZE - 1)];
+	eventTail = tail + 1; // Hand the slot back only once it has been copied
+	return 1;
+}
@@ -0,0 +1,27 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdint.h>
+
+/*
+Key events from the matrix scan (producer) to the report builder on SOF (consumer). Single producer, single
+consumer: each index is written by one side only and is a single byte, so neither side needs to disable interrupts.
+With SPLIT the SOF interrupt also pushes the keys of the other half, it never nests with the scan interrupt.
+*/
+
+#define EVENT_QUEUE_SIZE	16 // Events, power of two
+#define EVENT_FRAME_MASK	0x07FF // USB frame numbers are 11 bits
+
+typedef struct {
+	uint8_t key; // row * MATRIX_COLS + col, see KEYMAP_KEYS
+	uint8_t pressed;
+	uint16_t frame; // UDFNUM when the scan detected the change
+} event_t;
+
+void event_init(void);
+uint8_t event_push(uint8_t key, uint8_t pressed);
+uint8_t event_peek(event_t *event);
+uint8_t event_pop(event_t *event);
+uint8_t event_pending(void);
+
+#endif
@@ -0,0 +1,137 @@
+#include <string.h>
+#include "keyboard.h"
+#include "keymap.h"
+#include "macro.h"
+#include "event.h"
+#include "trace.h"
+
+#define USAGE_ERROR_ROLLOVER	0x01
+#define USAGE_MODIFIER_FIRST	0xE0 // Left Control
+#define USAGE_MODIFIER_LAST		0xE7 // Right GUI
+
+volatile uint8_t keyboardProtocol = KEYBOARD_PROTOCOL_REPORT;
+
+static uint8_t keyboardCodes[KEYMAP_KEYS]; // Code each key was pressed with, KEY_NONE while up
+static keyboardReport_t keyboardLastReport;
+static uint8_t keyboardResend = 0; // Send the next report even if nothing changed
+
+static uint8_t keyboard_report_length(void) {
+	return (keyboardProtocol == KEYBOARD_PROTOCOL_BOOT) ? sizeof(keyboardBootReport_t) : sizeof(keyboardNkroReport_t);
+}
+
+void keyboard_set_protocol(uint8_t protocol) {
+	keyboardProtocol = protocol;
+	memset(&keyboardLastReport, 0, sizeof(keyboardReport_t));
+	keyboardResend = 1; // The host expects the next report in the new format
+}
+
+// Add a held usage to the report, keyCount counts the boot protocol key slots used
+static void keyboard_add_usage(keyboardReport_t *report, uint8_t usage, uint8_t *keyCount) {
+	if (!KEY_IS_USAGE(usage)) {
+		return;
+	}
+	if (usage >= USAGE_MODIFIER_FIRST && usage <= USAGE_MODIFIER_LAST) {
+		report->boot.modifiers |= (1 << (usage - USAGE_MODIFIER_FIRST)); // Same offset in both formats
+	} else if (keyboardProtocol == KEYBOARD_PROTOCOL_BOOT) {
+		if (*keyCount < KEYBOARD_REPORT_KEYS) {
+			report->boot.keys[*keyCount] = usage;
+		}
+		(*keyCount)++;
+	} else if (usage < KEYBOARD_NKRO_BYTES * 8) {
+		report->nkro.keys[usage >> 3] |= (1 << (usage & 7));
+	}
+}
+
+static void keyboard_fill_report(keyboardReport_t *report) {
+	const uint8_t *macroUsages;
+	uint8_t macroCount = macro_held(&macroUsages);
+	uint8_t keyCount = 0;
+
+	memset(report, 0, sizeof(keyboardReport_t));
+	for (uint8_t key = 0; key < KEYMAP_KEYS; key++) {
+		keyboard_add_usage(report, keyboardCodes[key], &keyCount);
+	}
+	for (uint8_t i = 0; i < macroCount; i++) {
+		keyboard_add_usage(report, macroUsages[i], &keyCount);
+	}
+	if (keyCount > KEYBOARD_REPORT_KEYS) {
+		memset(report->boot.keys, USAGE_ERROR_ROLLOVER, KEYBOARD_REPORT_KEYS); // Too many keys for the boot report
+	}
+}
+
+// The next keyboard_build_report() returns the report even if nothing changed, used for the HID idle rate
+void keyboard_repeat_report(void) {
+	keyboardResend = 1;
+}
+
+// Non-zero while the next report may differ from the last one: key events are queued, a macro plays or a repeat is due
+uint8_t keyboard_report_pending(void) {
+	return keyboardResend || event_pending() || macro_playing();
+}
+
+/*
+Apply the macro actions of this frame, then the queued key events. Returns the report length in bytes, or zero when
+nothing changed. Only called when the endpoint has a free bank, so a macro advances exactly one step per report.
+Keys changed together, a chord, go out in one report. The frame stops before an event of a key already changed in
+it, so a press and release caught in the same frame become two reports in two frames rather than cancelling out.
+Media and mouse keys, whose reports are built from keyboardCodes right after this one, end the frame as well.
+frame is the current UDFNUM.
+*/
+uint8_t keyboard_build_report(keyboardReport_t *report, uint16_t frame) {
+	uint8_t length = keyboard_report_length();
+	uint8_t touched[KEYBOARD_TOUCHED_MAX];
+	uint8_t touchedCount = 0;
+	event_t event;
+
+	macro_step();
+	while (touchedCount < KEYBOARD_TOUCHED_MAX && event_peek(&event)) {
+		uint8_t again = 0;
+		for (uint8_t i = 0; i < touchedCount; i++) {
+			again |= (touched[i] == event.key);
+		}
+		if (again) {
+			break;
+		}
+		event_pop(&event);
+		touched[touchedCount++] = event.key;
+
+		// A key keeps the code it was pressed with until released, whatever happens to the layers meanwhile
+		uint8_t code;
+		if (event.pressed) {
+			code = keymap_lookup(event.key);
+			keyboardCodes[event.key] = code;
+			keymap_press(code);
+			if (KEY_IS_MACRO(code)) {
+				macro_start(code & 7);
+			}
+		} else {
+			code = keyboardCodes[event.key];
+			keymap_release(code);
+			keyboardCodes[event.key] = KEY_NONE;
+		}
+		TRACE_DEBUG(TRACE_KEY_EVENT, event.key, event.pressed, (frame - event.frame) & EVENT_FRAME_MASK);
+		if (KEY_IS_MEDIA(code) || KEY_IS_MOUSE(code)) {
+			break;
+		}
+	}
+	keyboard_fill_report(report);
+	if (memcmp(report, &keyboardLastReport, length) == 0 && !keyboardResend) {
+		return 0;
+	}
+	keyboardResend = 0;
+	memcpy(&keyboardLastReport, report, length);
+	return length;
+}
+
+// Code each key is held with (KEYMAP_KEYS entries), for the reports of the other interfaces
+const uint8_t *keyboard_codes(void) {
+	return keyboardCodes;
+}
+
+// Copy of the last report built, for GET_REPORT. Returns its length in bytes.
+uint8_t keyboard_copy_report(keyboardReport_t *report) {
+	uint8_t length = keyboard_report_length();
+
+	memcpy(report, &keyboardLastReport, length);
+	return length;
+}
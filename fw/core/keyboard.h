@@ -0,0 +1,40 @@
+#ifndef KEYBOARD_H
+#define KEYBOARD_H
+
+#include <stdint.h>
+
+#define KEYBOARD_PROTOCOL_BOOT		0 // See Device Class Definition for HID Section 7.2.6
+#define KEYBOARD_PROTOCOL_REPORT	1
+
+#define KEYBOARD_REPORT_KEYS	6
+#define KEYBOARD_NKRO_BYTES		15 // Bitmap of the usages 0x00 to 0x77
+#define KEYBOARD_TOUCHED_MAX	8 // Key changes packed into one report
+
+// Boot protocol keyboard input report, see Device Class Definition for HID Appendix B.1
+typedef struct {
+	uint8_t modifiers;
+	uint8_t reserved;
+	uint8_t keys[KEYBOARD_REPORT_KEYS];
+} __attribute__((packed)) keyboardBootReport_t;
+
+// Report protocol input report, one bit per usage so that any number of keys can be held down together
+typedef struct {
+	uint8_t modifiers;
+	uint8_t keys[KEYBOARD_NKRO_BYTES];
+} __attribute__((packed)) keyboardNkroReport_t;
+
+typedef union {
+	keyboardBootReport_t boot;
+	keyboardNkroReport_t nkro;
+} keyboardReport_t;
+
+extern volatile uint8_t keyboardProtocol;
+
+void keyboard_set_protocol(uint8_t protocol);
+void keyboard_repeat_report(void);
+uint8_t keyboard_report_pending(void);
+uint8_t keyboard_build_report(keyboardReport_t *report, uint16_t frame);
+uint8_t keyboard_copy_report(keyboardReport_t *report);
+const uint8_t *keyboard_codes(void);
+
+#endif
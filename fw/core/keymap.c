@@ -0,0 +1,91 @@
+#include <avr/pgmspace.h>
+#include <string.h>
+#include "keymap.h"
+
+#if KEYMAP_LAYERS > 8
+#error "Layer codes and the layer mask hold 8 layers"
+#endif
+
+/*
+One dense table per layer indexed by matrix position. A lookup reads the topmost active layer only, plus the base
+layer for a transparent key, so it costs the same whatever the number of layers. The topmost layer is worked out
+once when the layer mask changes.
+
+The tables here are the defaults. Lookups read the table the front-end passes to keymap_init(): the bare-metal
+firmware passes storeData.keymap, which the EEPROM store loads at boot and the host can remap.
+*/
+static const uint8_t keymapDefaults[KEYMAP_LAYERS][SPLIT_HALVES][MATRIX_ROWS][MATRIX_COLS] PROGMEM = {
+	{ // Base layer
+		{ { KEY_Z } },
+#if SPLIT
+		{ { KEY_C } }, // Other half
+#endif
+	},
+	{ // Layer 1
+		{ { KEY_X } },
+#if SPLIT
+		{ { KEY_V } },
+#endif
+	},
+};
+
+static keymap_t *keymapTable;
+static uint8_t keymapLayerMask = 1; // Bit n set while layer n is active, the base layer always is
+static uint8_t keymapTopLayer = 0;
+
+static void keymap_update(void) {
+	uint8_t layer = KEYMAP_LAYERS - 1;
+
+	keymapLayerMask |= 1; // The base layer can not be switched off
+	while (!(keymapLayerMask & (1 << layer))) {
+		layer--;
+	}
+	keymapTopLayer = layer;
+}
+
+// Replace a RAM keymap with the defaults, when the EEPROM holds none
+void keymap_reset(keymap_t *table) {
+	memcpy_P(*table, keymapDefaults, sizeof(keymap_t));
+}
+
+void keymap_init(keymap_t *table) {
+	keymapTable = table;
+	keymapLayerMask = 1;
+	keymap_update();
+}
+
+// Code of a key on the current layers
+uint8_t keymap_lookup(uint8_t key) {
+	uint8_t code = (*keymapTable)[keymapTopLayer][key];
+
+	if (code == KEY_TRANSPARENT) {
+		code = (*keymapTable)[0][key];
+	}
+	return (code == KEY_TRANSPARENT) ? KEY_NONE : code;
+}
+
+// Layer side of a key press, pass the code the key was looked up with. Usages are ignored.
+void keymap_press(uint8_t code) {
+	if (!KEY_IS_LAYER(code) || (code & 7) >= KEYMAP_LAYERS) {
+		return;
+	}
+	if (code < KEY_TOGGLE(0)) {
+		keymapLayerMask |= (1 << (code & 7));
+	} else {
+		keymapLayerMask ^= (1 << (code & 7));
+	}
+	keymap_update();
+}
+
+// Layer side of a key release, pass the code the key was pressed with so that layers can not get stuck
+void keymap_release(uint8_t code) {
+	if (code < KEY_MOMENTARY(0) || code >= KEY_TOGGLE(0) || (code & 7) >= KEYMAP_LAYERS) {
+		return;
+	}
+	keymapLayerMask &= ~(1 << (code & 7));
+	keymap_update();
+}
+
+uint8_t keymap_layers(void) {
+	return keymapLayerMask;
+}
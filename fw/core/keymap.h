@@ -0,0 +1,53 @@
+#ifndef KEYMAP_H
+#define KEYMAP_H
+
+#include <stdint.h>
+#include "keypad.h"
+#include "keycode.h"
+
+#define KEYMAP_LAYERS	2 // Up to 8
+#define KEYMAP_KEYS		(SPLIT_HALVES * MATRIX_ROWS * MATRIX_COLS) // Keys are numbered row * MATRIX_COLS + col, the other half of a split keypad follows
+
+// Codes besides the HID usages of keycode.h. The ranges are unused on the keyboard page.
+#define KEY_TRANSPARENT		0x01 // Same as the base layer (0x01 is ErrorRollOver, never produced by a key)
+#define KEY_MEDIA(usage)		(0xA8 | (usage)) // Consumer control usage, see consumer.c (0xA5 to 0xAF are reserved)
+#define KEY_IS_MEDIA(code)		(((code) & 0xF8) == 0xA8)
+#define KEY_MOUSE(action)		(0xD0 | (action)) // Mouse key, see mouse.c (keypad memory and base keys, not in the NKRO range)
+#define KEY_IS_MOUSE(code)		(((code) & 0xF0) == 0xD0)
+#define KEY_MACRO(macro)		(0xE8 | (macro)) // Plays a macro on press, see macro.c
+#define KEY_IS_MACRO(code)		(((code) & 0xF8) == 0xE8)
+#define KEY_MOMENTARY(layer)	(0xF0 | (layer)) // Layer active while the key is held
+#define KEY_TOGGLE(layer)		(0xF8 | (layer)) // Layer switched on or off on every press
+#define KEY_IS_LAYER(code)		((code) >= 0xF0)
+#define KEY_IS_USAGE(code)		((code) > KEY_TRANSPARENT && (code) < KEY_MACRO(0) && !KEY_IS_MEDIA(code) && !KEY_IS_MOUSE(code))
+
+#define KEY_MEDIA_MUTE			KEY_MEDIA(0)
+#define KEY_MEDIA_VOLUME_UP		KEY_MEDIA(1)
+#define KEY_MEDIA_VOLUME_DOWN	KEY_MEDIA(2)
+#define KEY_MEDIA_PLAY_PAUSE	KEY_MEDIA(3)
+#define KEY_MEDIA_NEXT			KEY_MEDIA(4)
+#define KEY_MEDIA_PREVIOUS		KEY_MEDIA(5)
+#define KEY_MEDIA_STOP			KEY_MEDIA(6)
+#define KEY_MEDIA_CALCULATOR	KEY_MEDIA(7)
+
+#define KEY_MOUSE_UP			KEY_MOUSE(0)
+#define KEY_MOUSE_DOWN			KEY_MOUSE(1)
+#define KEY_MOUSE_LEFT			KEY_MOUSE(2)
+#define KEY_MOUSE_RIGHT			KEY_MOUSE(3)
+#define KEY_MOUSE_BUTTON1		KEY_MOUSE(4) // Left
+#define KEY_MOUSE_BUTTON2		KEY_MOUSE(5) // Right
+#define KEY_MOUSE_BUTTON3		KEY_MOUSE(6) // Middle
+#define KEY_MOUSE_WHEEL_UP		KEY_MOUSE(7)
+#define KEY_MOUSE_WHEEL_DOWN	KEY_MOUSE(8)
+
+// Dense keymap kept in RAM so that it can be remapped at run time, the front-end owns it (storeData in fw/, see store.h)
+typedef uint8_t keymap_t[KEYMAP_LAYERS][KEYMAP_KEYS];
+
+void keymap_reset(keymap_t *table);
+void keymap_init(keymap_t *table);
+uint8_t keymap_lookup(uint8_t key);
+void keymap_press(uint8_t code);
+void keymap_release(uint8_t code);
+uint8_t keymap_layers(void);
+
+#endif
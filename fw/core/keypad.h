@@ -0,0 +1,33 @@
+#ifndef KEYPAD_H
+#define KEYPAD_H
+
+#include <stdint.h>
+
+/*
+Shape of the keypad, shared by the core library in this directory and both front-ends that build against it: the
+bare-metal firmware in fw/ and the Arduino sketch in fw/arduino/. The core holds the debounce, the event queue, the
+keymap and the report builder. It touches no peripheral besides reading UDFNUM, each front-end scans the matrix,
+pushes the key events and sends the reports it builds.
+*/
+
+#define MATRIX_ROWS 1
+#define MATRIX_COLS 1
+
+#define MATRIX_SCAN_PERIOD_US 1000 // Scan period of the front-end, the debounce windows count in scans
+
+#if MATRIX_COLS <= 8
+typedef uint8_t matrixRow_t;
+#elif MATRIX_COLS <= 16
+typedef uint16_t matrixRow_t;
+#else
+#error "MATRIX_COLS larger than 16 is not supported"
+#endif
+
+#ifndef SPLIT
+#define SPLIT 0 // 1: USART1 carries the split link, the console is then only available with USB_CDC
+#endif
+
+#define SPLIT_HALVES		(SPLIT ? 2 : 1)
+#define SPLIT_KEY_OFFSET	(MATRIX_ROWS * MATRIX_COLS) // Key number of the first key of the other half
+
+#endif
@@ -0,0 +1,122 @@
+#include <avr/pgmspace.h>
+#include <stddef.h>
+#include "macro.h"
+#include "keycode.h"
+
+#define MACRO_OP_PRESS		0x01
+#define MACRO_OP_RELEASE	0x02
+#define MACRO_OP_TAP		0x03
+#define MACRO_OP_DELAY		0x04
+
+static const uint8_t macroHello[] PROGMEM = {
+	MACRO_PRESS(KEY_LEFT_SHIFT), MACRO_TAP(KEY_H), MACRO_RELEASE(KEY_LEFT_SHIFT),
+	MACRO_TAP(KEY_E), MACRO_TAP(KEY_L), MACRO_TAP(KEY_L), MACRO_TAP(KEY_O), MACRO_TAP(KEY_ENTER),
+	MACRO_END
+};
+
+// Played by the keymap code KEY_MACRO(n)
+static const uint8_t * const macroTable[] PROGMEM = {
+	macroHello,
+};
+
+#define MACRO_COUNT (sizeof(macroTable) / sizeof(macroTable[0]))
+
+static const uint8_t *macroNext = NULL; // Next action in flash, NULL when no macro is playing
+static uint8_t macroDelay;
+static uint8_t macroTapDown; // The TAP at macroNext has pressed its key and still has to release it
+static uint8_t macroHeld[MACRO_HELD_MAX];
+static uint8_t macroHeldCount = 0;
+
+// Start a macro unless one is playing already
+void macro_start(uint8_t macro) {
+	if (macroNext || macro >= MACRO_COUNT) {
+		return;
+	}
+	macroNext = pgm_read_ptr(&macroTable[macro]);
+	macroDelay = 0;
+	macroTapDown = 0;
+}
+
+static uint8_t macro_press(uint8_t usage) {
+	if (macroHeldCount >= MACRO_HELD_MAX) {
+		return 0;
+	}
+	macroHeld[macroHeldCount++] = usage;
+	return 1;
+}
+
+static void macro_release(uint8_t usage) {
+	for (uint8_t i = 0; i < macroHeldCount; i++) {
+		if (macroHeld[i] == usage) {
+			macroHeld[i] = macroHeld[--macroHeldCount];
+			return;
+		}
+	}
+}
+
+uint8_t macro_playing(void) {
+	return macroNext != NULL;
+}
+
+/*
+Apply the actions of one frame, call once per report sent. Returns non-zero while a macro is playing. Keys left
+down at the end of a macro are released one frame later.
+*/
+uint8_t macro_step(void) {
+	uint8_t touched[MACRO_TOUCHED_MAX];
+	uint8_t touchedCount = 0;
+
+	if (!macroNext) {
+		return 0;
+	}
+	if (macroDelay) {
+		macroDelay--;
+		return 1;
+	}
+	while (touchedCount < MACRO_TOUCHED_MAX) {
+		uint8_t op = pgm_read_byte(macroNext);
+		uint8_t usage = pgm_read_byte(macroNext + 1);
+
+		if (op == MACRO_END) {
+			if (!touchedCount) {
+				macroHeldCount = 0;
+				macroNext = NULL;
+			}
+			break;
+		}
+		if (op == MACRO_OP_DELAY) {
+			macroDelay = usage;
+			macroNext += 2;
+			break;
+		}
+		uint8_t changed = 0;
+		for (uint8_t i = 0; i < touchedCount; i++) {
+			changed |= (touched[i] == usage);
+		}
+		if (changed) {
+			break; // Would merge with the change already in this report
+		}
+		if (op == MACRO_OP_RELEASE || (op == MACRO_OP_TAP && macroTapDown)) {
+			macro_release(usage);
+			macroTapDown = 0;
+			macroNext += 2;
+		} else {
+			if (!macro_press(usage)) {
+				break;
+			}
+			if (op == MACRO_OP_TAP) {
+				macroTapDown = 1; // Stays on this action until the release goes out in a later frame
+			} else {
+				macroNext += 2;
+			}
+		}
+		touched[touchedCount++] = usage;
+	}
+	return 1;
+}
+
+// Keys the macro holds down right now, for the report
+uint8_t macro_held(const uint8_t **usages) {
+	*usages = macroHeld;
+	return macroHeldCount;
+}
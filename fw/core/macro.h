@@ -0,0 +1,27 @@
+#ifndef MACRO_H
+#define MACRO_H
+
+#include <stdint.h>
+
+/*
+Macros are byte sequences in flash, played out by macro_step() once per USB frame. Every frame takes as many
+actions as can go into one report: it stops at a delay, at a key already changed in this frame (so the host sees
+each press and release, also of a repeated key) and when MACRO_HELD_MAX keys are down.
+*/
+
+#define MACRO_HELD_MAX	6 // Keys a macro holds at once, the boot protocol rollover
+#define MACRO_TOUCHED_MAX	8 // Key changes packed into one report
+
+// Actions, each an operation byte and an argument byte
+#define MACRO_END				0x00
+#define MACRO_PRESS(usage)		0x01, (usage)
+#define MACRO_RELEASE(usage)	0x02, (usage)
+#define MACRO_TAP(usage)		0x03, (usage) // Press, release in the next frame
+#define MACRO_DELAY(frames)		0x04, (frames) // Frames without changes after the current one
+
+void macro_start(uint8_t macro);
+uint8_t macro_step(void);
+uint8_t macro_playing(void);
+uint8_t macro_held(const uint8_t **usages);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_LEVEL_NONE	0
+#define TRACE_LEVEL_ERROR	1
+#define TRACE_LEVEL_INFO	2
+#define TRACE_LEVEL_DEBUG	3
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_INFO
+#endif
+
+#define TRACE_BUFFER_SIZE	16 // Records, power of two
+#define TRACE_SYNC			0xA5 // First byte of every record sent on the UART
+
+/*
+Event identifiers. tools/trace_decode.py reads this list, the comment of an entry names its argument bytes.
+Keep the values stable so that old captures still decode.
+*/
+enum {
+	TRACE_BOOT = 0x01,				// mcusr
+	TRACE_OVERFLOW = 0x02,			// lost
+	TRACE_STARTUP = 0x03,			// ticksL ticksM ticksH overBudget
+	TRACE_KEY_PRESS = 0x10,			// row col usbAddressConfig
+	TRACE_KEY_EVENT = 0x11,			// key pressed frames
+	TRACE_USB_RESET = 0x20,			//
+	TRACE_USB_SETUP = 0x21,			// bmRequestType bRequest wValueL wValueH
+	TRACE_USB_SETUP_LENGTH = 0x22,	// wIndexL wIndexH wLengthL wLengthH
+	TRACE_USB_GET_DESCRIPTOR = 0x23,// type index
+	TRACE_USB_STALL = 0x24,			// bmRequestType bRequest
+	TRACE_USB_SET_ADDRESS = 0x25,	// address
+	TRACE_USB_SET_CONFIGURATION = 0x26,	// configuration
+	TRACE_USB_SET_REPORT = 0x27,	// leds
+	TRACE_USB_SET_IDLE = 0x28,		// duration reportId
+	TRACE_USB_SET_PROTOCOL = 0x29,	// protocol
+	TRACE_USB_SUSPEND = 0x2A,		// remoteWakeup
+	TRACE_USB_RESUME = 0x2B,		// remote
+	TRACE_USB_WAKE_REPORT = 0x2C,	// ticksL ticksM ticksH
+};
+
+// Fixed size binary record, the timestamp is in clock ticks (see clock.h)
+typedef struct {
+	uint8_t id;
+	uint8_t time[3]; // 24-bit little endian
+	uint8_t args[4];
+} traceRecord_t;
+
+#if TRACE_LEVEL > TRACE_LEVEL_NONE
+void trace_record(uint8_t id, uint8_t a0, uint8_t a1, uint8_t a2, uint8_t a3);
+void trace_flush(void);
+#else
+#define trace_flush() do {} while (0)
+#endif
+
+// Zero to four argument bytes, missing ones are recorded as zero
+#define TRACE_ARGS(id, a0, a1, a2, a3, ...) trace_record((id), (a0), (a1), (a2), (a3))
+
+#if TRACE_LEVEL >= TRACE_LEVEL_ERROR
+#define TRACE_ERROR(...) TRACE_ARGS(__VA_ARGS__, 0, 0, 0, 0)
+#else
+#define TRACE_ERROR(...) do {} while (0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_INFO
+#define TRACE_INFO(...) TRACE_ARGS(__VA_ARGS__, 0, 0, 0, 0)
+#else
+#define TRACE_INFO(...) do {} while (0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_LEVEL_DEBUG
+#define TRACE_DEBUG(...) TRACE_ARGS(__VA_ARGS__, 0, 0, 0, 0)
+#else
+#define TRACE_DEBUG(...) do {} while (0)
+#endif
+
+#endif
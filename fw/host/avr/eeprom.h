@@ -0,0 +1,18 @@
+#ifndef HOST_AVR_EEPROM_H
+#define HOST_AVR_EEPROM_H
+
+#include <stdint.h>
+#include <avr/io.h>
+
+// EEPROM model: a byte array that is written instantly, see host/eeprom.c. Tests may read and corrupt it directly.
+extern uint8_t hostEeprom[E2END + 1];
+extern uint16_t hostEepromWrites; // Bytes actually written, eeprom_update_byte() skips unchanged ones
+
+#define eeprom_is_ready() 1
+
+uint8_t eeprom_read_byte(const uint8_t *address);
+void eeprom_read_block(void *destination, const void *source, uint16_t length);
+void eeprom_write_byte(uint8_t *address, uint8_t value);
+void eeprom_update_byte(uint8_t *address, uint8_t value);
+
+#endif
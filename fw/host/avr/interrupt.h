@@ -0,0 +1,10 @@
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+// Interrupt vectors become plain functions that the host test calls when the modelled hardware raises them
+#define ISR(vector) void vector(void); void vector(void)
+
+#define sei()
+#define cli()
+
+#endif
@@ -0,0 +1,441 @@
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+/*
+Register model of the ATmega32U4 for the host build. Every register lives at its data space address in avrIo, so
+pointer arithmetic between PINx, DDRx and PORTx works as on the chip. The USB registers with side effects (clear-only
+flags, the endpoint FIFO, per-endpoint banks selected by UENUM) go through usbsim_reg() in usbsim.c instead.
+*/
+
+#include <stdint.h>
+
+extern volatile uint8_t avrIo[0x100];
+volatile uint8_t *usbsim_reg(uint8_t address);
+
+// Ports
+#define PINB       avrIo[0x23]
+#define DDRB       avrIo[0x24]
+#define PORTB      avrIo[0x25]
+#define PINC       avrIo[0x26]
+#define DDRC       avrIo[0x27]
+#define PORTC      avrIo[0x28]
+#define PIND       avrIo[0x29]
+#define DDRD       avrIo[0x2A]
+#define PORTD      avrIo[0x2B]
+#define PINE       avrIo[0x2C]
+#define DDRE       avrIo[0x2D]
+#define PORTE      avrIo[0x2E]
+#define PINF       avrIo[0x2F]
+#define DDRF       avrIo[0x30]
+#define PORTF      avrIo[0x31]
+
+// Interrupt flags and general purpose registers
+#define TIFR0      avrIo[0x35]
+#define TIFR1      avrIo[0x36]
+#define TIFR3      avrIo[0x38]
+#define TIFR4      avrIo[0x39]
+#define PCIFR      avrIo[0x3B]
+#define EIFR       avrIo[0x3C]
+#define EIMSK      avrIo[0x3D]
+#define GPIOR0     avrIo[0x3E]
+#define EECR       avrIo[0x3F]
+#define EEDR       avrIo[0x40]
+#define EEARL      avrIo[0x41]
+#define EEARH      avrIo[0x42]
+#define GTCCR      avrIo[0x43]
+#define TCCR0A     avrIo[0x44]
+#define TCCR0B     avrIo[0x45]
+#define TCNT0      avrIo[0x46]
+#define OCR0A      avrIo[0x47]
+#define OCR0B      avrIo[0x48]
+#define GPIOR1     avrIo[0x4A]
+#define GPIOR2     avrIo[0x4B]
+#define SMCR       avrIo[0x53]
+#define MCUSR      avrIo[0x54]
+#define MCUCR      avrIo[0x55]
+#define SREG       avrIo[0x5F]
+
+// Extended I/O
+#define WDTCSR     avrIo[0x60]
+#define CLKPR      avrIo[0x61]
+#define PRR0       avrIo[0x64]
+#define PRR1       avrIo[0x65]
+#define PCICR      avrIo[0x68]
+#define EICRA      avrIo[0x69]
+#define EICRB      avrIo[0x6A]
+#define PCMSK0     avrIo[0x6B]
+#define TIMSK0     avrIo[0x6E]
+#define TIMSK1     avrIo[0x6F]
+#define TIMSK3     avrIo[0x71]
+#define TIMSK4     avrIo[0x72]
+#define TCCR1A     avrIo[0x80]
+#define TCCR1B     avrIo[0x81]
+#define TCCR1C     avrIo[0x82]
+#define TCNT1L     avrIo[0x84]
+#define TCNT1H     avrIo[0x85]
+#define OCR1AL     avrIo[0x88]
+#define OCR1AH     avrIo[0x89]
+#define OCR1BL     avrIo[0x8A]
+#define OCR1BH     avrIo[0x8B]
+#define TCCR3A     avrIo[0x90]
+#define TCCR3B     avrIo[0x91]
+#define TCNT3L     avrIo[0x94]
+#define TCNT3H     avrIo[0x95]
+#define OCR3AL     avrIo[0x98]
+#define OCR3AH     avrIo[0x99]
+
+// USART1
+#define UCSR1A     avrIo[0xC8]
+#define UCSR1B     avrIo[0xC9]
+#define UCSR1C     avrIo[0xCA]
+#define UBRR1L     avrIo[0xCC]
+#define UBRR1H     avrIo[0xCD]
+#define UDR1       avrIo[0xCE]
+
+// USB controller, the device side registers without side effects
+#define UHWCON     avrIo[0xD7]
+#define USBCON     avrIo[0xD8]
+#define USBSTA     avrIo[0xD9]
+#define USBINT     avrIo[0xDA]
+#define UDCON      avrIo[0xE0]
+#define UDIEN      avrIo[0xE2]
+#define UDADDR     avrIo[0xE3]
+#define UDFNUML    avrIo[0xE4]
+#define UDFNUMH    avrIo[0xE5]
+#define UDMFN      avrIo[0xE6]
+#define UEINT      avrIo[0xF4]
+
+// Registers modelled by usbsim.c
+#define PLLCSR     (*usbsim_reg(0x49))
+#define UDINT      (*usbsim_reg(0xE1))
+#define UEINTX     (*usbsim_reg(0xE8))
+#define UENUM      (*usbsim_reg(0xE9))
+#define UERST      (*usbsim_reg(0xEA))
+#define UECONX     (*usbsim_reg(0xEB))
+#define UECFG0X    (*usbsim_reg(0xEC))
+#define UECFG1X    (*usbsim_reg(0xED))
+#define UESTA0X    (*usbsim_reg(0xEE))
+#define UESTA1X    (*usbsim_reg(0xEF))
+#define UEIENX     (*usbsim_reg(0xF0))
+#define UEDATX     (*usbsim_reg(0xF1))
+#define UEBCLX     (*usbsim_reg(0xF2))
+#define UEBCHX     (*usbsim_reg(0xF3))
+
+// 16-bit registers, little endian like the AVR
+#define TCNT1      (*(volatile uint16_t *)&avrIo[0x84])
+#define OCR1A      (*(volatile uint16_t *)&avrIo[0x88])
+#define OCR1B      (*(volatile uint16_t *)&avrIo[0x8A])
+#define TCNT3      (*(volatile uint16_t *)&avrIo[0x94])
+#define OCR3A      (*(volatile uint16_t *)&avrIo[0x98])
+#define UDFNUM     (*(volatile uint16_t *)&avrIo[0xE4])
+#define UBRR1      (*(volatile uint16_t *)&avrIo[0xCC])
+#define EEAR       (*(volatile uint16_t *)&avrIo[0x41])
+
+// Bit positions
+// UEINTX
+#define TXINI      0
+#define STALLEDI   1
+#define RXOUTI     2
+#define RXSTPI     3
+#define NAKOUTI    4
+#define RWAL       5
+#define NAKINI     6
+#define FIFOCON    7
+// UECONX
+#define EPEN       0
+#define RSTDT      3
+#define STALLRQC   4
+#define STALLRQ    5
+// UDINT
+#define SUSPI      0
+#define MSOFI      1
+#define SOFI       2
+#define EORSTI     3
+#define WAKEUPI    4
+#define EORSMI     5
+#define UPRSMI     6
+// UDIEN
+#define SUSPE      0
+#define MSOFE      1
+#define SOFE       2
+#define EORSTE     3
+#define WAKEUPE    4
+#define EORSME     5
+#define UPRSME     6
+// UDCON
+#define DETACH     0
+#define RMWKUP     1
+#define LSM        2
+#define RSTCPU     3
+// UDADDR
+#define ADDEN      7
+// UEIENX
+#define TXINE      0
+#define STALLEDE   1
+#define RXOUTE     2
+#define RXSTPE     3
+#define NAKOUTE    4
+#define NAKINE     6
+#define FLERRE     7
+// USBCON
+#define VBUSTE     0
+#define OTGPADE    4
+#define FRZCLK     5
+#define USBE       7
+// UHWCON
+#define UVREGE     0
+// PLLCSR
+#define PLOCK      0
+#define PLLE       1
+#define PINDIV     4
+// USBSTA
+#define VBUS       0
+// USBINT
+#define VBUSTI     0
+// UECFG0X
+#define EPDIR      0
+#define EPTYPE0    6
+#define EPTYPE1    7
+// UECFG1X
+#define ALLOC      1
+#define EPBK0      2
+#define EPBK1      3
+#define EPSIZE0    4
+#define EPSIZE1    5
+#define EPSIZE2    6
+// UESTA0X
+#define CFGOK      7
+// UCSR1A
+#define MPCM1      0
+#define U2X1       1
+#define UPE1       2
+#define DOR1       3
+#define FE1        4
+#define UDRE1      5
+#define TXC1       6
+#define RXC1       7
+// UCSR1B
+#define TXB81      0
+#define RXB81      1
+#define UCSZ12     2
+#define TXEN1      3
+#define RXEN1      4
+#define UDRIE1     5
+#define TXCIE1     6
+#define RXCIE1     7
+// UCSR1C
+#define UCPOL1     0
+#define UCSZ10     1
+#define UCSZ11     2
+#define USBS1      3
+#define UPM10      4
+#define UPM11      5
+#define UMSEL10    6
+#define UMSEL11    7
+// TCCR0A
+#define WGM00      0
+#define WGM01      1
+// TCCR0B
+#define CS00       0
+#define CS01       1
+#define CS02       2
+#define WGM02      3
+// TIMSK0
+#define TOIE0      0
+#define OCIE0A     1
+#define OCIE0B     2
+// TIFR0
+#define TOV0       0
+#define OCF0A      1
+#define OCF0B      2
+// TCCR1A
+#define WGM10      0
+#define WGM11      1
+// TCCR1B
+#define CS10       0
+#define CS11       1
+#define CS12       2
+#define WGM12      3
+#define WGM13      4
+// TIMSK1
+#define TOIE1      0
+#define OCIE1A     1
+#define OCIE1B     2
+// TIFR1
+#define TOV1       0
+#define OCF1A      1
+#define OCF1B      2
+// TCCR3B
+#define CS30       0
+#define CS31       1
+#define CS32       2
+#define WGM32      3
+// TIMSK3
+#define OCIE3A     1
+// TIFR3
+#define OCF3A      1
+// PCICR
+#define PCIE0      0
+// PCIFR
+#define PCIF0      0
+// SMCR
+#define SE         0
+#define SM0        1
+#define SM1        2
+#define SM2        3
+// EIMSK
+#define INT6       6
+// EIFR
+#define INTF6      6
+// EICRB
+#define ISC60      4
+#define ISC61      5
+// EECR
+#define EERE       0
+#define EEPE       1
+#define EEMPE      2
+#define EERIE      3
+// MCUSR
+#define PORF       0
+#define EXTRF      1
+#define BORF       2
+#define WDRF       3
+// WDTCSR
+#define WDE        3
+#define WDCE       4
+
+// Port pins
+#define PORTB0 0
+#define PINB0 0
+#define DDB0 0
+#define PORTB1 1
+#define PINB1 1
+#define DDB1 1
+#define PORTB2 2
+#define PINB2 2
+#define DDB2 2
+#define PORTB3 3
+#define PINB3 3
+#define DDB3 3
+#define PORTB4 4
+#define PINB4 4
+#define DDB4 4
+#define PORTB5 5
+#define PINB5 5
+#define DDB5 5
+#define PORTB6 6
+#define PINB6 6
+#define DDB6 6
+#define PORTB7 7
+#define PINB7 7
+#define DDB7 7
+#define PCINT0 0
+#define PCINT1 1
+#define PCINT2 2
+#define PCINT3 3
+#define PCINT4 4
+#define PCINT5 5
+#define PCINT6 6
+#define PCINT7 7
+#define PORTC0 0
+#define PINC0 0
+#define DDC0 0
+#define PORTC1 1
+#define PINC1 1
+#define DDC1 1
+#define PORTC2 2
+#define PINC2 2
+#define DDC2 2
+#define PORTC3 3
+#define PINC3 3
+#define DDC3 3
+#define PORTC4 4
+#define PINC4 4
+#define DDC4 4
+#define PORTC5 5
+#define PINC5 5
+#define DDC5 5
+#define PORTC6 6
+#define PINC6 6
+#define DDC6 6
+#define PORTC7 7
+#define PINC7 7
+#define DDC7 7
+#define PORTD0 0
+#define PIND0 0
+#define DDD0 0
+#define PORTD1 1
+#define PIND1 1
+#define DDD1 1
+#define PORTD2 2
+#define PIND2 2
+#define DDD2 2
+#define PORTD3 3
+#define PIND3 3
+#define DDD3 3
+#define PORTD4 4
+#define PIND4 4
+#define DDD4 4
+#define PORTD5 5
+#define PIND5 5
+#define DDD5 5
+#define PORTD6 6
+#define PIND6 6
+#define DDD6 6
+#define PORTD7 7
+#define PIND7 7
+#define DDD7 7
+#define PORTE0 0
+#define PINE0 0
+#define DDE0 0
+#define PORTE1 1
+#define PINE1 1
+#define DDE1 1
+#define PORTE2 2
+#define PINE2 2
+#define DDE2 2
+#define PORTE3 3
+#define PINE3 3
+#define DDE3 3
+#define PORTE4 4
+#define PINE4 4
+#define DDE4 4
+#define PORTE5 5
+#define PINE5 5
+#define DDE5 5
+#define PORTE6 6
+#define PINE6 6
+#define DDE6 6
+#define PORTE7 7
+#define PINE7 7
+#define DDE7 7
+#define PORTF0 0
+#define PINF0 0
+#define DDF0 0
+#define PORTF1 1
+#define PINF1 1
+#define DDF1 1
+#define PORTF2 2
+#define PINF2 2
+#define DDF2 2
+#define PORTF3 3
+#define PINF3 3
+#define DDF3 3
+#define PORTF4 4
+#define PINF4 4
+#define DDF4 4
+#define PORTF5 5
+#define PINF5 5
+#define DDF5 5
+#define PORTF6 6
+#define PINF6 6
+#define DDF6 6
+#define PORTF7 7
+#define PINF7 7
+#define DDF7 7
+
+#define _BV(bit) (1 << (bit))
+
+#define E2END 0x3FF // Last EEPROM address
+
+#endif
@@ -0,0 +1,24 @@
+#include <string.h>
+#include <avr/eeprom.h>
+
+uint8_t hostEeprom[E2END + 1];
+uint16_t hostEepromWrites = 0;
+
+uint8_t eeprom_read_byte(const uint8_t *address) {
+	return hostEeprom[(uintptr_t)address & E2END];
+}
+
+void eeprom_read_block(void *destination, const void *source, uint16_t length) {
+	memcpy(destination, &hostEeprom[(uintptr_t)source & E2END], length);
+}
+
+void eeprom_write_byte(uint8_t *address, uint8_t value) {
+	hostEeprom[(uintptr_t)address & E2END] = value;
+	hostEepromWrites++;
+}
+
+void eeprom_update_byte(uint8_t *address, uint8_t value) {
+	if (eeprom_read_byte(address) != value) {
+		eeprom_write_byte(address, value);
+	}
+}
@@ -0,0 +1,983 @@
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+#include <stdio.h>
+#include <string.h>
+#include "usbsim.h"
+#include "../usb.h"
+#include "../matrix.h"
+#include "../core/keyboard.h"
+#include "../mouse.h"
+#include "../profile.h"
+#include "../core/keymap.h"
+#include "../core/event.h"
+#include "../store.h"
+#include "../uart.h"
+#include "../console.h"
+#include "../split.h"
+
+// Host side checks of the USB stack: enumeration as a host would run it, then the keyboard report path
+
+extern volatile uint8_t keyboard_leds;
+void TIMER0_COMPA_vect(void);
+void TIMER1_OVF_vect(void);
+
+static int testFailures = 0;
+
+#define CHECK(condition) do { \
+	if (!(condition)) { \
+		printf("  %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+		testFailures++; \
+	} \
+} while (0)
+
+#define CHECK_EQUAL(actual, expected) do { \
+	long checkActual = (long)(actual), checkExpected = (long)(expected); \
+	if (checkActual != checkExpected) { \
+		printf("  %s:%d: %s is %ld, expected %ld\n", __FILE__, __LINE__, #actual, checkActual, checkExpected); \
+		testFailures++; \
+	} \
+} while (0)
+
+#define USAGE_Z 0x1D
+#define USAGE_C 0x06 // Key 0 of the other half with SPLIT
+#define VENDOR_INTERFACE 3 // Or the CDC control interface with USB_CDC
+
+static uint8_t buffer[512];
+
+// Key (0, 0) is wired to PF6, pressed pulls it low
+static void press_key(uint8_t pressed) {
+	if (pressed) {
+		PINF &= ~(1 << PINF6);
+	} else {
+		PINF |= (1 << PINF6);
+	}
+}
+
+static void scan(uint16_t times) {
+	while (times--) {
+		TIMER0_COMPA_vect();
+	}
+}
+
+// Let the clock run on by whole timer 1 overflows (32.768 ms)
+static void advance_ms(uint16_t ms) {
+	for (uint16_t elapsed = 0; elapsed < ms; elapsed += 32) {
+		TIMER1_OVF_vect();
+	}
+}
+
+static void attach(void) {
+	keymap_reset(&storeData.keymap); // As main() does on a blank EEPROM
+	keymap_init(&storeData.keymap);
+	usbsim_power_on();
+	PINF = 0xFF;
+	matrix_init();
+	usbsim_bus_reset();
+}
+
+static void enumerate(void) {
+	attach();
+	usbsim_control(0x80, 0x06, 0x0100, 0, 64, buffer);
+	usbsim_control(0x00, 0x05, 0x0007, 0, 0, NULL);
+	usbsim_control(0x80, 0x06, 0x0200, 0, 255, buffer);
+	usbsim_control(0x00, 0x09, 0x0001, 0, 0, NULL);
+}
+
+static void test_device_descriptor(void) {
+	attach();
+	CHECK_EQUAL(usbsim_control(0x80, 0x06, 0x0100, 0, 64, buffer), 18);
+	CHECK_EQUAL(buffer[0], 18); // bLength
+	CHECK_EQUAL(buffer[1], 0x01); // bDescriptorType
+	CHECK_EQUAL(buffer[7], 32); // bMaxPacketSize0
+	CHECK_EQUAL(buffer[8] | (buffer[9] << 8), 0x03EB); // idVendor
+
+	// A host asking for fewer bytes gets exactly that
+	CHECK_EQUAL(usbsim_control(0x80, 0x06, 0x0100, 0, 8, buffer), 8);
+}
+
+static void test_set_address(void) {
+	uint8_t setup[8] = { 0x00, 0x05, 0x2A, 0x00, 0, 0, 0, 0 };
+
+	attach();
+	usbsim_setup(setup);
+	CHECK_EQUAL(usbsim_address(), 0); // Not before the status stage
+	CHECK_EQUAL(usbsim_in(0, buffer), 0);
+	CHECK_EQUAL(usbsim_address(), 0x2A);
+}
+
+static void test_configuration_descriptor(void) {
+	attach();
+	CHECK_EQUAL(usbsim_control(0x80, 0x06, 0x0200, 0, 9, buffer), 9);
+	uint16_t totalLength = buffer[2] | (buffer[3] << 8);
+#if USB_CDC
+	CHECK_EQUAL(totalLength, 9 + 3 * (9 + 9 + 7) + (8 + 9 + 5 + 5 + 4 + 5 + 7 + 9 + 7 + 7));
+	CHECK_EQUAL(buffer[4], 5); // bNumInterfaces
+#else
+	CHECK_EQUAL(totalLength, 9 + 4 * (9 + 9 + 7));
+	CHECK_EQUAL(buffer[4], 4); // bNumInterfaces
+#endif
+
+	// More than one packet, ends with the short one
+	CHECK_EQUAL(usbsim_control(0x80, 0x06, 0x0200, 0, 0xFFFF, buffer), totalLength);
+	CHECK_EQUAL(buffer[9 + 1], 0x04); // Interface descriptor
+	CHECK_EQUAL(buffer[9 + 5], 0x03); // HID class
+	CHECK_EQUAL(buffer[18 + 1], 0x21); // HID descriptor
+	CHECK_EQUAL(buffer[27 + 1], 0x05); // Endpoint descriptor
+	CHECK_EQUAL(buffer[27 + 2], 0x83); // EP3 IN
+	CHECK_EQUAL(buffer[27 + 6], 1); // bInterval
+	CHECK_EQUAL(buffer[34 + 2], 1); // Consumer control interface number
+	CHECK_EQUAL(buffer[43 + 1], 0x21); // HID descriptor
+	CHECK_EQUAL(buffer[52 + 2], 0x85); // EP5 IN
+	CHECK_EQUAL(buffer[52 + 6], 1);
+	CHECK_EQUAL(buffer[59 + 2], 2); // Mouse interface number
+	CHECK_EQUAL(buffer[77 + 2], 0x86); // EP6 IN
+	CHECK_EQUAL(buffer[77 + 6], 1);
+#if USB_CDC
+	CHECK_EQUAL(buffer[84 + 1], 0x0B); // Interface association
+	CHECK_EQUAL(buffer[84 + 2], 3); // First interface
+	CHECK_EQUAL(buffer[92 + 5], 0x02); // CDC class
+	CHECK_EQUAL(buffer[120 + 2], 0x84); // Notification EP4 IN
+	CHECK_EQUAL(buffer[127 + 2], 4); // Data interface number
+	CHECK_EQUAL(buffer[136 + 2], 0x01); // EP1 OUT
+	CHECK_EQUAL(buffer[136 + 3], 0x02); // Bulk
+	CHECK_EQUAL(buffer[143 + 2], 0x82); // EP2 IN
+	CHECK_EQUAL(usbsim_control(0x80, 0x06, 0x0100, 0, 64, buffer), 18);
+	CHECK_EQUAL(buffer[4], 0xEF); // bDeviceClass, function made of associated interfaces
+#else
+	CHECK_EQUAL(buffer[84 + 2], 3); // Profiler interface number
+	CHECK_EQUAL(buffer[102 + 2], 0x84); // EP4 IN
+#endif
+
+	// Exactly one full packet: no zero length packet, straight to the status stage
+	CHECK_EQUAL(usbsim_control(0x80, 0x06, 0x0200, 0, 32, buffer), 32);
+}
+
+static void test_hid_report_descriptor(void) {
+	attach();
+	usbsim_control(0x80, 0x06, 0x0200, 0, 0xFFFF, buffer);
+	uint16_t reportLength = buffer[18 + 7] | (buffer[18 + 8] << 8);
+	uint16_t mouseLength = buffer[68 + 7] | (buffer[68 + 8] << 8);
+
+	CHECK_EQUAL(usbsim_control(0x81, 0x06, 0x2200, 0, reportLength + 64, buffer), reportLength);
+	CHECK_EQUAL(buffer[0], 0x05); // Usage Page
+	CHECK_EQUAL(buffer[reportLength - 1], 0xC0); // End Collection
+
+	// Every interface has its own
+	CHECK_EQUAL(usbsim_control(0x81, 0x06, 0x2200, 2, 255, buffer), mouseLength);
+	CHECK_EQUAL(buffer[3], 0x02); // Usage (Mouse)
+	CHECK_EQUAL(usbsim_control(0x81, 0x06, 0x2100, 2, 255, buffer), 9); // HID descriptor alone
+	CHECK_EQUAL(usbsim_control(0x81, 0x06, 0x2200, 4, 255, buffer), USBSIM_STALL);
+}
+
+static void test_unknown_request_stalls(void) {
+	attach();
+	CHECK_EQUAL(usbsim_control(0x80, 0x06, 0x0300, 0, 255, buffer), USBSIM_STALL); // No string descriptors
+	CHECK_EQUAL(usbsim_control(0x80, 0x06, 0x0100, 0, 64, buffer), 18); // The next SETUP clears the stall
+}
+
+static void test_configuration(void) {
+	enumerate();
+	CHECK_EQUAL(usbsim_address(), 7);
+	CHECK_EQUAL(usbsim_control(0x80, 0x08, 0, 0, 1, buffer), 1);
+	CHECK_EQUAL(buffer[0], 1);
+	CHECK_EQUAL(usbsim_control(0x80, 0x00, 0, 0, 2, buffer), 2);
+	CHECK_EQUAL(usbsim_control(0x00, 0x09, 0x0002, 0, 0, NULL), USBSIM_STALL);
+}
+
+// SET_FEATURE and CLEAR_FEATURE ENDPOINT_HALT, GET_STATUS of an endpoint
+static void test_endpoint_halt(void) {
+	enumerate();
+	usbsim_sof();
+	usbsim_in(3, buffer);
+	CHECK_EQUAL(usbsim_control(0x02, 0x03, 0, 0x83, 0, NULL), 0);
+	CHECK_EQUAL(usbsim_control(0x82, 0x00, 0, 0x83, 2, buffer), 2);
+	CHECK_EQUAL(buffer[0], 0x01);
+	CHECK_EQUAL(usbsim_in(3, buffer), USBSIM_STALL);
+
+	CHECK_EQUAL(usbsim_control(0x02, 0x01, 0, 0x83, 0, NULL), 0);
+	CHECK_EQUAL(usbsim_control(0x82, 0x00, 0, 0x83, 2, buffer), 2);
+	CHECK_EQUAL(buffer[0], 0);
+	press_key(1);
+	scan(1);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	press_key(0);
+	scan(20);
+	usbsim_sof();
+	usbsim_in(3, buffer);
+
+	CHECK_EQUAL(usbsim_control(0x82, 0x00, 0, 0x80, 2, buffer), 2); // Endpoint 0
+	CHECK_EQUAL(usbsim_control(0x82, 0x00, 0, 0x03, 2, buffer), USBSIM_STALL); // Wrong direction
+	CHECK_EQUAL(usbsim_control(0x02, 0x01, 0, 0x87, 0, NULL), USBSIM_STALL); // No such endpoint
+	CHECK_EQUAL(usbsim_control(0x02, 0x01, 1, 0x83, 0, NULL), USBSIM_STALL); // Not a feature of endpoints
+}
+
+static void test_hid_class_requests(void) {
+	uint8_t leds = 0x02;
+
+	enumerate();
+	CHECK_EQUAL(usbsim_control(0x21, 0x0A, 0x7D00, 0, 0, NULL), 0); // SET_IDLE 500 ms
+	CHECK_EQUAL(usbsim_control(0xA1, 0x02, 0, 0, 1, buffer), 1);
+	CHECK_EQUAL(buffer[0], 0x7D);
+	CHECK_EQUAL(usbsim_control(0x21, 0x0A, 0, VENDOR_INTERFACE, 0, NULL), USBSIM_STALL); // Only the keyboard has one
+	CHECK_EQUAL(usbsim_control(0xA1, 0x02, 0, VENDOR_INTERFACE, 1, buffer), USBSIM_STALL);
+	CHECK_EQUAL(usbsim_control(0x21, 0x09, 0x0200, 0, 1, &leds), 1); // SET_REPORT output
+	CHECK_EQUAL(keyboard_leds, 0x02);
+	memset(buffer, 0x04, 40);
+	CHECK_EQUAL(usbsim_control(0x21, 0x09, 0x0200, 0, 40, buffer), USBSIM_STALL); // More data than the report holds
+	CHECK_EQUAL(keyboard_leds, 0x02);
+	CHECK_EQUAL(usbsim_control(0xA1, 0x03, 0, 0, 1, buffer), 1);
+	CHECK_EQUAL(buffer[0], KEYBOARD_PROTOCOL_REPORT);
+	CHECK_EQUAL(usbsim_control(0x21, 0x0B, KEYBOARD_PROTOCOL_BOOT, 0, 0, NULL), 0);
+	CHECK_EQUAL(usbsim_control(0xA1, 0x03, 0, 0, 1, buffer), 1);
+	CHECK_EQUAL(buffer[0], KEYBOARD_PROTOCOL_BOOT);
+	CHECK_EQUAL(usbsim_control(0xA1, 0x01, 0x0100, 0, 8, buffer), 8); // GET_REPORT input
+}
+
+#if !USB_CDC
+static void test_profiler_reports(void) {
+	profileSiteReport_t site;
+	profileCountersReport_t counters;
+
+	enumerate();
+	usbsim_control(0x21, 0x09, 0x0300 | PROFILE_REPORT_COUNTERS, VENDOR_INTERFACE, 0, NULL); // SET_REPORT feature resets
+	scan(3);
+	usbsim_control(0x80, 0x06, 0x0300, 0, 255, buffer); // Stalls
+	usbsim_sof();
+	usbsim_sof();
+
+	CHECK_EQUAL(usbsim_control(0xA1, 0x01, 0x0300 | PROFILE_REPORT_SITE(PROFILE_SITE_SCAN), VENDOR_INTERFACE, sizeof(site), (uint8_t *)&site), sizeof(site));
+	CHECK_EQUAL(site.reportId, PROFILE_REPORT_SITE(PROFILE_SITE_SCAN));
+	CHECK_EQUAL(site.site.count, 3);
+	CHECK_EQUAL(site.site.histogram[0], 3); // The model timer does not run, every scan took zero ticks
+
+	CHECK_EQUAL(usbsim_control(0xA1, 0x01, 0x0300 | PROFILE_REPORT_COUNTERS, VENDOR_INTERFACE, sizeof(counters), (uint8_t *)&counters), sizeof(counters));
+	CHECK_EQUAL(counters.ticksPerUs, 2);
+	CHECK_EQUAL(counters.counters[PROFILE_COUNTER_STALL], 1);
+	CHECK_EQUAL(counters.counters[PROFILE_COUNTER_MISSED_SOF], 0);
+
+	CHECK_EQUAL(usbsim_control(0xA1, 0x01, 0x0300 | 0x7F, VENDOR_INTERFACE, 64, buffer), USBSIM_STALL); // Unknown report ID
+	CHECK_EQUAL(usbsim_control(0xA1, 0x01, 0x0100, VENDOR_INTERFACE, 64, buffer), USBSIM_STALL); // No input report
+}
+
+static void test_scan_locked_to_sof(void) {
+	profileSiteReport_t phase;
+
+	enumerate();
+	usbsim_control(0x21, 0x09, 0x0300 | PROFILE_REPORT_COUNTERS, VENDOR_INTERFACE, 0, NULL);
+	TCNT0 = 200;
+	scan(1);
+	usbsim_sof();
+	CHECK_EQUAL(TCNT0, MATRIX_SOF_LEAD_US / 4); // Next compare match MATRIX_SOF_LEAD_US ahead of the next SOF
+	usbsim_sof(); // No scan in between, nothing to measure
+
+	usbsim_control(0xA1, 0x01, 0x0300 | PROFILE_REPORT_SITE(PROFILE_SITE_SOF_PHASE), VENDOR_INTERFACE, sizeof(phase), (uint8_t *)&phase);
+	CHECK_EQUAL(phase.site.count, 1);
+}
+
+// Only frames that had a keyboard report to load and no bank for it count, full endpoints with nothing new do not
+static void test_dropped_reports(void) {
+	profileReport_t report;
+
+	enumerate();
+	usbsim_sof(); // Initial empty report, left in the bank
+	press_key(1);
+	scan(1);
+	usbsim_sof();
+	profile_reset();
+	for (uint8_t frame = 0; frame < 5; frame++) {
+		usbsim_sof();
+	}
+	profile_copy_report(PROFILE_REPORT_COUNTERS, &report);
+	CHECK_EQUAL(report.counters.counters[PROFILE_COUNTER_DROPPED_REPORT], 0);
+
+	press_key(0);
+	scan(20);
+	usbsim_sof();
+	usbsim_sof();
+	profile_copy_report(PROFILE_REPORT_COUNTERS, &report);
+	CHECK_EQUAL(report.counters.counters[PROFILE_COUNTER_DROPPED_REPORT], 2);
+
+	// The release goes out once the host polls, none was lost
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	CHECK_EQUAL(buffer[1 + USAGE_Z / 8], 1 << (USAGE_Z % 8));
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	CHECK_EQUAL(buffer[1 + USAGE_Z / 8], 0);
+}
+
+#endif
+
+static void test_keyboard_reports(void) {
+	enumerate();
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t)); // Initial empty report
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), USBSIM_NAK); // Nothing changed
+
+	press_key(1);
+	scan(1);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	CHECK_EQUAL(buffer[1 + USAGE_Z / 8], 1 << (USAGE_Z % 8));
+
+	press_key(0);
+	scan(20);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	CHECK_EQUAL(buffer[1 + USAGE_Z / 8], 0);
+}
+
+static void test_idle_rate(void) {
+	enumerate();
+	usbsim_sof();
+	usbsim_in(3, buffer);
+
+	usbsim_control(0x21, 0x0A, 0x0100, 0, 0, NULL); // SET_IDLE 4 ms
+	for (uint8_t frame = 1; frame < 4; frame++) {
+		usbsim_sof();
+		CHECK_EQUAL(usbsim_in(3, buffer), USBSIM_NAK);
+	}
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t)); // Unchanged report repeated
+
+	// A change restarts the idle period
+	press_key(1);
+	scan(1);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), USBSIM_NAK);
+
+	usbsim_control(0x21, 0x0A, 0x0000, 0, 0, NULL); // Only on change
+	for (uint8_t frame = 0; frame < 10; frame++) {
+		usbsim_sof();
+		CHECK_EQUAL(usbsim_in(3, buffer), USBSIM_NAK);
+	}
+	press_key(0);
+	scan(20);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t)); // Release
+}
+
+static void test_keymap_layers(void) {
+	enumerate();
+	CHECK_EQUAL(keymap_lookup(0), KEY_Z);
+	keymap_press(KEY_TOGGLE(1));
+	keymap_release(KEY_TOGGLE(1));
+	CHECK_EQUAL(keymap_layers(), 0x03);
+	CHECK_EQUAL(keymap_lookup(0), KEY_X);
+
+	// The key reports the code of the layer it was pressed on, even after the layer is gone
+	usbsim_sof();
+	usbsim_in(3, buffer);
+	press_key(1);
+	scan(1);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	CHECK_EQUAL(buffer[1 + KEY_X / 8], 1 << (KEY_X % 8));
+	keymap_press(KEY_TOGGLE(1));
+	CHECK_EQUAL(keymap_layers(), 0x01);
+	press_key(0);
+	scan(20);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	CHECK_EQUAL(buffer[1 + KEY_X / 8], 0);
+
+	keymap_press(KEY_MOMENTARY(1));
+	CHECK_EQUAL(keymap_lookup(0), KEY_X);
+	keymap_release(KEY_MOMENTARY(1));
+	CHECK_EQUAL(keymap_lookup(0), KEY_Z);
+}
+
+static void commit_settings(void) {
+	advance_ms(STORE_COMMIT_MS + 32);
+	for (uint16_t i = 0; i < 256; i++) {
+		store_task();
+	}
+}
+
+#if !USB_CDC
+static void test_settings_store(void) {
+	storeReport_t settings;
+
+	memset(hostEeprom, 0xFF, sizeof(hostEeprom));
+	CHECK_EQUAL(store_init(), 0); // Blank
+	enumerate();
+
+	// Remap through the vendor feature report, the RAM copy takes it at once
+	CHECK_EQUAL(usbsim_control(0xA1, 0x01, 0x0300 | STORE_REPORT_ID, VENDOR_INTERFACE, sizeof(settings), (uint8_t *)&settings), sizeof(settings));
+	CHECK_EQUAL(settings.data.keymap[0][0], KEY_Z);
+	settings.data.keymap[0][0] = KEY_A;
+	CHECK_EQUAL(usbsim_control(0x21, 0x09, 0x0300 | STORE_REPORT_ID, VENDOR_INTERFACE, sizeof(settings), (uint8_t *)&settings), sizeof(settings));
+	CHECK_EQUAL(keymap_lookup(0), KEY_A);
+	CHECK(store_task()); // Reported once for the main loop to apply
+	CHECK(!store_task());
+
+	// A short write or one with another report ID in the data leaves the settings alone
+	settings.data.keymap[0][0] = KEY_C;
+	CHECK_EQUAL(usbsim_control(0x21, 0x09, 0x0300 | STORE_REPORT_ID, VENDOR_INTERFACE, sizeof(settings) - 1, (uint8_t *)&settings), USBSIM_STALL);
+	settings.reportId = 0;
+	CHECK_EQUAL(usbsim_control(0x21, 0x09, 0x0300 | STORE_REPORT_ID, VENDOR_INTERFACE, sizeof(settings), (uint8_t *)&settings), sizeof(settings));
+	CHECK_EQUAL(keymap_lookup(0), KEY_A);
+	CHECK(!store_task());
+	settings.reportId = STORE_REPORT_ID;
+	settings.data.keymap[0][0] = KEY_A;
+
+	// Nothing reaches the EEPROM before the changes settled
+	hostEepromWrites = 0;
+	store_task();
+	CHECK_EQUAL(hostEepromWrites, 0);
+	commit_settings();
+	CHECK(hostEepromWrites > 0);
+
+	// A second commit goes to the next slot, a boot loads the newest
+	settings.data.keymap[0][0] = KEY_B;
+	store_set_report(&settings);
+	commit_settings();
+	keymap_reset(&storeData.keymap);
+	CHECK_EQUAL(store_init(), 1);
+	CHECK_EQUAL(keymap_lookup(0), KEY_B);
+
+	// A torn commit leaves the previous record in charge
+	uint16_t newest = 0;
+	for (uint16_t i = 0; i + 1 < sizeof(hostEeprom); i++) {
+		if (hostEeprom[i] == 2 && hostEeprom[i + 1] == 0 && hostEeprom[i + 2] == STORE_VERSION) { // Sequence 2
+			newest = i;
+			break;
+		}
+	}
+	hostEeprom[newest + 3] ^= 0xFF;
+	CHECK_EQUAL(store_init(), 1);
+	CHECK_EQUAL(keymap_lookup(0), KEY_A);
+}
+
+#endif
+
+// One report per frame, one key (or none) down in each besides the modifiers
+static void test_macro(void) {
+	static const uint8_t expected[][2] = { // modifiers, usage
+		{ 0x02, KEY_H }, { 0, KEY_E }, { 0, KEY_L }, { 0, KEY_NONE }, { 0, KEY_L }, { 0, KEY_O }, { 0, KEY_ENTER }, { 0, KEY_NONE },
+	};
+
+	enumerate();
+	storeData.keymap[0][0] = KEY_MACRO(0);
+	usbsim_sof();
+	usbsim_in(3, buffer);
+	press_key(1);
+	scan(1);
+	press_key(0);
+	scan(20);
+	usbsim_sof(); // Starts the macro
+	CHECK_EQUAL(usbsim_in(3, buffer), USBSIM_NAK);
+
+	for (uint8_t frame = 0; frame < sizeof(expected) / sizeof(expected[0]); frame++) {
+		uint8_t keys = 0;
+
+		usbsim_sof();
+		CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+		CHECK_EQUAL(buffer[0], expected[frame][0]);
+		for (uint8_t i = 1; i < sizeof(keyboardNkroReport_t); i++) {
+			keys += __builtin_popcount(buffer[i]);
+		}
+		CHECK_EQUAL(keys, expected[frame][1] != KEY_NONE);
+		if (expected[frame][1] != KEY_NONE) {
+			CHECK_EQUAL(buffer[1 + expected[frame][1] / 8], 1 << (expected[frame][1] % 8));
+		}
+	}
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), USBSIM_NAK);
+	keymap_reset(&storeData.keymap);
+}
+
+// Press and release between two frames: both edges reach the host, one report each
+static void test_tap_within_a_frame(void) {
+	enumerate();
+	usbsim_sof();
+	usbsim_in(3, buffer);
+
+	press_key(1);
+	scan(1);
+	press_key(0);
+	scan(20);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	CHECK_EQUAL(buffer[1 + USAGE_Z / 8], 1 << (USAGE_Z % 8));
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	CHECK_EQUAL(buffer[1 + USAGE_Z / 8], 0);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), USBSIM_NAK);
+}
+
+#if KEYMAP_KEYS > 1
+// Keys changed in the same scan, as matrix_scan() queues them, go out together
+static void test_chord_in_one_report(void) {
+	enumerate();
+	usbsim_sof();
+	usbsim_in(3, buffer);
+
+	event_push(0, 1);
+	event_push(1, 1);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	CHECK_EQUAL(buffer[1 + USAGE_Z / 8], 1 << (USAGE_Z % 8));
+	CHECK_EQUAL(buffer[1 + USAGE_C / 8], 1 << (USAGE_C % 8));
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), USBSIM_NAK);
+
+	event_push(0, 0);
+	event_push(1, 0);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	CHECK_EQUAL(buffer[1 + USAGE_Z / 8], 0);
+	CHECK_EQUAL(buffer[1 + USAGE_C / 8], 0);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), USBSIM_NAK);
+}
+#endif
+
+static void test_boot_protocol_reports(void) {
+	enumerate();
+	usbsim_control(0x21, 0x0B, KEYBOARD_PROTOCOL_BOOT, 0, 0, NULL);
+	press_key(1);
+	scan(1);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardBootReport_t));
+	CHECK_EQUAL(buffer[2], USAGE_Z);
+	press_key(0);
+	scan(20);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardBootReport_t));
+	CHECK_EQUAL(buffer[2], 0);
+}
+
+// Media and mouse keys go out on their own endpoints and leave the keyboard report alone
+static void test_consumer_and_mouse_reports(void) {
+	enumerate();
+	usbsim_sof();
+	usbsim_in(3, buffer);
+
+	storeData.keymap[0][0] = KEY_MEDIA_VOLUME_UP;
+	press_key(1);
+	scan(1);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), USBSIM_NAK);
+	CHECK_EQUAL(usbsim_in(5, buffer), 2);
+	CHECK_EQUAL(buffer[0] | (buffer[1] << 8), 0x00E9);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(5, buffer), USBSIM_NAK); // Held, nothing changed
+	press_key(0);
+	scan(20);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(5, buffer), 2);
+	CHECK_EQUAL(buffer[0] | (buffer[1] << 8), 0);
+
+	// A move key reports every frame it is held, faster the longer it is
+	storeData.keymap[0][0] = KEY_MOUSE_RIGHT;
+	press_key(1);
+	scan(1);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(6, buffer), sizeof(mouseReport_t));
+	CHECK_EQUAL((int8_t)buffer[1], MOUSE_SPEED_MIN);
+	for (uint8_t frame = 0; frame < MOUSE_ACCEL_FRAMES; frame++) {
+		usbsim_sof();
+		CHECK_EQUAL(usbsim_in(6, buffer), sizeof(mouseReport_t));
+	}
+	CHECK_EQUAL((int8_t)buffer[1], MOUSE_SPEED_MIN + 1);
+	press_key(0);
+	scan(20);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(6, buffer), USBSIM_NAK); // Motion stops without a report
+
+	// Buttons report their changes only
+	storeData.keymap[0][0] = KEY_MOUSE_BUTTON1;
+	press_key(1);
+	scan(1);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(6, buffer), sizeof(mouseReport_t));
+	CHECK_EQUAL(buffer[0], 0x01);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(6, buffer), USBSIM_NAK);
+	press_key(0);
+	scan(20);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(6, buffer), sizeof(mouseReport_t));
+	CHECK_EQUAL(buffer[0], 0);
+	CHECK_EQUAL(usbsim_in(3, buffer), USBSIM_NAK);
+	keymap_reset(&storeData.keymap);
+}
+
+// Once idle, the timer only polls the columns, and the first press is scanned and reported without delay
+static void test_idle_wake(void) {
+	profileReport_t report;
+
+	enumerate();
+	usbsim_sof();
+	usbsim_in(3, buffer);
+	scan(MATRIX_IDLE_SCANS);
+	profile_reset();
+	scan(10);
+	profile_copy_report(PROFILE_REPORT_SITE(PROFILE_SITE_SCAN), &report);
+	CHECK_EQUAL(report.site.site.count, 0);
+
+	press_key(1);
+	scan(1);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	CHECK_EQUAL(buffer[1 + USAGE_Z / 8], 1 << (USAGE_Z % 8));
+	profile_copy_report(PROFILE_REPORT_SITE(PROFILE_SITE_SCAN), &report);
+	CHECK_EQUAL(report.site.site.count, 1);
+	profile_copy_report(PROFILE_REPORT_SITE(PROFILE_SITE_WAKE), &report);
+	CHECK_EQUAL(report.site.site.count, 1);
+
+	press_key(0);
+	scan(20);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+
+	// Only a keyboard report ends the measurement, not a media key on its own endpoint
+	storeData.keymap[0][0] = KEY_MEDIA_VOLUME_UP;
+	scan(MATRIX_IDLE_SCANS);
+	profile_reset();
+	press_key(1);
+	scan(1);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(5, buffer), 2);
+	profile_copy_report(PROFILE_REPORT_SITE(PROFILE_SITE_WAKE), &report);
+	CHECK_EQUAL(report.site.site.count, 0);
+	press_key(0);
+	scan(20);
+	usbsim_sof();
+	usbsim_in(5, buffer);
+	storeData.keymap[0][0] = KEY_Z;
+}
+
+static void test_suspend_remote_wakeup(void) {
+	enumerate();
+	usbsim_sof();
+	usbsim_in(3, buffer);
+	CHECK_EQUAL(usbsim_control(0x80, 0x00, 0, 0, 2, buffer), 2); // GET_STATUS
+	CHECK_EQUAL(buffer[0], 0);
+
+	// Not enabled by the host: a key press leaves the bus suspended, the host resumes it
+	usbsim_suspend();
+	CHECK(usbSuspended);
+	CHECK(USBCON & (1 << FRZCLK));
+	press_key(1);
+	scan(1);
+	advance_ms(5);
+	usb_remote_wakeup();
+	CHECK(usbSuspended);
+	CHECK(!(UDCON & (1 << RMWKUP)));
+	usbsim_resume();
+	CHECK(!usbSuspended);
+	CHECK(!(USBCON & (1 << FRZCLK)));
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	press_key(0);
+	scan(20);
+	usbsim_sof();
+	usbsim_in(3, buffer);
+
+	// Enabled: the press signals resume, once the bus has been idle long enough
+	CHECK_EQUAL(usbsim_control(0x00, 0x03, 0x0001, 0, 0, NULL), 0); // SET_FEATURE DEVICE_REMOTE_WAKEUP
+	CHECK_EQUAL(usbsim_control(0x80, 0x00, 0, 0, 2, buffer), 2);
+	CHECK_EQUAL(buffer[0], 0x02);
+	usbsim_suspend();
+	press_key(1);
+	scan(1);
+	usb_remote_wakeup();
+	CHECK(usbSuspended); // Within the 5 ms of idle bus
+	advance_ms(5);
+	usb_remote_wakeup();
+	CHECK(!usbSuspended);
+	CHECK(UDCON & (1 << RMWKUP));
+	UDCON &= ~(1 << RMWKUP);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	CHECK_EQUAL(buffer[1 + USAGE_Z / 8], 1 << (USAGE_Z % 8));
+	press_key(0);
+	scan(20);
+	usbsim_sof();
+	usbsim_in(3, buffer);
+}
+
+// The PF6 column has no pin change interrupt: while suspended and idle timer 0 keeps polling it, and a press found
+// that way wakes the host
+static void test_suspended_idle_wake(void) {
+	enumerate();
+	usbsim_sof();
+	usbsim_in(3, buffer);
+	usbsim_control(0x00, 0x03, 0x0001, 0, 0, NULL); // SET_FEATURE DEVICE_REMOTE_WAKEUP
+	scan(MATRIX_IDLE_SCANS);
+	usbsim_suspend();
+	CHECK(!matrix_wakes_on_pin_change()); // main_sleep() stays in idle sleep
+	CHECK(TIMSK0 & (1 << OCIE0A));
+	CHECK(!(PCICR & (1 << PCIE0)));
+
+	press_key(1);
+	scan(1);
+	advance_ms(5);
+	usb_remote_wakeup();
+	CHECK(!usbSuspended);
+	UDCON &= ~(1 << RMWKUP);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	CHECK_EQUAL(buffer[1 + USAGE_Z / 8], 1 << (USAGE_Z % 8));
+	press_key(0);
+	scan(20);
+	usbsim_sof();
+	usbsim_in(3, buffer);
+}
+
+#if USB_CDC
+// Console over the CDC-ACM interface: bytes go out in full packets, short ones only after a few frames
+static void test_cdc_console(void) {
+	uint8_t lineCoding[7];
+	char text[CONSOLE_REPLY_MAX + 1];
+
+	enumerate();
+	CHECK_EQUAL(usbsim_control(0xA1, 0x21, 0, 3, sizeof(lineCoding), lineCoding), 7); // GET_LINE_CODING
+	CHECK_EQUAL(lineCoding[0] | (lineCoding[1] << 8), 38400);
+	CHECK_EQUAL(usbsim_control(0xA1, 0x21, 0, 0, sizeof(lineCoding), lineCoding), USBSIM_STALL); // Keyboard interface
+
+	// Nothing goes out before a terminal opened the port
+	uart_print("boot\r\n");
+	for (uint8_t frame = 0; frame < 10; frame++) {
+		usbsim_sof();
+	}
+	CHECK_EQUAL(usbsim_in(2, buffer), USBSIM_NAK);
+	CHECK_EQUAL(usbsim_control(0x21, 0x22, 0x0001, 3, 0, NULL), 0); // SET_CONTROL_LINE_STATE DTR
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(2, buffer), USBSIM_NAK); // Waiting for a full packet
+	for (uint8_t frame = 1; frame < 4; frame++) {
+		usbsim_sof();
+	}
+	CHECK_EQUAL(usbsim_in(2, buffer), 6);
+	CHECK(memcmp(buffer, "boot\r\n", 6) == 0);
+
+	// A full packet goes out in the next frame
+	memset(text, 'x', CONSOLE_REPLY_MAX);
+	text[CONSOLE_REPLY_MAX] = '\0';
+	uart_print(text);
+	uart_print("tail");
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(2, buffer), 64);
+	CHECK_EQUAL(usbsim_in(2, buffer), USBSIM_NAK);
+	for (uint8_t frame = 0; frame < 4; frame++) {
+		usbsim_sof();
+	}
+	CHECK_EQUAL(usbsim_in(2, buffer), 4);
+
+	// Commands come in on the OUT endpoint, the reply follows the echo
+	CHECK_EQUAL(usbsim_out(1, (const uint8_t *)"k 0 0 4\r", 8), 8);
+	usbsim_sof();
+	console_task();
+	for (uint8_t frame = 0; frame < 4; frame++) {
+		usbsim_sof();
+	}
+	CHECK_EQUAL(usbsim_in(2, buffer), 15);
+	CHECK(memcmp(buffer, "k 0 0 4\r\nk 04\r\n", 15) == 0);
+	CHECK_EQUAL(storeData.keymap[0][0], KEY_A);
+	hostEepromWrites = 0;
+	commit_settings();
+	CHECK(hostEepromWrites > 0);
+
+	CHECK_EQUAL(usbsim_out(1, (const uint8_t *)"x\r", 2), 2);
+	usbsim_sof();
+	console_task();
+	for (uint8_t frame = 0; frame < 4; frame++) {
+		usbsim_sof();
+	}
+	CHECK_EQUAL(usbsim_in(2, buffer), 6);
+	CHECK(memcmp(buffer, "x\r\n?\r\n", 6) == 0);
+
+	// The profiler listing, a line per site and the counters
+	CHECK_EQUAL(usbsim_out(1, (const uint8_t *)"p\r", 2), 2);
+	usbsim_sof();
+	for (uint8_t i = 0; i < PROFILE_SITES + 2; i++) {
+		console_task();
+	}
+	uint16_t received = 0;
+	for (uint8_t frame = 0; frame < 10; frame++) {
+		int length;
+
+		usbsim_sof();
+		while ((length = usbsim_in(2, buffer + received)) > 0) {
+			received += length;
+		}
+	}
+	buffer[received] = '\0';
+	CHECK(strstr((char *)buffer, "\r\n0 ") != NULL);
+	CHECK(strstr((char *)buffer, "\r\nc ") != NULL);
+
+	// A full packet, a paste, is taken in one frame and frees the bank for the next one
+	uint8_t pasted = 0;
+	uint8_t c;
+	memset(text, ' ', 64);
+	CHECK_EQUAL(usbsim_out(1, (const uint8_t *)text, 64), 64);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_out(1, (const uint8_t *)"\r", 1), 1);
+	usbsim_sof();
+	while (uart_read(&c)) {
+		pasted++;
+	}
+	CHECK_EQUAL(pasted, 65);
+	keymap_reset(&storeData.keymap);
+}
+#endif
+
+#if SPLIT
+void USART1_RX_vect(void);
+void USART1_UDRE_vect(void);
+
+// The test plays the other half on the far end of USART1: a packet from it goes in byte by byte
+static void link_receive(uint8_t type, const uint8_t *payload, uint8_t length, uint8_t crcError) {
+	uint8_t header = (type << 5) | length;
+	uint8_t crc = _crc8_ccitt_update(0, header);
+	uint8_t bytes[SPLIT_PAYLOAD_MAX + 3] = { SPLIT_SYNC, header };
+
+	for (uint8_t i = 0; i < length; i++) {
+		bytes[2 + i] = payload[i];
+		crc = _crc8_ccitt_update(crc, payload[i]);
+	}
+	bytes[2 + length] = crc ^ crcError;
+	for (uint8_t i = 0; i < length + 3; i++) {
+		UCSR1A = 0;
+		UDR1 = bytes[i];
+		USART1_RX_vect();
+	}
+}
+
+// Whatever the firmware queued for the other half
+static uint8_t link_sent(uint8_t *data) {
+	uint8_t length = 0;
+
+	while (UCSR1B & (1 << UDRIE1)) {
+		USART1_UDRE_vect();
+		if (UCSR1B & (1 << UDRIE1)) {
+			data[length++] = UDR1;
+		}
+	}
+	return length;
+}
+
+static uint16_t link_counter(uint8_t counter) {
+	profileReport_t report;
+
+	profile_copy_report(PROFILE_REPORT_COUNTERS, &report);
+	return report.counters.counters[counter];
+}
+
+static void test_split_link(void) {
+	uint8_t delta[2] = { 0, 0x80 }; // Sequence 0, key 0 of the other half pressed
+	uint8_t state[2] = { 1, 0 }; // Next delta 1, nothing pressed
+
+	enumerate();
+	split_init();
+	profile_reset();
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+
+	// The first scan tells the other half about the keys of this one
+	scan(1);
+	CHECK_EQUAL(link_sent(buffer), 5);
+	CHECK_EQUAL(buffer[0], SPLIT_SYNC);
+	CHECK_EQUAL(buffer[1], (SPLIT_PACKET_STATE << 5) | 2);
+
+	// A delta that came in before the SOF is in that frame's report
+	link_receive(SPLIT_PACKET_DELTA, delta, sizeof(delta), 0);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	CHECK_EQUAL(buffer[1 + USAGE_C / 8], 1 << (USAGE_C % 8));
+
+	// A broken packet is dropped and the whole state asked for, then the state releases the key
+	delta[0] = 1;
+	delta[1] = 0x00;
+	link_receive(SPLIT_PACKET_DELTA, delta, sizeof(delta), 0x55);
+	CHECK_EQUAL(link_counter(PROFILE_COUNTER_LINK_ERROR), 1);
+	CHECK_EQUAL(link_sent(buffer), 3);
+	CHECK_EQUAL(buffer[1], SPLIT_PACKET_RESYNC << 5);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), USBSIM_NAK);
+	link_receive(SPLIT_PACKET_STATE, state, sizeof(state), 0);
+	usbsim_sof();
+	CHECK_EQUAL(usbsim_in(3, buffer), sizeof(keyboardNkroReport_t));
+	CHECK_EQUAL(buffer[1 + USAGE_C / 8], 0);
+
+	// A delta after a gap in the sequence is not applied either
+	delta[0] = 2;
+	delta[1] = 0x80;
+	link_receive(SPLIT_PACKET_DELTA, delta, sizeof(delta), 0);
+	CHECK_EQUAL(link_counter(PROFILE_COUNTER_LINK_ERROR), 2);
+	link_sent(buffer);
+
+	// The configured half pings, the pong gives the round trip. Four frames went by so far.
+	for (uint8_t frame = 4; frame < SPLIT_PING_FRAMES - 1; frame++) {
+		usbsim_sof();
+	}
+	CHECK_EQUAL(link_sent(buffer), 0);
+	usbsim_sof();
+	CHECK_EQUAL(link_sent(buffer), 5);
+	CHECK_EQUAL(buffer[1], (SPLIT_PACKET_PING << 5) | 2);
+	link_receive(SPLIT_PACKET_PONG, &buffer[2], 2, 0);
+	profile_copy_report(PROFILE_REPORT_SITE(PROFILE_SITE_SPLIT_RTT), (profileReport_t *)buffer);
+	CHECK_EQUAL(((profileReport_t *)buffer)->site.site.count, 1);
+}
+#endif
+
+typedef struct {
+	const char *name;
+	void (*run)(void);
+} test_t;
+
+static const test_t tests[] = {
+	{ "device descriptor", test_device_descriptor },
+	{ "set address", test_set_address },
+	{ "configuration descriptor", test_configuration_descriptor },
+	{ "hid report descriptor", test_hid_report_descriptor },
+	{ "unknown request stalls", test_unknown_request_stalls },
+	{ "configuration", test_configuration },
+	{ "endpoint halt", test_endpoint_halt },
+	{ "hid class requests", test_hid_class_requests },
+#if !USB_CDC
+	{ "profiler reports", test_profiler_reports },
+	{ "scan locked to sof", test_scan_locked_to_sof },
+	{ "dropped reports", test_dropped_reports },
+#endif
+	{ "keyboard reports", test_keyboard_reports },
+	{ "idle rate", test_idle_rate },
+	{ "keymap layers", test_keymap_layers },
+#if !USB_CDC
+	{ "settings store", test_settings_store },
+#endif
+	{ "macro", test_macro },
+	{ "tap within a frame", test_tap_within_a_frame },
+#if KEYMAP_KEYS > 1
+	{ "chord in one report", test_chord_in_one_report },
+#endif
+	{ "boot protocol reports", test_boot_protocol_reports },
+	{ "consumer and mouse reports", test_consumer_and_mouse_reports },
+	{ "idle wake", test_idle_wake },
+	{ "suspend and remote wakeup", test_suspend_remote_wakeup },
+	{ "suspended idle wake", test_suspended_idle_wake },
+#if USB_CDC
+	{ "cdc console", test_cdc_console },
+#endif
+#if SPLIT
+	{ "split link", test_split_link },
+#endif
+};
+
+int main(void) {
+	for (unsigned int i = 0; i < sizeof(tests) / sizeof(test_t); i++) {
+		int before = testFailures;
+		tests[i].run();
+		printf("%s %s\n", (testFailures == before) ? "PASS" : "FAIL", tests[i].name);
+	}
+	printf("%d failure(s)\n", testFailures);
+	return testFailures ? 1 : 0;
+}
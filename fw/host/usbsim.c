@@ -0,0 +1,353 @@
+#include <avr/io.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "usbsim.h"
+#include "../usb.h"
+
+#define USBSIM_INTERRUPT_LIMIT	100 // Interrupts per bus event before the model calls it a storm
+
+#define USBSIM_UEINTX_CLEARABLE	((1 << TXINI) | (1 << STALLEDI) | (1 << RXOUTI) | (1 << RXSTPI) | (1 << NAKOUTI) | (1 << NAKINI) | (1 << FIFOCON))
+#define USBSIM_UEIENX_MASK		0x5F // UEIENX enable bits sit at the position of their UEINTX flag
+
+#define USBSIM_ADDRESS_PLLCSR	0x49
+#define USBSIM_ADDRESS_UDINT	0xE1
+#define USBSIM_ADDRESS_UENUM	0xE9
+#define USBSIM_ADDRESS_UERST	0xEA
+
+typedef struct {
+	uint8_t ueintx; // Flags as the firmware reads and writes them
+	uint8_t flags; // Flags as the model last set them, a difference with ueintx is a firmware write
+	uint8_t ueconx;
+	uint8_t uecfg0x;
+	uint8_t uecfg1x;
+	uint8_t uesta0x;
+	uint8_t uesta1x;
+	uint8_t ueienx;
+	uint8_t uebclx;
+	uint8_t uebchx;
+	uint8_t bank[USBSIM_BANK_SIZE]; // Bank currently accessed through UEDATX
+	uint8_t count; // OUT or SETUP bytes in bank
+	uint8_t index; // UEDATX position in bank
+	uint8_t queue[2][USBSIM_BANK_SIZE]; // IN packets handed over by the firmware, waiting for the host
+	uint8_t queueLength[2];
+	uint8_t queued;
+	uint8_t overrun; // Target of UEDATX accesses past the end of the bank
+} usbsimEndpoint_t;
+
+volatile uint8_t avrIo[0x100];
+
+static usbsimEndpoint_t usbsimEndpoints[USBSIM_ENDPOINTS];
+static uint8_t usbsimUdint = 0; // UDINT flags as the model set them
+static uint16_t usbsimFrame = 0;
+static uint16_t usbsimInterrupts = 0;
+
+static uint8_t usbsim_is_control(const usbsimEndpoint_t *ep) {
+	return (ep->uecfg0x & ((1 << EPTYPE1) | (1 << EPTYPE0))) == 0;
+}
+
+static uint8_t usbsim_is_in(const usbsimEndpoint_t *ep) {
+	return ep->uecfg0x & (1 << EPDIR);
+}
+
+static uint8_t usbsim_banks(const usbsimEndpoint_t *ep) {
+	return (ep->uecfg1x & (1 << EPBK0)) ? 2 : 1;
+}
+
+static uint8_t usbsim_size(const usbsimEndpoint_t *ep) {
+	return 8 << ((ep->uecfg1x >> EPSIZE0) & 0x07);
+}
+
+static void usbsim_queue(usbsimEndpoint_t *ep) {
+	if (ep->queued < 2) {
+		memcpy(ep->queue[ep->queued], ep->bank, ep->index);
+		ep->queueLength[ep->queued] = ep->index;
+		ep->queued++;
+	}
+	ep->index = 0;
+}
+
+// Recompute the flags that follow the bank state
+static void usbsim_update(usbsimEndpoint_t *ep) {
+	if (!(ep->ueconx & (1 << EPEN))) {
+		ep->flags = 0;
+		return;
+	}
+	if (usbsim_is_control(ep)) {
+		if (ep->queued) {
+			ep->flags &= ~(1 << TXINI);
+		} else {
+			ep->flags |= (1 << TXINI);
+		}
+	} else if (usbsim_is_in(ep)) {
+		if (ep->queued < usbsim_banks(ep)) {
+			ep->flags |= (1 << TXINI) | (1 << RWAL) | (1 << FIFOCON);
+		} else {
+			ep->flags &= ~((1 << TXINI) | (1 << RWAL) | (1 << FIFOCON));
+		}
+	} else if (ep->count) {
+		ep->flags |= (1 << RXOUTI) | (1 << RWAL) | (1 << FIFOCON);
+	}
+}
+
+// Apply what the firmware wrote since the last register access
+static void usbsim_sync(void) {
+	if (avrIo[USBSIM_ADDRESS_PLLCSR] & (1 << PLLE)) {
+		avrIo[USBSIM_ADDRESS_PLLCSR] |= (1 << PLOCK); // The PLL locks instantly
+	} else {
+		avrIo[USBSIM_ADDRESS_PLLCSR] &= ~(1 << PLOCK);
+	}
+
+	usbsimUdint &= avrIo[USBSIM_ADDRESS_UDINT]; // Writing one has no effect, writing zero clears
+	avrIo[USBSIM_ADDRESS_UDINT] = usbsimUdint;
+
+	for (uint8_t i = 1; i < USBSIM_ENDPOINTS; i++) {
+		if (avrIo[USBSIM_ADDRESS_UERST] & (1 << i)) {
+			usbsimEndpoints[i].queued = 0;
+			usbsimEndpoints[i].count = 0;
+			usbsimEndpoints[i].index = 0;
+		}
+	}
+
+	for (uint8_t i = 0; i < USBSIM_ENDPOINTS; i++) {
+		usbsimEndpoint_t *ep = &usbsimEndpoints[i];
+		uint8_t cleared = ep->flags & ~ep->ueintx & USBSIM_UEINTX_CLEARABLE;
+
+		if (cleared & ((1 << RXSTPI) | (1 << RXOUTI))) {
+			ep->count = 0; // Bank released
+			ep->index = 0;
+		}
+		if (usbsim_is_control(ep) && (cleared & (1 << TXINI))) {
+			usbsim_queue(ep);
+		}
+		if (!usbsim_is_control(ep) && (cleared & (1 << FIFOCON))) {
+			if (usbsim_is_in(ep)) {
+				usbsim_queue(ep);
+			} else {
+				ep->count = 0;
+				ep->index = 0;
+			}
+		}
+		ep->flags &= ~cleared;
+
+		if (ep->ueconx & (1 << STALLRQC)) {
+			ep->ueconx &= ~((1 << STALLRQ) | (1 << STALLRQC));
+		}
+		ep->uesta0x = (ep->uecfg1x & (1 << ALLOC)) ? (1 << CFGOK) : 0;
+		ep->uebclx = ep->count ? ep->count - ep->index : ep->index;
+
+		usbsim_update(ep);
+		ep->ueintx = ep->flags;
+	}
+}
+
+volatile uint8_t *usbsim_reg(uint8_t address) {
+	usbsim_sync();
+
+	usbsimEndpoint_t *ep = &usbsimEndpoints[avrIo[USBSIM_ADDRESS_UENUM] % USBSIM_ENDPOINTS];
+	switch (address) {
+		case 0xE8: return &ep->ueintx;
+		case 0xEB: return &ep->ueconx;
+		case 0xEC: return &ep->uecfg0x;
+		case 0xED: return &ep->uecfg1x;
+		case 0xEE: return &ep->uesta0x;
+		case 0xEF: return &ep->uesta1x;
+		case 0xF0: return &ep->ueienx;
+		case 0xF2: return &ep->uebclx;
+		case 0xF3: return &ep->uebchx;
+		case 0xF1:
+			if (ep->index < USBSIM_BANK_SIZE) {
+				return &ep->bank[ep->index++];
+			}
+			return &ep->overrun;
+	}
+	return &avrIo[address];
+}
+
+// Call the firmware interrupt routines for as long as an enabled interrupt is pending
+static void usbsim_run(void) {
+	for (uint8_t n = 0; n < USBSIM_INTERRUPT_LIMIT; n++) {
+		usbsim_sync();
+		if (usbsimUdint & UDIEN & 0x7F) {
+			usbsimInterrupts++;
+			USB_GEN_vect();
+			continue;
+		}
+
+		uint8_t pending = 0;
+		for (uint8_t i = 0; i < USBSIM_ENDPOINTS; i++) {
+			if (usbsimEndpoints[i].flags & usbsimEndpoints[i].ueienx & USBSIM_UEIENX_MASK) {
+				pending = 1;
+			}
+		}
+		if (!pending) {
+			return;
+		}
+		usbsimInterrupts++;
+		USB_COM_vect();
+	}
+	fprintf(stderr, "usbsim: interrupt storm, UDINT=0x%02X UDIEN=0x%02X\n", usbsimUdint, UDIEN);
+	abort();
+}
+
+void usbsim_power_on(void) {
+	memset((void *)avrIo, 0, sizeof(avrIo));
+	memset(usbsimEndpoints, 0, sizeof(usbsimEndpoints));
+	usbsimUdint = 0;
+	usbsimFrame = 0;
+	usbsimInterrupts = 0;
+	usb_init();
+	usbsim_run();
+}
+
+void usbsim_bus_reset(void) {
+	memset(usbsimEndpoints, 0, sizeof(usbsimEndpoints)); // Reset deconfigures every endpoint
+	UDADDR = 0;
+	usbsimUdint |= (1 << EORSTI);
+	avrIo[USBSIM_ADDRESS_UDINT] = usbsimUdint;
+	usbsim_run();
+}
+
+void usbsim_sof(void) {
+	usbsimFrame = (usbsimFrame + 1) & 0x7FF;
+	UDFNUM = usbsimFrame;
+	usbsimUdint |= (1 << SOFI);
+	avrIo[USBSIM_ADDRESS_UDINT] = usbsimUdint;
+	usbsim_run();
+}
+
+// Three idle milliseconds on the bus
+void usbsim_suspend(void) {
+	usbsimUdint |= (1 << SUSPI);
+	avrIo[USBSIM_ADDRESS_UDINT] = usbsimUdint;
+	usbsim_run();
+}
+
+// The host drives resume on the bus, the controller sees activity
+void usbsim_resume(void) {
+	usbsimUdint |= (1 << WAKEUPI);
+	avrIo[USBSIM_ADDRESS_UDINT] = usbsimUdint;
+	usbsim_run();
+}
+
+uint8_t usbsim_address(void) {
+	return (UDADDR & (1 << ADDEN)) ? (UDADDR & 0x7F) : 0;
+}
+
+uint16_t usbsim_interrupt_count(void) {
+	return usbsimInterrupts;
+}
+
+int usbsim_setup(const uint8_t *setup) {
+	usbsimEndpoint_t *ep = &usbsimEndpoints[0];
+
+	usbsim_sync();
+	if (!(ep->ueconx & (1 << EPEN))) {
+		return USBSIM_TIMEOUT;
+	}
+	memcpy(ep->bank, setup, 8);
+	ep->count = 8;
+	ep->index = 0;
+	ep->queued = 0; // A SETUP aborts any transfer in progress
+	ep->ueconx &= ~(1 << STALLRQ);
+	ep->flags = (ep->flags & ~(1 << RXOUTI)) | (1 << RXSTPI);
+	ep->ueintx = ep->flags;
+	usbsim_run();
+	return 8;
+}
+
+int usbsim_in(uint8_t endpoint, uint8_t *data) {
+	usbsimEndpoint_t *ep = &usbsimEndpoints[endpoint];
+
+	usbsim_sync();
+	if (!(ep->ueconx & (1 << EPEN))) {
+		return USBSIM_TIMEOUT;
+	}
+	if (ep->ueconx & (1 << STALLRQ)) {
+		return USBSIM_STALL;
+	}
+	if (!ep->queued) {
+		return USBSIM_NAK;
+	}
+
+	int length = ep->queueLength[0];
+	memcpy(data, ep->queue[0], length);
+	memmove(ep->queue[0], ep->queue[1], USBSIM_BANK_SIZE);
+	ep->queueLength[0] = ep->queueLength[1];
+	ep->queued--;
+	usbsim_update(ep);
+	ep->ueintx = ep->flags;
+	usbsim_run();
+	return length;
+}
+
+int usbsim_out(uint8_t endpoint, const uint8_t *data, uint8_t length) {
+	usbsimEndpoint_t *ep = &usbsimEndpoints[endpoint];
+
+	usbsim_sync();
+	if (!(ep->ueconx & (1 << EPEN))) {
+		return USBSIM_TIMEOUT;
+	}
+	if (ep->ueconx & (1 << STALLRQ)) {
+		return USBSIM_STALL;
+	}
+	if (ep->count || (ep->flags & (1 << RXOUTI))) {
+		return USBSIM_NAK; // Previous packet not read yet
+	}
+	if (length) {
+		memcpy(ep->bank, data, length);
+	}
+	ep->count = length;
+	ep->index = 0;
+	ep->flags |= (1 << RXOUTI);
+	usbsim_update(ep);
+	ep->ueintx = ep->flags;
+	usbsim_run();
+	return length;
+}
+
+int usbsim_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint8_t *data) {
+	uint8_t setup[8] = { bmRequestType, bRequest, wValue, wValue >> 8, wIndex, wIndex >> 8, wLength, wLength >> 8 };
+	uint8_t packet[USBSIM_BANK_SIZE];
+	uint8_t packetSize = usbsim_size(&usbsimEndpoints[0]);
+	uint16_t total = 0;
+	int result;
+
+	result = usbsim_setup(setup);
+	if (result < 0) {
+		return result;
+	}
+
+	if (bmRequestType & 0x80) {
+		while (total < wLength) {
+			result = usbsim_in(0, packet);
+			if (result < 0) {
+				return result;
+			}
+			if (total + result > wLength) {
+				return USBSIM_TIMEOUT; // Babble, the device sent more than asked for
+			}
+			memcpy(data + total, packet, result);
+			total += result;
+			if (result < packetSize) {
+				break;
+			}
+		}
+		result = usbsim_out(0, NULL, 0); // Status stage
+		return (result < 0) ? result : total;
+	}
+
+	while (total < wLength) {
+		uint8_t length = (wLength - total < packetSize) ? wLength - total : packetSize;
+		result = usbsim_out(0, data + total, length);
+		if (result < 0) {
+			return result;
+		}
+		total += length;
+	}
+	result = usbsim_in(0, packet); // Status stage
+	if (result < 0) {
+		return result;
+	}
+	return (result == 0) ? total : USBSIM_TIMEOUT;
+}
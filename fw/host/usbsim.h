@@ -0,0 +1,39 @@
+#ifndef USBSIM_H
+#define USBSIM_H
+
+#include <stdint.h>
+
+/*
+Scripted USB host for the host build. It plays the bus side of the ATmega32U4 USB controller: it fills the
+endpoint banks, raises the flags, calls the firmware interrupt routines while an enabled interrupt is pending and
+collects the IN packets the firmware hands over.
+*/
+
+#define USBSIM_ENDPOINTS	7
+#define USBSIM_BANK_SIZE	64
+
+#define USBSIM_NAK		-1
+#define USBSIM_STALL	-2
+#define USBSIM_TIMEOUT	-3
+
+// Firmware interrupt routines called by the model
+void USB_GEN_vect(void);
+void USB_COM_vect(void);
+
+void usbsim_power_on(void);
+void usbsim_bus_reset(void);
+void usbsim_sof(void);
+void usbsim_suspend(void);
+void usbsim_resume(void);
+uint8_t usbsim_address(void);
+uint16_t usbsim_interrupt_count(void);
+
+// Single transactions, the return value is the packet length or one of USBSIM_NAK/USBSIM_STALL
+int usbsim_setup(const uint8_t *setup);
+int usbsim_in(uint8_t endpoint, uint8_t *data);
+int usbsim_out(uint8_t endpoint, const uint8_t *data, uint8_t length);
+
+// Whole control transfer on endpoint 0, returns the data stage length or a negative USBSIM_ code
+int usbsim_control(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength, uint8_t *data);
+
+#endif
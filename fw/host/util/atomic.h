@@ -0,0 +1,9 @@
+#ifndef HOST_UTIL_ATOMIC_H
+#define HOST_UTIL_ATOMIC_H
+
+// Interrupts are function calls made by the test, so every block is atomic already
+#define ATOMIC_BLOCK(type) for (uint8_t atomicOnce = 1; atomicOnce; atomicOnce = 0)
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+
+#endif
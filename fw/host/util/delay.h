@@ -0,0 +1,9 @@
+#ifndef HOST_UTIL_DELAY_H
+#define HOST_UTIL_DELAY_H
+
+// Time does not pass on the host, the test drives the timer interrupts itself
+#define _delay_ms(ms) do {} while (0)
+#define _delay_us(us) do {} while (0)
+#define __builtin_avr_delay_cycles(cycles) do {} while (0)
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef HOST_UTIL_SETBAUD_H
+#define HOST_UTIL_SETBAUD_H
+
+#define UBRR_VALUE	(((F_CPU) + 8UL * (BAUD)) / (16UL * (BAUD)) - 1UL)
+#define UBRRL_VALUE	(UBRR_VALUE & 0xFF)
+#define UBRRH_VALUE	(UBRR_VALUE >> 8)
+#define USE_2X		0
+
+#endif
@@ -1,32 +1,110 @@
 #include <avr/io.h>
-#include <util/delay.h>
-// #include "led.h"
-
-void sendBit(uint8_t bitVal) {
-    if (bitVal) {
-        // Send a '1' bit
-        PORTF |= (1 << PORTF5);  // Set pin high
-        _delay_us(0.8);  // Approximately 800 ns
-        PORTF &= ~(1 << PORTF5); // Set pin low
-        _delay_us(0.45); // Approximately 450 ns
-    } else {
-        // Send a '0' bit
-        PORTF |= (1 << PORTF5);  // Set pin high
-        _delay_us(0.4);  // Approximately 400 ns
-        PORTF &= ~(1 << PORTF5); // Set pin low
-        _delay_us(0.85); // Approximately 850 ns
-    }
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "led.h"
+#include "clock.h"
+#include "profile.h"
+#include "bench.h"
+
+#if F_CPU != 16000000UL
+#error "The WS2812 bit timing in led_send_pixel() is counted for 16 MHz"
+#endif
+
+#define LED_LATCH_TICKS ((uint32_t)LED_LATCH_US * CLOCK_TICKS_PER_US)
+
+static uint8_t ledFrame[LED_COUNT * 3]; // Wire order: green, red, blue
+static uint8_t ledDirty = 0;
+static uint32_t ledLatchStart = 0; // Clock time the line went low after the last frame
+
+/*
+Send the 24 bits of one pixel. One bit is 20 cycles (1.25 us):
+  '0' high for 6 cycles (375 ns) and low for 14 cycles (875 ns)
+  '1' high for 12 cycles (750 ns) and low for 8 cycles (500 ns)
+The line stays low 7 cycles longer between bytes, which the pixels tolerate.
+*/
+static void led_send_pixel(const uint8_t *pixel) {
+	uint8_t byte;
+	uint8_t bits;
+	uint8_t count = 3;
+
+	asm volatile(
+		"0:"						"\n\t"
+		"ld   %[byte], %a[pixel]+"	"\n\t" // 2
+		"ldi  %[bits], 8"			"\n\t" // 1
+		"1:"						"\n\t" //   T (cycle the instruction starts at)
+		"sbi  %[port], %[pin]"		"\n\t" // 2  0  line high
+		"sbrs %[byte], 7"			"\n\t" // 1  2  (2 when skipping)
+		"rjmp 2f"					"\n\t" // 2  3
+		"rjmp .+0"					"\n\t" // 2  4  '1' bit
+		"rjmp .+0"					"\n\t" // 2  6
+		"rjmp .+0"					"\n\t" // 2  8
+		"rjmp .+0"					"\n\t" // 2  10
+		"cbi  %[port], %[pin]"		"\n\t" // 2  12 line low
+		"rjmp 3f"					"\n\t" // 2  14
+		"2:"						"\n\t" //       '0' bit
+		"nop"						"\n\t" // 1  5
+		"cbi  %[port], %[pin]"		"\n\t" // 2  6  line low
+		"rjmp .+0"					"\n\t" // 2  8
+		"rjmp .+0"					"\n\t" // 2  10
+		"rjmp .+0"					"\n\t" // 2  12
+		"rjmp .+0"					"\n\t" // 2  14
+		"3:"						"\n\t"
+		"lsl  %[byte]"				"\n\t" // 1  16
+		"dec  %[bits]"				"\n\t" // 1  17
+		"brne 1b"					"\n\t" // 2  18 -> next bit high at 20
+		"dec  %[count]"				"\n\t" // 1
+		"brne 0b"					"\n\t" // 2
+		: [byte] "=&r" (byte), [bits] "=&d" (bits), [count] "+r" (count), [pixel] "+e" (pixel)
+		: [port] "I" (_SFR_IO_ADDR(LED_PORT)), [pin] "I" (LED_PIN)
+		: "memory" // Reads the pixel bytes through the pointer, the frame buffer stores have to be done before
+	);
 }
 
-void sendByte(uint8_t byte) {
-    for (int8_t i = 7; i >= 0; i--) {
-        sendBit(byte & (1 << i));
-    }
+static void led_show(void) {
+	BENCH_ENTER(BENCH_SITE_LED);
+	uint16_t profileStart = profile_start();
+	for (uint8_t i = 0; i < LED_COUNT; i++) {
+		// The bit timing must not be stretched by an interrupt, but only one pixel (30 us) at a time is protected.
+		// An interrupt between two pixels only lengthens a low period, well below the latch time.
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			led_send_pixel(&ledFrame[i * 3]);
+		}
+	}
+	ledLatchStart = clock_now();
+	profile_end(PROFILE_SITE_LED, profileStart);
+	BENCH_EXIT(BENCH_SITE_LED);
 }
 
-void sendColor(uint8_t green, uint8_t red, uint8_t blue) {
-    sendByte(green);
-    sendByte(red);
-    sendByte(blue);
-    _delay_ms(50); // RES
-}
\ No newline at end of file
+void led_init(void) {
+	LED_DDR |= (1 << LED_PIN);
+	LED_PORT &= ~(1 << LED_PIN); // Idle low
+	for (uint8_t i = 0; i < sizeof(ledFrame); i++) {
+		ledFrame[i] = 0;
+	}
+	ledDirty = 1; // Pixels power up in an unknown state
+	ledLatchStart = clock_now();
+}
+
+void led_set(uint8_t index, uint8_t red, uint8_t green, uint8_t blue) {
+	uint8_t *pixel = &ledFrame[index * 3];
+
+	if (index >= LED_COUNT || (pixel[0] == green && pixel[1] == red && pixel[2] == blue)) {
+		return;
+	}
+	pixel[0] = green;
+	pixel[1] = red;
+	pixel[2] = blue;
+	ledDirty = 1;
+}
+
+// Send the frame if it changed and the previous one has latched, otherwise return right away. Call from the main loop.
+void led_task(void) {
+	if (!ledDirty) {
+		return;
+	}
+	if (((clock_now() - ledLatchStart) & 0xFFFFFFUL) < LED_LATCH_TICKS) {
+		return;
+	}
+	ledDirty = 0;
+	led_show();
+}
@@ -1,12 +1,19 @@
 #ifndef LED_H
 #define LED_H
 
-#include <stdio.h>
+#include <stdint.h>
 
-void sendBit(uint8_t bitVal);
+#define LED_COUNT 1 // WS2812 pixels on the chain
 
-void sendByte(uint8_t byte);
+// Data line of the chain, sbi/cbi need an I/O register so the port must be below 0x20 in I/O space
+#define LED_PORT	PORTF
+#define LED_DDR		DDRF
+#define LED_PIN		PORTF5
 
-void sendColor(uint8_t green, uint8_t red, uint8_t blue);
+#define LED_LATCH_US 50 // Line held low this long makes the pixels latch the frame
 
-#endif
\ No newline at end of file
+void led_init(void);
+void led_set(uint8_t index, uint8_t red, uint8_t green, uint8_t blue);
+void led_task(void);
+
+#endif
@@ -1,10 +1,44 @@
-#include <stdio.h>
 #include <avr/io.h>
 #include <util/delay.h>
 #include "usb.h"
 #include "uart.h"
+#include "matrix.h"
+#include "keymap.h"
+#include "clock.h"
+#include "trace.h"
+#include "led.h"
+#include "anim.h"
+#include "profile.h"
+#include "store.h"
+#include "console.h"
+#include "split.h"
+#include "event.h"
+#include "bench.h"
 #include <avr/interrupt.h>
-char buffer[40];  // Buffer for formatted string
+#include <avr/sleep.h>
+
+// Bound on the time from clock_init() to the USB controller attached and ready to enumerate
+#define STARTUP_BUDGET_US		2000
+#define STARTUP_BUDGET_TICKS	((uint32_t)STARTUP_BUDGET_US * CLOCK_TICKS_PER_US)
+
+/*
+Sleep until the next interrupt. All work of the loop comes from interrupts (scan, USB, USART, the timer 1 overflow
+of the clock), so idle sleep costs no latency. While the bus is suspended and only a pin change can restart the
+scan, power down instead: the USB wake up and the pin change interrupts still work without the clock. With the
+matrix of this board, one column on PF6, timer 0 has to keep polling it and the suspended keypad stays in idle sleep.
+*/
+static void main_sleep(void) {
+    cli(); // Checked and slept on without an interrupt in between
+#if SPLIT
+    set_sleep_mode(SLEEP_MODE_IDLE); // The link receiver needs the clock
+#else
+    set_sleep_mode((usbSuspended && matrix_wakes_on_pin_change()) ? SLEEP_MODE_PWR_DOWN : SLEEP_MODE_IDLE);
+#endif
+    sleep_enable();
+    sei(); // The instruction after sei always runs first, the sleep can not miss an interrupt
+    sleep_cpu();
+    sleep_disable();
+}
 
 int main(void) {
     // Set LED(Green) at PC6
@@ -15,31 +49,58 @@ int main(void) {
     DDRE |= (1 << PORTE6);
     PORTE &= ~(1 << PORTE6);
 
-    // Set port F pin 6 as an input
-    DDRF &= ~(1 << PORTF6);
-    // Enable pull-up resistor on PF6
-    PORTF |= (1 << PORTF6);
-
-    // Set port F pin 5 as an output
-    DDRF |= (1 << PORTF5);
-    PORTF |= (1 << PORTF5);
-
-    // Need to find a new pin for LED programming.
-    // sendColor(0x00, 0xff, 0x00); // green, red, blue
-
     uart_init();
+    clock_init(); // Timestamps for the trace records, LED frame and latch timing
+    TRACE_INFO(TRACE_BOOT, MCUSR);
+    profile_reset();
+    if (!store_init()) { // Blank EEPROM or settings of an older layout
+        keymap_reset(&storeData.keymap);
+        storeData.ledEffect = ANIM_EFFECT_BREATHING;
+        storeData.ledColor = (animColor_t){ ANIM_FULL, ANIM_NONE, ANIM_NONE }; // Red
+    }
+    led_init();
+    anim_init();
+    anim_set_effect(storeData.ledEffect, storeData.ledColor);
+    keymap_init(&storeData.keymap);
+#if SPLIT
+    split_init(); // Before the first scan sends its state
+#endif
+    matrix_init(); // Switch inputs are scanned from the timer 0 interrupt from here on
 	usb_init();
+
+    uint32_t startup = clock_now(); // Does not include what runs before clock_init(), a few microseconds
+    BENCH_EVENT(BENCH_SITE_READY);
+    TRACE_INFO(TRACE_STARTUP, startup, startup >> 8, startup >> 16, startup > STARTUP_BUDGET_TICKS);
+
+    uint8_t wasPressed = 0;
     while (1) {
+        BENCH_EVENT(BENCH_SITE_MAIN_LOOP);
+        uint16_t profileStart = profile_start();
 
         // Check if switch is pressed
-        if (!(PINF & (1 << PORTF6))) {
+        if (matrix_is_pressed(0, 0)) {
             PORTC |= (1 << PORTC6);
-            sprintf(buffer, "usbAddressConfig=%x\r\n", usbAddressConfig);
-            uart_print(buffer);
+            if (!wasPressed) {
+                TRACE_INFO(TRACE_KEY_PRESS, 0, 0, usbAddressConfig);
+                anim_key_press(0);
+            }
+            wasPressed = 1;
         } else {
             // Switch is not pressed, turn off the LED
             PORTC &= ~(1 << PORTC6);
+            wasPressed = 0;
+        }
+        if (store_task()) { // The host changed the settings
+            anim_set_effect(storeData.ledEffect, storeData.ledColor);
+        }
+        anim_task();
+        led_task(); // Sends the frame only when it changed
+        trace_flush(); // Send the events recorded by the interrupts
+        console_task();
+        if (event_pending()) {
+            usb_remote_wakeup(); // Only does something while suspended, with remote wakeup enabled by the host
         }
-        _delay_ms(50); // Debounce delay
+        profile_end(PROFILE_SITE_MAIN_LOOP, profileStart);
+        main_sleep();
     }
 }
@@ -0,0 +1,364 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/delay.h> // __builtin_avr_delay_cycles on the host
+#include <util/atomic.h>
+#include <stddef.h>
+#include "matrix.h"
+#include "debounce.h"
+#include "event.h"
+#include "profile.h"
+#include "bench.h"
+#include "clock.h"
+#include "split.h"
+
+#define MATRIX_TIMER_PRESCALER	64
+#define MATRIX_TIMER_TOP		((F_CPU / MATRIX_TIMER_PRESCALER / 1000UL) * MATRIX_SCAN_PERIOD_US / 1000UL - 1)
+
+#if MATRIX_TIMER_TOP > 255
+#error "MATRIX_SCAN_PERIOD_US does not fit in the 8-bit timer 0"
+#endif
+
+// Timer 0 count to restart from on SOF, the compare match then comes MATRIX_SOF_LEAD_US before the next SOF
+#define MATRIX_SOF_LEAD_TICKS	((F_CPU / MATRIX_TIMER_PRESCALER / 1000UL) * MATRIX_SOF_LEAD_US / 1000UL)
+
+#if MATRIX_SOF_LOCK && MATRIX_SCAN_PERIOD_US != 1000
+#error "MATRIX_SOF_LOCK needs MATRIX_SCAN_PERIOD_US at the 1 ms frame period"
+#endif
+#if MATRIX_SOF_LOCK && MATRIX_SOF_LEAD_TICKS > MATRIX_TIMER_TOP
+#error "MATRIX_SOF_LEAD_US is longer than the frame"
+#endif
+
+// Rounded up, 2 cycles at 16 MHz
+#define MATRIX_SETTLE_CYCLES	((F_CPU / 1000000UL * MATRIX_SETTLE_NS + 999) / 1000)
+// The release wait is timed on the low byte of Timer1
+#define MATRIX_RELEASE_TICKS	(MATRIX_RELEASE_US * CLOCK_TICKS_PER_US)
+
+#if MATRIX_RELEASE_TICKS > 255
+#error "MATRIX_RELEASE_US does not fit in the low byte of timer 1"
+#endif
+
+// Longest scan: every row settles and waits out the whole release bound, plus a generous allowance for the debounce,
+// the events and the split link of one scan at 16 MHz
+#define MATRIX_SCAN_BASE_US	20
+#define MATRIX_SCAN_MAX_US	(MATRIX_ROWS * (MATRIX_RELEASE_US + (MATRIX_SETTLE_NS + 999) / 1000) + MATRIX_SCAN_BASE_US)
+
+#if MATRIX_SOF_LOCK && MATRIX_SOF_LEAD_US < MATRIX_SCAN_MAX_US
+#error "MATRIX_SOF_LEAD_US is shorter than the longest scan, it would end after the SOF"
+#endif
+#if MATRIX_IDLE_SCANS && MATRIX_IDLE_SCANS <= DEBOUNCE_TICKS
+#error "MATRIX_IDLE_SCANS has to outlast the debounce window"
+#endif
+
+// On AVR the DDRx and PORTx registers directly follow PINx, so a pin is fully described by its PINx address
+#define MATRIX_DDR(pin)		(*((pin)->reg + 1))
+#define MATRIX_PORT(pin)	(*((pin)->reg + 2))
+
+typedef struct {
+	volatile uint8_t *reg; // PINx register of the port
+	uint8_t mask;
+} matrixPin_t;
+
+// Rows are strobed low one at a time while the columns are read with their pull-ups enabled.
+// A row without a register has its switches wired straight to ground and is always selected.
+static const matrixPin_t matrixRowPins[MATRIX_ROWS] = {
+	{ NULL, 0 },
+};
+
+typedef struct {
+	volatile uint8_t *reg; // PINx register of the port
+	uint8_t mask; // Port bits of consecutive columns
+	int8_t shift; // Column of the lowest bit minus its bit number in the port
+} matrixColRun_t;
+
+// Columns as runs of port bits that map to consecutive columns. Runs on the same port go next to each other, the
+// port is then read once per row and every run only costs a mask and a shift.
+static const matrixColRun_t matrixColRuns[] = {
+	{ &PINF, (1 << PORTF6), 0 - PORTF6 }, // Column 0
+};
+
+#define MATRIX_COL_RUNS	(sizeof(matrixColRuns) / sizeof(matrixColRuns[0]))
+
+volatile matrixRow_t matrixState[MATRIX_ROWS];
+
+#if !MATRIX_DIODES
+// Last raw state of each row that was free of ghosts
+static matrixRow_t matrixClean[MATRIX_ROWS];
+#endif
+
+// Timer1 count at the end of the last scan, only used by the timer 0 and SOF interrupts, which do not nest
+static uint16_t matrixScanEnd;
+static uint8_t matrixScanDone = 0;
+
+// Idle state, only used by the timer 0, pin change and SOF interrupts
+static uint16_t matrixIdleScans = 0; // Scans in a row with every key released
+static uint8_t matrixIdle = 0; // The scan is stopped and every row is driven low
+static uint8_t matrixWakePins = 0; // Columns on PORTB, with a pin change interrupt
+static uint8_t matrixWakePolled = 0; // Some column has no pin change interrupt, timer 0 polls it while idle
+static uint8_t matrixRowsDriven = 0; // Some row has a pin, as opposed to all wired to ground
+static uint16_t matrixWakeStart; // Timer1 count when the idle scan saw the first press
+static uint8_t matrixWakePending = 0; // No report has been loaded since
+
+static void matrix_select_row(const matrixPin_t *pin) {
+	if (pin->reg) {
+		MATRIX_DDR(pin) |= pin->mask; // Drive the row low
+		MATRIX_PORT(pin) &= ~pin->mask;
+	}
+}
+
+static void matrix_unselect_row(const matrixPin_t *pin) {
+	if (pin->reg) {
+		MATRIX_DDR(pin) &= ~pin->mask; // Back to input with pull-up so the row floats high
+		MATRIX_PORT(pin) |= pin->mask;
+	}
+}
+
+static matrixRow_t matrix_read_cols(void) {
+	volatile uint8_t *reg = NULL;
+	uint8_t pins = 0;
+	matrixRow_t cols = 0;
+
+	for (uint8_t i = 0; i < MATRIX_COL_RUNS; i++) {
+		const matrixColRun_t *run = &matrixColRuns[i];
+		if (run->reg != reg) {
+			reg = run->reg;
+			pins = ~*reg; // Pressed keys pull the column low
+		}
+		matrixRow_t bits = pins & run->mask;
+		cols |= (run->shift >= 0) ? (matrixRow_t)(bits << run->shift) : (matrixRow_t)(bits >> -run->shift);
+	}
+	return cols;
+}
+
+// Pressed keys held their columns low through a row that was just unselected, wait for the pull-ups
+static void matrix_wait_release(void) {
+	uint8_t start = TCNT1L;
+
+	while (matrix_read_cols() && (uint8_t)(TCNT1L - start) < MATRIX_RELEASE_TICKS) {
+	}
+}
+
+static matrixRow_t matrix_read_row(const matrixPin_t *pin) {
+	if (!pin->reg) {
+		return matrix_read_cols();
+	}
+	matrix_select_row(pin);
+	__builtin_avr_delay_cycles(MATRIX_SETTLE_CYCLES);
+	matrixRow_t cols = matrix_read_cols();
+	matrix_unselect_row(pin);
+	if (cols) {
+		matrix_wait_release(); // Before the next strobe
+	}
+	return cols;
+}
+
+#if !MATRIX_DIODES
+// Every row is checked against the raw state of the others, a row that is held back still shows its ghost partner
+static void matrix_suppress_ghosts(matrixRow_t *raw) {
+	uint8_t ghosts = 0;
+
+	for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+		uint8_t ghost = 0;
+		if (raw[row] & (raw[row] - 1)) { // Two keys or more
+			for (uint8_t other = 0; other < MATRIX_ROWS; other++) {
+				matrixRow_t common = raw[row] & raw[other];
+				if (other != row && (common & (common - 1))) {
+					ghost = 1;
+					break;
+				}
+			}
+		}
+		if (ghost) {
+			ghosts = 1;
+		} else {
+			matrixClean[row] = raw[row];
+		}
+	}
+	for (uint8_t row = 0; ghosts && row < MATRIX_ROWS; row++) {
+		raw[row] = matrixClean[row];
+	}
+	if (ghosts) {
+		profile_count(PROFILE_COUNTER_GHOST);
+	}
+}
+#endif
+
+#if MATRIX_IDLE_SCANS
+/*
+Every key released for MATRIX_IDLE_SCANS scans: drive all rows low so that any key pulls its column low, and stop
+the scan. The pin change interrupt is armed before the rows go low, a key already down then raises it at once.
+*/
+static void matrix_idle(void) {
+	if (matrixWakePins) {
+		PCMSK0 = matrixWakePins;
+		PCIFR = (1 << PCIF0);
+		PCICR |= (1 << PCIE0);
+	}
+	for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+		matrix_select_row(&matrixRowPins[row]);
+	}
+	matrixIdle = 1;
+	matrixWakePending = 0;
+	if (!matrixWakePolled) {
+		TIMSK0 = 0; // Only a pin change restarts the scan
+	}
+}
+
+static void matrix_wake(void) {
+	PCICR &= ~(1 << PCIE0);
+	for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+		matrix_unselect_row(&matrixRowPins[row]);
+	}
+	if (matrixRowsDriven) {
+		matrix_wait_release(); // Before the first strobe
+	}
+	matrixIdle = 0;
+	matrixIdleScans = 0;
+	matrixWakeStart = profile_start();
+	matrixWakePending = 1;
+	TIMSK0 = (1 << OCIE0A);
+}
+#endif
+
+static void matrix_scan(void) {
+	matrixRow_t raw[MATRIX_ROWS];
+	matrixRow_t active = 0;
+
+	for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+		raw[row] = matrix_read_row(&matrixRowPins[row]);
+	}
+#if !MATRIX_DIODES
+	matrix_suppress_ghosts(raw);
+#endif
+	for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+		matrixRow_t rowState = debounce_row(row, raw[row]);
+		matrixRow_t changed = rowState ^ matrixState[row];
+		active |= raw[row] | rowState;
+		matrixState[row] = rowState;
+		for (uint8_t col = 0; changed; col++, changed >>= 1) {
+			if (changed & 1) {
+				if (!event_push(row * MATRIX_COLS + col, (rowState >> col) & 1)) {
+					profile_count(PROFILE_COUNTER_DROPPED_EVENT);
+				}
+#if SPLIT
+				split_key(row * MATRIX_COLS + col, (rowState >> col) & 1);
+#endif
+			}
+		}
+	}
+#if SPLIT
+	split_scan_end();
+#endif
+#if MATRIX_IDLE_SCANS
+	if (active) {
+		matrixIdleScans = 0;
+	} else if (++matrixIdleScans >= MATRIX_IDLE_SCANS) {
+		matrix_idle();
+	}
+#endif
+}
+
+// A scan with its profile and the end time the next SOF measures its staleness from
+static void matrix_scan_timed(void) {
+	uint16_t profileStart = profile_start();
+	matrix_scan();
+	profile_end(PROFILE_SITE_SCAN, profileStart);
+	matrixScanEnd = profile_start();
+	matrixScanDone = 1;
+}
+
+void matrix_init(void) {
+	matrixRowsDriven = 0;
+	for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+		matrix_unselect_row(&matrixRowPins[row]);
+		matrixRowsDriven |= (matrixRowPins[row].reg != NULL);
+		matrixState[row] = 0;
+#if !MATRIX_DIODES
+		matrixClean[row] = 0;
+#endif
+	}
+	debounce_init();
+	event_init();
+	matrixWakePins = 0;
+	matrixWakePolled = 0;
+	for (uint8_t i = 0; i < MATRIX_COL_RUNS; i++) {
+		MATRIX_DDR(&matrixColRuns[i]) &= ~matrixColRuns[i].mask; // Input
+		MATRIX_PORT(&matrixColRuns[i]) |= matrixColRuns[i].mask; // Enable pull-up resistor
+		if (matrixColRuns[i].reg == &PINB) {
+			matrixWakePins |= matrixColRuns[i].mask; // PCINT0 to PCINT7 are PB0 to PB7
+		} else {
+			matrixWakePolled = 1;
+		}
+	}
+	matrixIdle = 0;
+	matrixIdleScans = 0;
+	matrixWakePending = 0;
+	PCICR &= ~(1 << PCIE0);
+
+	// Timer 0 in CTC mode fires the scan at a fixed period, global interrupts are enabled by usb_init()
+	TCCR0A = (1 << WGM01);
+	TCCR0B = (1 << CS01) | (1 << CS00); // clk/64
+	OCR0A = MATRIX_TIMER_TOP;
+	TIMSK0 = (1 << OCIE0A);
+}
+
+/*
+Called from the SOF interrupt before the report is built. Records how long ago the last scan ended, which is how
+stale the key state going into the report is, and re-phases the scan timer when locked to the frame.
+*/
+void matrix_sof(void) {
+	if (matrixScanDone) {
+		profile_end(PROFILE_SITE_SOF_PHASE, matrixScanEnd);
+		matrixScanDone = 0;
+	}
+#if MATRIX_SOF_LOCK
+	TCNT0 = MATRIX_SOF_LEAD_TICKS;
+#endif
+}
+
+// A report was loaded for the host. The first one after the scan woke up ends the wake latency measurement.
+void matrix_reported(void) {
+	if (matrixWakePending) {
+		profile_end(PROFILE_SITE_WAKE, matrixWakeStart);
+		matrixWakePending = 0;
+	}
+}
+
+// Non-zero while the scan is stopped and only a pin change can restart it, timer 0 does not interrupt then.
+// Never the case with the PF6 column of this board, which timer 0 polls.
+uint8_t matrix_wakes_on_pin_change(void) {
+	return matrixIdle && !matrixWakePolled;
+}
+
+uint8_t matrix_is_pressed(uint8_t row, uint8_t col) {
+	matrixRow_t rowState;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		rowState = matrixState[row]; // Two bytes with more than 8 columns, the scan must not update it in between
+	}
+	return (rowState >> col) & 1;
+}
+
+// Timer 0 compare match Interrupt Service Routine
+ISR(TIMER0_COMPA_vect) {
+#if MATRIX_IDLE_SCANS
+	if (matrixIdle) {
+		if (!matrix_read_cols()) {
+			return; // Still idle, only the columns were polled with every row selected
+		}
+		matrix_wake();
+	}
+#endif
+	BENCH_ENTER(BENCH_SITE_SCAN);
+	matrix_scan_timed();
+	BENCH_EXIT(BENCH_SITE_SCAN);
+}
+
+#if MATRIX_IDLE_SCANS
+// Pin change interrupt of the PORTB columns, only enabled while idle. The press is scanned right away.
+ISR(PCINT0_vect) {
+	if (matrixIdle) {
+		matrix_wake();
+		matrix_scan_timed();
+	}
+}
+#endif
@@ -0,0 +1,53 @@
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#include <stdint.h>
+#include "keypad.h" // MATRIX_ROWS, MATRIX_COLS and MATRIX_SCAN_PERIOD_US, timer 0 runs the scan in steps of 4 us (clk/64)
+
+// Each row strobe reads every column port once, so the scan costs about the same per row whatever the column count.
+// MATRIX_SETTLE_NS is the wait between the strobe and the read: two cycles cover the input synchronizer of the port,
+// longer wiring with more capacitance needs more. After a row with pressed keys the columns are polled until they
+// are back high, at most MATRIX_RELEASE_US, so that the next row does not read the previous one.
+#ifndef MATRIX_SETTLE_NS
+#define MATRIX_SETTLE_NS 125
+#endif
+#ifndef MATRIX_RELEASE_US
+#define MATRIX_RELEASE_US 10
+#endif
+
+// Scans with every key released before the scan stops (0 never stops). The rows are then all driven low and a
+// column going low restarts the scan at once: columns on PORTB through their pin change interrupt, the others
+// because timer 0 keeps polling them instead of running the scan. Either way the press is seen within a scan period.
+// The column of this keypad is PF6, which has no pin change interrupt: it is always polled, so the suspended keypad
+// sleeps in idle mode and never powers down (see main_sleep()). Power down needs every column on PORTB.
+#ifndef MATRIX_IDLE_SCANS
+#define MATRIX_IDLE_SCANS 500
+#endif
+
+// Set when every switch has a diode. Without diodes three pressed corners of a rectangle also close the fourth, so
+// rows that share two or more pressed columns keep their last clean state until the ambiguity goes away.
+#ifndef MATRIX_DIODES
+#define MATRIX_DIODES 0
+#endif
+
+// Lock the scan to the USB frame: every SOF restarts timer 0 so that the scan starts MATRIX_SOF_LEAD_US before the
+// next SOF loads the report. The lead has to cover the scan itself plus the longest other interrupt that can delay
+// it, otherwise the scan slips behind the SOF and the report is a frame late. matrix.c checks it against the longest
+// scan. Without SOFs the timer free runs.
+#ifndef MATRIX_SOF_LOCK
+#define MATRIX_SOF_LOCK 1
+#endif
+#ifndef MATRIX_SOF_LEAD_US
+#define MATRIX_SOF_LEAD_US 100 // In steps of 4 us
+#endif
+
+// Bit c of matrixState[r] is set while the key at row r and column c is pressed (debounced)
+extern volatile matrixRow_t matrixState[MATRIX_ROWS];
+
+void matrix_init(void);
+void matrix_sof(void);
+void matrix_reported(void);
+uint8_t matrix_wakes_on_pin_change(void);
+uint8_t matrix_is_pressed(uint8_t row, uint8_t col);
+
+#endif
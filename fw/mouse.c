@@ -0,0 +1,61 @@
+#include <string.h>
+#include "mouse.h"
+#include "keyboard.h"
+#include "keymap.h"
+
+static uint8_t mouseButtons = 0; // Buttons of the last report
+static uint16_t mouseFrames = 0; // Frames a move or wheel key has been held, for the acceleration
+
+/*
+Mouse keys: a report every frame while a move or wheel key is held, speeding up the longer it is held, and one on
+every button change. Returns the report length in bytes, or zero when there is nothing to send.
+*/
+uint8_t mouse_build_report(mouseReport_t *report) {
+	const uint8_t *codes = keyboard_codes();
+	uint8_t speed = MOUSE_SPEED_MIN + mouseFrames / MOUSE_ACCEL_FRAMES;
+	uint8_t wheel = (mouseFrames % MOUSE_WHEEL_FRAMES) == 0;
+	uint8_t moving = 0;
+
+	if (speed > MOUSE_SPEED_MAX) {
+		speed = MOUSE_SPEED_MAX;
+	}
+	memset(report, 0, sizeof(mouseReport_t));
+	for (uint8_t key = 0; key < KEYMAP_KEYS; key++) {
+		uint8_t code = codes[key];
+
+		if (!KEY_IS_MOUSE(code)) {
+			continue;
+		}
+		moving |= (code != KEY_MOUSE_BUTTON1 && code != KEY_MOUSE_BUTTON2 && code != KEY_MOUSE_BUTTON3);
+		switch (code) {
+			case KEY_MOUSE_UP:			report->y -= speed; break;
+			case KEY_MOUSE_DOWN:		report->y += speed; break;
+			case KEY_MOUSE_LEFT:		report->x -= speed; break;
+			case KEY_MOUSE_RIGHT:		report->x += speed; break;
+			case KEY_MOUSE_WHEEL_UP:	report->wheel += wheel; break;
+			case KEY_MOUSE_WHEEL_DOWN:	report->wheel -= wheel; break;
+			case KEY_MOUSE_BUTTON1:
+			case KEY_MOUSE_BUTTON2:
+			case KEY_MOUSE_BUTTON3:
+				report->buttons |= 1 << (code - KEY_MOUSE_BUTTON1);
+			break;
+		}
+	}
+	if (!moving) {
+		mouseFrames = 0;
+	} else if (mouseFrames < 0xFFFF) {
+		mouseFrames++;
+	}
+	if (!report->x && !report->y && !report->wheel && report->buttons == mouseButtons) {
+		return 0;
+	}
+	mouseButtons = report->buttons;
+	return sizeof(mouseReport_t);
+}
+
+// The buttons of the last report and no motion, for GET_REPORT. Returns the report length in bytes.
+uint8_t mouse_copy_report(mouseReport_t *report) {
+	memset(report, 0, sizeof(mouseReport_t));
+	report->buttons = mouseButtons;
+	return sizeof(mouseReport_t);
+}
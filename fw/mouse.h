@@ -0,0 +1,22 @@
+#ifndef MOUSE_H
+#define MOUSE_H
+
+#include <stdint.h>
+
+#define MOUSE_SPEED_MIN		1 // Counts per frame when a move key goes down
+#define MOUSE_SPEED_MAX		12
+#define MOUSE_ACCEL_FRAMES	32 // Frames held per speed step
+#define MOUSE_WHEEL_FRAMES	60 // Frames between wheel steps while a wheel key is held
+
+// Mouse input report: three buttons, relative X, Y and wheel
+typedef struct {
+	uint8_t buttons;
+	int8_t x;
+	int8_t y;
+	int8_t wheel;
+} __attribute__((packed)) mouseReport_t;
+
+uint8_t mouse_build_report(mouseReport_t *report);
+uint8_t mouse_copy_report(mouseReport_t *report);
+
+#endif
@@ -0,0 +1,96 @@
+#include <avr/io.h>
+#include <util/atomic.h>
+#include <string.h>
+#include "profile.h"
+#include "clock.h"
+
+#define PROFILE_FRAME_MASK 0x07FF // UDFNUM is 11 bits
+
+static profileSite_t profileSites[PROFILE_SITES];
+static uint16_t profileCounters[PROFILE_COUNTERS];
+static uint16_t profileLastFrame;
+static uint8_t profileFrameValid = 0;
+
+void profile_reset(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		memset(profileSites, 0, sizeof(profileSites));
+		for (uint8_t i = 0; i < PROFILE_SITES; i++) {
+			profileSites[i].min = 0xFFFF;
+		}
+		memset(profileCounters, 0, sizeof(profileCounters));
+	}
+}
+
+// Timer1 count at the start of a measured section, read atomically because the main loop is measured too
+uint16_t profile_start(void) {
+	uint16_t now;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		now = TCNT1;
+	}
+	return now;
+}
+
+void profile_end(uint8_t site, uint16_t start) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		profileSite_t *stat = &profileSites[site];
+		uint16_t duration = TCNT1 - start; // Wraps correctly for anything below 32 ms
+		uint16_t scaled = duration >> PROFILE_HISTOGRAM_SHIFT;
+		uint8_t bucket = 0;
+
+		while (scaled && bucket < PROFILE_HISTOGRAM_BUCKETS - 1) {
+			scaled >>= 1;
+			bucket++;
+		}
+		stat->histogram[bucket]++;
+		stat->count++;
+		stat->total += duration;
+		if (duration < stat->min) {
+			stat->min = duration;
+		}
+		if (duration > stat->max) {
+			stat->max = duration;
+		}
+	}
+}
+
+void profile_count(uint8_t counter) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		profileCounters[counter]++;
+	}
+}
+
+// Called on every SOF interrupt with UDFNUM, counts the frame numbers skipped since the previous one
+void profile_sof(uint16_t frame) {
+	if (profileFrameValid) {
+		profileCounters[PROFILE_COUNTER_MISSED_SOF] += (frame - profileLastFrame - 1) & PROFILE_FRAME_MASK;
+	}
+	profileLastFrame = frame;
+	profileFrameValid = 1;
+}
+
+// Frames stop for a reason (bus reset, suspend), the next SOF starts counting afresh
+void profile_sof_lost(void) {
+	profileFrameValid = 0;
+}
+
+// Snapshot of one feature report, returns its length or zero for an unknown report ID
+uint8_t profile_copy_report(uint8_t reportId, profileReport_t *report) {
+	if (reportId >= PROFILE_REPORT_SITE(0) && reportId < PROFILE_REPORT_SITE(PROFILE_SITES)) {
+		report->site.reportId = reportId;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			memcpy(&report->site.site, &profileSites[reportId - PROFILE_REPORT_SITE(0)], sizeof(profileSite_t));
+		}
+		return sizeof(profileSiteReport_t);
+	}
+	if (reportId == PROFILE_REPORT_COUNTERS) {
+		report->counters.reportId = reportId;
+		report->counters.ticksPerUs = CLOCK_TICKS_PER_US;
+		report->counters.histogramShift = PROFILE_HISTOGRAM_SHIFT;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			memcpy(report->counters.counters, profileCounters, sizeof(profileCounters));
+		}
+		return sizeof(profileCountersReport_t);
+	}
+	return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+/*
+On-device profiler. Durations are Timer1 ticks (see clock.h) between profile_start() and profile_end(), the ISR
+prologue and epilogue are not included. The statistics are read by the host as vendor HID feature reports,
+see tools/profile_read.py, or with USB_CDC through the console (console.h).
+*/
+
+#define PROFILE_SITE_USB_GEN	0
+#define PROFILE_SITE_USB_COM	1
+#define PROFILE_SITE_SCAN		2
+#define PROFILE_SITE_LED		3
+#define PROFILE_SITE_MAIN_LOOP	4
+#define PROFILE_SITE_SOF_PHASE	5 // Not a section: from the end of the last scan to the SOF that reports it
+#define PROFILE_SITE_SPLIT_RTT	6 // Not a section: round trip of a ping over the split link, see split.h
+#define PROFILE_SITE_WAKE		7 // Not a section: from the idle scan seeing a press to the first report loaded
+#define PROFILE_SITES			8
+
+#define PROFILE_COUNTER_MISSED_SOF		0 // Frames between two SOF interrupts that never raised one
+#define PROFILE_COUNTER_STALL			1 // Control requests answered with STALL
+#define PROFILE_COUNTER_DROPPED_REPORT	2 // Frames a keyboard report was due but the endpoint had no free bank for it
+#define PROFILE_COUNTER_DROPPED_EVENT	3 // Key events lost to a full event queue
+#define PROFILE_COUNTER_GHOST			4 // Scans that held back a row because of a possible ghost key
+#define PROFILE_COUNTER_LINK_ERROR		5 // Split link packets lost to line, CRC or sequence errors or a full buffer
+#define PROFILE_COUNTERS				6
+
+#define PROFILE_HISTOGRAM_BUCKETS	8
+#define PROFILE_HISTOGRAM_SHIFT		3 // Bucket 0 is below 1 << 3 ticks (4 us), every next one doubles, the last is open
+
+// Feature report IDs: one per site, then the counters. Writing any of them resets everything.
+#define PROFILE_REPORT_SITE(site)	((site) + 1)
+#define PROFILE_REPORT_COUNTERS		(PROFILE_SITES + 1)
+
+typedef struct {
+	uint32_t count;
+	uint32_t total; // Sum of the durations, the host divides by count for the mean
+	uint16_t min;
+	uint16_t max;
+	uint16_t histogram[PROFILE_HISTOGRAM_BUCKETS];
+} __attribute__((packed)) profileSite_t;
+
+typedef struct {
+	uint8_t reportId;
+	profileSite_t site;
+} __attribute__((packed)) profileSiteReport_t;
+
+typedef struct {
+	uint8_t reportId;
+	uint8_t ticksPerUs;
+	uint8_t histogramShift;
+	uint16_t counters[PROFILE_COUNTERS];
+} __attribute__((packed)) profileCountersReport_t;
+
+typedef union {
+	profileSiteReport_t site;
+	profileCountersReport_t counters;
+} profileReport_t;
+
+void profile_reset(void);
+uint16_t profile_start(void);
+void profile_end(uint8_t site, uint16_t start);
+void profile_count(uint8_t counter);
+void profile_sof(uint16_t frame);
+void profile_sof_lost(void);
+uint8_t profile_copy_report(uint8_t reportId, profileReport_t *report);
+
+#endif
@@ -0,0 +1,315 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/crc16.h>
+#include <string.h>
+#include "split.h"
+#include "event.h"
+#include "profile.h"
+
+#if SPLIT
+
+#define BAUD SPLIT_BAUD
+#include <util/setbaud.h>
+
+#define SPLIT_TX_BUFFER_SIZE	64 // Power of two, at most 256
+#define SPLIT_TX_BUFFER_MASK	(SPLIT_TX_BUFFER_SIZE - 1)
+#define SPLIT_ROW_BYTES			((MATRIX_COLS + 7) / 8)
+#define SPLIT_STATE_LENGTH		(1 + MATRIX_ROWS * SPLIT_ROW_BYTES)
+#define SPLIT_HEADER(type, length)	(((type) << 5) | (length))
+
+#if SPLIT_TX_BUFFER_SIZE & SPLIT_TX_BUFFER_MASK
+#error "SPLIT_TX_BUFFER_SIZE must be a power of two"
+#endif
+#if SPLIT_PAYLOAD_MAX > 31
+#error "SPLIT_PAYLOAD_MAX does not fit in the packet header"
+#endif
+#if SPLIT_STATE_LENGTH > SPLIT_PAYLOAD_MAX
+#error "The matrix state does not fit in a packet"
+#endif
+#if MATRIX_ROWS * MATRIX_COLS > 128
+#error "Key numbers of a half do not fit in the 7 bits of a delta"
+#endif
+
+// Receiver states, a packet is taken byte by byte in the receive interrupt
+#define SPLIT_RX_HUNT		0 // Waiting for SPLIT_SYNC
+#define SPLIT_RX_HEADER		1
+#define SPLIT_RX_PAYLOAD	2
+#define SPLIT_RX_CRC		3
+
+/*
+The transmit buffer is filled by the scan, SOF and receive interrupts and drained by the data register empty
+interrupt. None of them nests and the main loop never sends, so the indices need no further protection.
+*/
+static volatile uint8_t splitTxBuffer[SPLIT_TX_BUFFER_SIZE];
+static volatile uint8_t splitTxHead = 0;
+static volatile uint8_t splitTxTail = 0;
+static uint8_t splitTxSequence = 0;
+static uint8_t splitSendState = 0; // The other half asked for a state packet
+static uint8_t splitStateScans = 0;
+
+// Changes of the local keys in the current scan, behind the sequence number
+static uint8_t splitDelta[SPLIT_PAYLOAD_MAX];
+static uint8_t splitDeltaLength = 1;
+static uint8_t splitDeltaOverflow = 0;
+
+static struct {
+	uint8_t state;
+	uint8_t header;
+	uint8_t length;
+	uint8_t index;
+	uint8_t crc;
+	uint8_t payload[SPLIT_PAYLOAD_MAX];
+} splitRx;
+static uint8_t splitRxSequence = 0; // Expected in the next delta
+
+// Keys of the other half as received, and as far as they went into the event queue
+static matrixRow_t splitRemote[MATRIX_ROWS];
+static matrixRow_t splitMerged[MATRIX_ROWS];
+static uint8_t splitRxIdle = 0; // Frames since the last packet
+static uint8_t splitPingFrames = 0;
+
+// Queue a whole packet, or nothing when it does not fit. Interrupt context only.
+static void split_send(uint8_t type, const uint8_t *payload, uint8_t length) {
+	uint8_t head = splitTxHead;
+	uint8_t header = SPLIT_HEADER(type, length);
+	uint8_t crc = _crc8_ccitt_update(0, header);
+
+	if (((splitTxTail - head - 1) & SPLIT_TX_BUFFER_MASK) < length + 3) {
+		profile_count(PROFILE_COUNTER_LINK_ERROR); // The other half notices the sequence gap and asks for the state
+		return;
+	}
+	splitTxBuffer[head] = SPLIT_SYNC;
+	head = (head + 1) & SPLIT_TX_BUFFER_MASK;
+	splitTxBuffer[head] = header;
+	head = (head + 1) & SPLIT_TX_BUFFER_MASK;
+	for (uint8_t i = 0; i < length; i++) {
+		splitTxBuffer[head] = payload[i];
+		head = (head + 1) & SPLIT_TX_BUFFER_MASK;
+		crc = _crc8_ccitt_update(crc, payload[i]);
+	}
+	splitTxBuffer[head] = crc;
+	splitTxHead = (head + 1) & SPLIT_TX_BUFFER_MASK;
+	UCSR1B |= (1 << UDRIE1);
+}
+
+static void split_send_state(void) {
+	uint8_t payload[SPLIT_STATE_LENGTH];
+	uint8_t *data = payload;
+
+	*data++ = splitTxSequence;
+	for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+		matrixRow_t rowState = matrixState[row];
+		for (uint8_t i = 0; i < SPLIT_ROW_BYTES; i++) {
+			*data++ = rowState;
+			rowState >>= 8;
+		}
+	}
+	split_send(SPLIT_PACKET_STATE, payload, sizeof(payload));
+}
+
+// Drop the packet being received and ask for the whole state, counted once per lost packet
+static void split_rx_error(void) {
+	if (splitRx.state != SPLIT_RX_HUNT) {
+		profile_count(PROFILE_COUNTER_LINK_ERROR);
+		split_send(SPLIT_PACKET_RESYNC, NULL, 0);
+	}
+	splitRx.state = SPLIT_RX_HUNT;
+}
+
+static void split_receive_delta(void) {
+	for (uint8_t i = 1; i < splitRx.length; i++) {
+		uint8_t key = splitRx.payload[i] & 0x7F;
+		if (key >= SPLIT_KEY_OFFSET) {
+			continue;
+		}
+		matrixRow_t bit = (matrixRow_t)1 << (key % MATRIX_COLS);
+		if (splitRx.payload[i] & 0x80) {
+			splitRemote[key / MATRIX_COLS] |= bit;
+		} else {
+			splitRemote[key / MATRIX_COLS] &= ~bit;
+		}
+	}
+}
+
+static void split_receive_state(void) {
+	const uint8_t *data = &splitRx.payload[1];
+
+	for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+		matrixRow_t rowState = 0;
+		for (uint8_t i = 0; i < SPLIT_ROW_BYTES; i++) {
+			rowState |= (matrixRow_t)*data++ << (8 * i);
+		}
+		splitRemote[row] = rowState;
+	}
+}
+
+// A packet with a good CRC, returns zero if its content does not fit the link state
+static uint8_t split_receive(void) {
+	uint8_t type = splitRx.header >> 5;
+
+	splitRxIdle = 0;
+	switch (type) {
+	case SPLIT_PACKET_DELTA:
+		if (splitRx.length < 1 || splitRx.payload[0] != splitRxSequence) {
+			return 0; // A delta went missing, the keys are only right again after a state
+		}
+		splitRxSequence++;
+		split_receive_delta();
+		return 1;
+	case SPLIT_PACKET_STATE:
+		if (splitRx.length != SPLIT_STATE_LENGTH) {
+			return 0;
+		}
+		splitRxSequence = splitRx.payload[0];
+		split_receive_state();
+		return 1;
+	case SPLIT_PACKET_RESYNC:
+		splitSendState = 1; // With the next scan, the state is complete then
+		return 1;
+	case SPLIT_PACKET_PING:
+		split_send(SPLIT_PACKET_PONG, splitRx.payload, splitRx.length);
+		return 1;
+	case SPLIT_PACKET_PONG:
+		if (splitRx.length != 2) {
+			return 0;
+		}
+		profile_end(PROFILE_SITE_SPLIT_RTT, splitRx.payload[0] | (splitRx.payload[1] << 8));
+		return 1;
+	}
+	return 0;
+}
+
+void split_init(void) {
+	UBRR1H = UBRRH_VALUE;
+	UBRR1L = UBRRL_VALUE;
+#if USE_2X
+	UCSR1A = (1 << U2X1);
+#else
+	UCSR1A = 0;
+#endif
+	UCSR1C = (1 << UCSZ11) | (1 << UCSZ10); // Asynchronous, 8-data, No parity, 1-stop
+	UCSR1B = (1 << RXEN1) | (1 << TXEN1) | (1 << RXCIE1);
+
+	splitTxHead = 0;
+	splitTxTail = 0;
+	splitSendState = 1; // Let the other half know the keys of this one from the first scan
+	splitStateScans = 0;
+	splitDeltaLength = 1;
+	splitDeltaOverflow = 0;
+	splitRx.state = SPLIT_RX_HUNT;
+	memset(splitRemote, 0, sizeof(splitRemote));
+	memset(splitMerged, 0, sizeof(splitMerged));
+	splitRxIdle = 0;
+	splitPingFrames = 0;
+}
+
+// A local key changed in this scan, called from the scan interrupt
+void split_key(uint8_t key, uint8_t pressed) {
+	if (splitDeltaLength == SPLIT_PAYLOAD_MAX) {
+		splitDeltaOverflow = 1; // Too many changes for a delta, the state covers them all
+		return;
+	}
+	splitDelta[splitDeltaLength++] = key | (pressed ? 0x80 : 0);
+}
+
+// End of the scan: send the changes, or the whole state when asked for, due or shorter
+void split_scan_end(void) {
+	if (splitSendState || splitDeltaOverflow || ++splitStateScans >= SPLIT_STATE_SCANS) {
+		split_send_state();
+		splitSendState = 0;
+		splitStateScans = 0;
+	} else if (splitDeltaLength > 1) {
+		splitDelta[0] = splitTxSequence++; // Used up even if the packet is dropped, so that the loss shows
+		split_send(SPLIT_PACKET_DELTA, splitDelta, splitDeltaLength);
+	}
+	splitDeltaLength = 1;
+	splitDeltaOverflow = 0;
+}
+
+/*
+Called from the SOF interrupt of the configured half before the report is built. Turns the changes of the other
+half received since the last frame into key events, so a packet that arrived before the SOF is in this report.
+The SOF and scan interrupts do not nest, so both can push to the event queue.
+*/
+void split_sof(void) {
+	if (splitRxIdle < SPLIT_TIMEOUT_FRAMES) {
+		splitRxIdle++;
+	} else {
+		memset(splitRemote, 0, sizeof(splitRemote)); // Link lost, release the keys of the other half
+	}
+	for (uint8_t row = 0; row < MATRIX_ROWS; row++) {
+		matrixRow_t changed = splitRemote[row] ^ splitMerged[row];
+		for (uint8_t col = 0; changed; col++, changed >>= 1) {
+			matrixRow_t bit = (matrixRow_t)1 << col;
+			if (!(changed & 1)) {
+				continue;
+			}
+			if (!event_push(SPLIT_KEY_OFFSET + row * MATRIX_COLS + col, (splitRemote[row] & bit) != 0)) {
+				return; // Queue full, the rest goes in a later frame
+			}
+			splitMerged[row] ^= bit;
+		}
+	}
+	if (++splitPingFrames >= SPLIT_PING_FRAMES) {
+		uint16_t now = profile_start();
+		uint8_t payload[2] = { now, now >> 8 };
+
+		splitPingFrames = 0;
+		split_send(SPLIT_PACKET_PING, payload, sizeof(payload));
+	}
+}
+
+// USART1 Receive Complete Interrupt Service Routine
+ISR(USART1_RX_vect) {
+	uint8_t status = UCSR1A; // The error flags belong to the byte in UDR1, read them first
+	uint8_t data = UDR1;
+
+	if (status & ((1 << FE1) | (1 << DOR1))) {
+		split_rx_error();
+		return;
+	}
+	switch (splitRx.state) {
+	case SPLIT_RX_HUNT:
+		if (data == SPLIT_SYNC) {
+			splitRx.state = SPLIT_RX_HEADER;
+		}
+		break;
+	case SPLIT_RX_HEADER:
+		splitRx.header = data;
+		splitRx.length = data & 0x1F;
+		splitRx.index = 0;
+		splitRx.crc = _crc8_ccitt_update(0, data);
+		if (splitRx.length > SPLIT_PAYLOAD_MAX) {
+			split_rx_error();
+		} else {
+			splitRx.state = splitRx.length ? SPLIT_RX_PAYLOAD : SPLIT_RX_CRC;
+		}
+		break;
+	case SPLIT_RX_PAYLOAD:
+		splitRx.payload[splitRx.index++] = data;
+		splitRx.crc = _crc8_ccitt_update(splitRx.crc, data);
+		if (splitRx.index == splitRx.length) {
+			splitRx.state = SPLIT_RX_CRC;
+		}
+		break;
+	default:
+		if (data != splitRx.crc || !split_receive()) {
+			split_rx_error();
+		} else {
+			splitRx.state = SPLIT_RX_HUNT;
+		}
+		break;
+	}
+}
+
+// USART1 Data Register Empty Interrupt Service Routine
+ISR(USART1_UDRE_vect) {
+	if (splitTxHead == splitTxTail) {
+		UCSR1B &= ~(1 << UDRIE1); // Buffer drained, mask the interrupt until the next packet
+		return;
+	}
+	UDR1 = splitTxBuffer[splitTxTail];
+	splitTxTail = (splitTxTail + 1) & SPLIT_TX_BUFFER_MASK;
+}
+
+#endif
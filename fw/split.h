@@ -0,0 +1,38 @@
+#ifndef SPLIT_H
+#define SPLIT_H
+
+#include <stdint.h>
+#include "matrix.h"
+
+/*
+Link between the two halves of a split keypad on USART1. Both halves run the same firmware and have the same
+matrix. Each sends the changes of its own debounced keys, the half the host configured merges the keys of the
+other one into its reports on the next SOF. The keys of the other half follow the local ones in the keymap.
+
+A packet is SPLIT_SYNC, a header with the type in the top 3 bits and the payload length in the low 5, the payload
+and a CRC-8 (polynomial 0x07) of the header and payload. Deltas carry a sequence number. A receiver that loses a
+packet to a line, CRC or sequence error hunts for the next SPLIT_SYNC and asks the other half for its whole state.
+*/
+
+// SPLIT, SPLIT_HALVES and SPLIT_KEY_OFFSET are in keypad.h, the keymap of the core sizes itself with them
+
+#define SPLIT_BAUD			1000000UL // Exact at 16 MHz, 10 us per byte
+#define SPLIT_SYNC			0xA5
+#define SPLIT_PAYLOAD_MAX	16 // At most 31, the header holds 5 bits of length
+
+#define SPLIT_PACKET_DELTA	0 // Sequence number, then a byte per key change: bit 7 set on press, key number below
+#define SPLIT_PACKET_STATE	1 // Sequence number of the next delta, then matrixState of every row, low byte first
+#define SPLIT_PACKET_RESYNC	2 // No payload, answered with a state packet
+#define SPLIT_PACKET_PING	3 // Timer1 count of the sender, low byte first
+#define SPLIT_PACKET_PONG	4 // The payload of the ping, sent back at once
+
+#define SPLIT_PING_FRAMES		100 // Round trip measured every 100 ms, see PROFILE_SITE_SPLIT_RTT
+#define SPLIT_STATE_SCANS		50 // A state goes out at least every 50 scans, keeps the link alive
+#define SPLIT_TIMEOUT_FRAMES	200 // Keys of the other half are released after 200 ms without a packet
+
+void split_init(void);
+void split_key(uint8_t key, uint8_t pressed);
+void split_scan_end(void);
+void split_sof(void);
+
+#endif
@@ -0,0 +1,133 @@
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+#include <stddef.h>
+#include <string.h>
+#include "store.h"
+#include "clock.h"
+
+#define STORE_COMMIT_TICKS	((uint32_t)STORE_COMMIT_MS * 1000UL * CLOCK_TICKS_PER_US)
+
+typedef struct {
+	uint16_t sequence; // Newest record has the highest, compared with wrap around
+	uint8_t version;
+	storeData_t data;
+	uint16_t crc; // CRC-CCITT of everything before it
+} __attribute__((packed)) storeRecord_t;
+
+#define STORE_SLOTS (((uint16_t)E2END + 1) / sizeof(storeRecord_t))
+
+_Static_assert(STORE_SLOTS >= 2 && STORE_SLOTS <= 255, "storeRecord_t does not fit the EEPROM ring");
+_Static_assert(sizeof(storeRecord_t) < 255, "storeRecord_t is too large");
+
+storeData_t storeData;
+
+static uint8_t storeSlot; // Slot of the newest valid record, the next commit goes to the one after it
+static uint16_t storeSequence;
+static volatile uint8_t storeDirty = 0; // Set by store_changed(), possibly from an interrupt
+static volatile uint8_t storeUpdated = 0;
+static uint32_t storeChangedAt;
+static storeRecord_t storeCommit; // Snapshot being written
+static uint8_t storeCommitOffset = sizeof(storeRecord_t); // Next byte of the snapshot to write, idle when past the end
+
+static uint8_t *store_slot_address(uint8_t slot) {
+	return (uint8_t *)(uintptr_t)(slot * sizeof(storeRecord_t));
+}
+
+static uint16_t store_crc(const storeRecord_t *record) {
+	const uint8_t *data = (const uint8_t *)record;
+	uint16_t crc = 0xFFFF;
+
+	for (uint8_t i = 0; i < offsetof(storeRecord_t, crc); i++) {
+		crc = _crc_ccitt_update(crc, data[i]);
+	}
+	return crc;
+}
+
+/*
+Load the newest valid record into storeData. Only the headers of the slots are read, a full record and its CRC
+only for a slot newer than the best one so far, which keeps the boot short. Returns zero if there was no valid
+record, storeData is then left for the caller to fill with defaults.
+*/
+uint8_t store_init(void) {
+	storeRecord_t record;
+	uint8_t found = 0;
+
+	for (uint8_t slot = 0; slot < STORE_SLOTS; slot++) {
+		uint8_t *address = store_slot_address(slot);
+		uint16_t sequence = eeprom_read_byte(address) | (eeprom_read_byte(address + 1) << 8);
+
+		if (eeprom_read_byte(address + offsetof(storeRecord_t, version)) != STORE_VERSION) {
+			continue;
+		}
+		if (found && (int16_t)(sequence - storeSequence) <= 0) {
+			continue;
+		}
+		eeprom_read_block(&record, address, sizeof(storeRecord_t));
+		if (record.crc != store_crc(&record)) {
+			continue;
+		}
+		memcpy(&storeData, &record.data, sizeof(storeData_t));
+		storeSlot = slot;
+		storeSequence = sequence;
+		found = 1;
+	}
+	if (!found) {
+		storeSlot = STORE_SLOTS - 1; // First commit goes to slot 0
+		storeSequence = 0;
+	}
+	storeDirty = 0;
+	storeCommitOffset = sizeof(storeRecord_t);
+	return found;
+}
+
+// storeData was changed, commit it once the changes stop coming in. Safe from interrupts.
+void store_changed(void) {
+	storeChangedAt = clock_now();
+	storeDirty = 1;
+	storeUpdated = 1;
+}
+
+/*
+Write at most one EEPROM byte and return right away, call from the main loop. A commit takes one call per record
+byte, each about 3.4 ms apart while the EEPROM finishes the previous write. Returns non-zero once after storeData
+was changed, for the caller to apply the new settings.
+*/
+uint8_t store_task(void) {
+	uint8_t updated;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		updated = storeUpdated;
+		storeUpdated = 0;
+		if (storeDirty && storeCommitOffset >= sizeof(storeRecord_t)
+			&& ((clock_now() - storeChangedAt) & 0xFFFFFFUL) >= STORE_COMMIT_TICKS) {
+			storeDirty = 0;
+			storeSequence++;
+			storeSlot = (storeSlot + 1) % STORE_SLOTS;
+			storeCommit.sequence = storeSequence;
+			storeCommit.version = STORE_VERSION;
+			memcpy(&storeCommit.data, &storeData, sizeof(storeData_t));
+			storeCommitOffset = 0;
+		}
+	}
+	if (storeCommitOffset == 0) {
+		storeCommit.crc = store_crc(&storeCommit);
+	}
+	if (storeCommitOffset < sizeof(storeRecord_t) && eeprom_is_ready()) {
+		eeprom_update_byte(store_slot_address(storeSlot) + storeCommitOffset, ((uint8_t *)&storeCommit)[storeCommitOffset]);
+		storeCommitOffset++;
+	}
+	return updated;
+}
+
+uint8_t store_copy_report(storeReport_t *report) {
+	report->reportId = STORE_REPORT_ID;
+	memcpy(&report->data, &storeData, sizeof(storeData_t));
+	return sizeof(storeReport_t);
+}
+
+void store_set_report(const storeReport_t *report) {
+	memcpy(&storeData, &report->data, sizeof(storeData_t));
+	store_changed();
+}
@@ -0,0 +1,40 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+#include "keymap.h"
+#include "anim.h"
+
+/*
+Settings kept in EEPROM. storeData is the RAM copy everything reads; the EEPROM is only read once by store_init()
+and written by store_task() from the main loop.
+
+The EEPROM is a ring of record slots. Every commit writes the whole record, sequence number and CRC included, to
+the slot after the newest one, so the writes spread evenly over the EEPROM and a commit cut short by a power loss
+leaves the previous record valid.
+*/
+
+#define STORE_VERSION		1 // Bump when storeData_t changes, older records are then ignored
+#define STORE_COMMIT_MS		1000 // Changes are written once they stopped coming in for this long
+#define STORE_REPORT_ID		0x20 // Vendor feature report carrying storeData_t
+
+typedef struct {
+	keymap_t keymap;
+	uint8_t ledEffect;
+	animColor_t ledColor;
+} __attribute__((packed)) storeData_t;
+
+typedef struct {
+	uint8_t reportId;
+	storeData_t data;
+} __attribute__((packed)) storeReport_t;
+
+extern storeData_t storeData;
+
+uint8_t store_init(void);
+void store_changed(void);
+uint8_t store_task(void);
+uint8_t store_copy_report(storeReport_t *report);
+void store_set_report(const storeReport_t *report);
+
+#endif
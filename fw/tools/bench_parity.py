@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+"""Compare the front-ends of the keypad core side by side under simavr.
+
+Usage: bench_parity.py <simbench> <name>=<firmware>:<keyboard endpoint> ...
+
+Runs bench/simbench on every firmware image and prints press to report latency, startup time, flash and RAM in
+one column per image (see make parity). Latencies are in microseconds at 16 MHz.
+"""
+import argparse
+import subprocess
+import sys
+
+F_CPU = 16000000
+
+
+def run(simbench, firmware, endpoint, presses):
+    output = subprocess.run([simbench, firmware, str(presses), str(endpoint)], check=True, stdout=subprocess.PIPE,
+                            universal_newlines=True).stdout
+    rows = {}
+    for line in output.splitlines()[1:]:
+        fields = line.split('\t')
+        rows[fields[0]] = fields[1:]
+    return rows
+
+
+def cycles_us(value):
+    return '-' if value == '-' else '%.1f' % (float(value) * 1000000 / F_CPU)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--presses', type=int, default=50)
+    parser.add_argument('simbench')
+    parser.add_argument('builds', nargs='+', metavar='name=firmware:endpoint')
+    args = parser.parse_args()
+
+    names = []
+    results = []
+    for build in args.builds:
+        name, _, target = build.partition('=')
+        firmware, _, endpoint = target.rpartition(':')
+        if not name or not firmware or not endpoint.isdigit():
+            parser.error('expected name=firmware:endpoint, got %s' % build)
+        names.append(name)
+        results.append(run(args.simbench, firmware, int(endpoint), args.presses))
+
+    # Label, simbench row, column of that row (count, min, mean, max), converted from cycles or not
+    metrics = [
+        ('press_to_report_min_us', 'press_to_report', 1, True),
+        ('press_to_report_mean_us', 'press_to_report', 2, True),
+        ('press_to_report_max_us', 'press_to_report', 3, True),
+        ('reports', 'press_to_report', 0, False),
+        ('startup_us', 'startup', 1, True),
+        ('flash_bytes', 'flash_bytes', 0, False),
+        ('ram_bytes', 'ram_bytes', 0, False),
+    ]
+    print('metric\t' + '\t'.join(names))
+    for label, row, column, cycles in metrics:
+        values = []
+        for rows in results:
+            fields = rows.get(row, [])
+            value = fields[column] if column < len(fields) else '-'
+            values.append(cycles_us(value) if cycles else value)
+        print('%s\t%s' % (label, '\t'.join(values)))
+
+
+if __name__ == '__main__':
+    sys.exit(main())
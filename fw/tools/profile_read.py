@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+"""Read the profiler statistics from the vendor HID interface of the keypad.
+
+Usage: profile_read.py [--reset] /dev/hidrawN
+
+The hidraw node is the one of interface 3 (vendor defined usage page 0xFF00). Builds with USB_CDC have no such
+interface, use the p and r console commands instead (see console.h). Report layouts are in profile.h.
+"""
+import argparse
+import fcntl
+import struct
+import sys
+
+SITES = ['usb_gen_isr', 'usb_com_isr', 'scan_isr', 'led_show', 'main_loop', 'scan_to_sof', 'split_rtt', 'wake_to_report']
+COUNTERS = ['missed_sof', 'stall', 'dropped_report', 'dropped_event', 'ghost', 'link_error']
+HISTOGRAM_BUCKETS = 8
+SITE_FORMAT = '<BIIHH%dH' % HISTOGRAM_BUCKETS
+COUNTERS_FORMAT = '<BBB%dH' % len(COUNTERS)
+REPORT_COUNTERS = len(SITES) + 1
+
+
+def hidioc(number, length):
+    # _IOC(_IOC_READ | _IOC_WRITE, 'H', number, length)
+    return (3 << 30) | (length << 16) | (ord('H') << 8) | number
+
+
+def get_feature(device, report_id, length):
+    buffer = bytearray(length)
+    buffer[0] = report_id
+    fcntl.ioctl(device, hidioc(0x07, length), buffer)  # HIDIOCGFEATURE
+    return bytes(buffer)
+
+
+def set_feature(device, report_id, length):
+    buffer = bytearray(length)
+    buffer[0] = report_id
+    fcntl.ioctl(device, hidioc(0x06, length), buffer)  # HIDIOCSFEATURE
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--reset', action='store_true', help='clear the statistics after reading them')
+    parser.add_argument('device')
+    args = parser.parse_args()
+
+    with open(args.device, 'rb+', buffering=0) as device:
+        counters = struct.unpack(COUNTERS_FORMAT, get_feature(device, REPORT_COUNTERS, struct.calcsize(COUNTERS_FORMAT)))
+        ticks_per_us, shift = counters[1], counters[2]
+        limits = ['<%gus' % ((1 << (shift + i)) / ticks_per_us) for i in range(HISTOGRAM_BUCKETS - 1)] + ['more']
+
+        print('site\tcount\tmin_us\tmean_us\tmax_us\t' + '\t'.join(limits))
+        for site, name in enumerate(SITES):
+            values = struct.unpack(SITE_FORMAT, get_feature(device, site + 1, struct.calcsize(SITE_FORMAT)))
+            count, total, low, high = values[1:5]
+            if not count:
+                print('%s\t0' % name)
+                continue
+            print('%s\t%d\t%.1f\t%.1f\t%.1f\t%s' % (name, count, low / ticks_per_us, total / count / ticks_per_us,
+                                                      high / ticks_per_us, '\t'.join(str(v) for v in values[5:])))
+        for name, value in zip(COUNTERS, counters[3:]):
+            print('%s\t%d' % (name, value))
+
+        if args.reset:
+            set_feature(device, REPORT_COUNTERS, struct.calcsize(COUNTERS_FORMAT))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
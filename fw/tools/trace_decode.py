@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+"""Decode the binary trace records sent by the firmware on the UART.
+
+Usage: trace_decode.py [--tick-us 0.5] [--header ../core/trace.h] <capture file or serial device>
+
+The serial device has to be configured beforehand, e.g. `stty -F /dev/ttyUSB0 38400 raw`.
+With USB_CDC the records come over the USB serial console instead, e.g. /dev/ttyACM0, mixed with the console
+replies, which are skipped like any other bytes outside a valid record.
+Event names and argument names are taken from the enum in trace.h.
+"""
+import argparse
+import os
+import re
+import sys
+
+SYNC = 0xA5
+RECORD_SIZE = 8  # sizeof(traceRecord_t)
+TIME_WRAP = 1 << 24
+
+
+def load_events(header):
+    events = {}
+    pattern = re.compile(r'^\s*TRACE_(\w+)\s*=\s*(0x[0-9A-Fa-f]+|\d+),\s*//(.*)$')
+    with open(header) as f:
+        for line in f:
+            match = pattern.match(line)
+            if match:
+                events[int(match.group(2), 0)] = (match.group(1), match.group(3).split())
+    return events
+
+
+def records(stream):
+    """Yield the valid records of the stream, skipping bytes until the next sync on any error."""
+    buffer = bytearray()
+    while True:
+        chunk = stream.read(1)
+        if not chunk:
+            return
+        buffer += chunk
+        while len(buffer) >= RECORD_SIZE + 2:
+            if buffer[0] != SYNC:
+                del buffer[0]
+                continue
+            record = buffer[1:RECORD_SIZE + 1]
+            check = 0
+            for byte in record:
+                check ^= byte
+            if check != buffer[RECORD_SIZE + 1]:
+                del buffer[0]
+                continue
+            del buffer[:RECORD_SIZE + 2]
+            yield bytes(record)
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--header', default=os.path.join(here, '..', 'core', 'trace.h'))
+    parser.add_argument('--tick-us', type=float, default=0.5, help='clock tick length, see clock.h')
+    parser.add_argument('input')
+    args = parser.parse_args()
+
+    events = load_events(args.header)
+    last = None
+    elapsed = 0
+    with open(args.input, 'rb', buffering=0) as stream:
+        for record in records(stream):
+            time = record[1] | (record[2] << 8) | (record[3] << 16)
+            # The timestamp wraps after 2^24 ticks, events further apart than that lose their spacing
+            if last is not None:
+                elapsed += (time - last) % TIME_WRAP
+            last = time
+
+            name, names = events.get(record[0], ('0x%02X' % record[0], []))
+            values = record[4:]
+            fields = ['%s=0x%02X' % (names[i] if i < len(names) else 'arg%d' % i, values[i])
+                      for i in range(len(values)) if i < len(names) or values[i]]
+            print('%12.1f us  %-24s %s' % (elapsed * args.tick_us, name, ' '.join(fields)))
+            sys.stdout.flush()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,73 @@
+#include <avr/io.h>
+#include <util/atomic.h>
+#include "trace.h"
+
+#if TRACE_LEVEL > TRACE_LEVEL_NONE
+
+#include "clock.h"
+#include "uart.h"
+
+#define TRACE_BUFFER_MASK (TRACE_BUFFER_SIZE - 1)
+
+#if TRACE_BUFFER_SIZE & TRACE_BUFFER_MASK
+#error "TRACE_BUFFER_SIZE must be a power of two"
+#endif
+
+static traceRecord_t traceBuffer[TRACE_BUFFER_SIZE];
+static volatile uint8_t traceHead = 0;
+static volatile uint8_t traceTail = 0;
+static volatile uint8_t traceLost = 0; // Records dropped since the last overflow event
+
+// Store one event in RAM, cheap enough to be called from any interrupt
+void trace_record(uint8_t id, uint8_t a0, uint8_t a1, uint8_t a2, uint8_t a3) {
+	uint32_t now = clock_now();
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uint8_t next = (traceHead + 1) & TRACE_BUFFER_MASK;
+
+		if (next == traceTail) {
+			if (traceLost != 0xFF) {
+				traceLost++;
+			}
+		} else {
+			traceRecord_t *record = &traceBuffer[traceHead];
+			record->id = id;
+			record->time[0] = now;
+			record->time[1] = now >> 8;
+			record->time[2] = now >> 16;
+			record->args[0] = a0;
+			record->args[1] = a1;
+			record->args[2] = a2;
+			record->args[3] = a3;
+			traceHead = next;
+		}
+	}
+}
+
+// Move pending records to the UART, called from the main loop. A record is sent as the sync byte,
+// the record itself and the XOR of its bytes so that the decoder can find its way back after a glitch.
+void trace_flush(void) {
+	while (traceTail != traceHead && uart_tx_free() >= sizeof(traceRecord_t) + 2) {
+		const uint8_t *data = (const uint8_t *)&traceBuffer[traceTail];
+		uint8_t check = 0;
+
+		uart_transmit(TRACE_SYNC);
+		for (uint8_t i = 0; i < sizeof(traceRecord_t); i++) {
+			uart_transmit(data[i]);
+			check ^= data[i];
+		}
+		uart_transmit(check);
+		traceTail = (traceTail + 1) & TRACE_BUFFER_MASK;
+	}
+
+	if (traceLost) {
+		uint8_t lost;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			lost = traceLost;
+			traceLost = 0;
+		}
+		trace_record(TRACE_OVERFLOW, lost, 0, 0, 0); // Goes out with the next flush
+	}
+}
+
+#endif
@@ -1,9 +1,33 @@
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
 #include "uart.h"
 
 #include <util/setbaud.h>
 
+#define UART_TX_BUFFER_MASK (UART_TX_BUFFER_SIZE - 1)
+#define UART_RX_BUFFER_MASK (UART_RX_BUFFER_SIZE - 1)
+
+#if UART_TX_BUFFER_SIZE & UART_TX_BUFFER_MASK
+#error "UART_TX_BUFFER_SIZE must be a power of two"
+#endif
+#if UART_RX_BUFFER_SIZE & UART_RX_BUFFER_MASK
+#error "UART_RX_BUFFER_SIZE must be a power of two"
+#endif
+
+// Transmit ring buffer, filled by uart_transmit() and drained by the data register empty interrupt
+static volatile uint8_t uartTxBuffer[UART_TX_BUFFER_SIZE];
+static volatile uint8_t uartTxHead = 0;
+static volatile uint8_t uartTxTail = 0;
+static volatile uint16_t uartTxOverflow = 0; // Bytes dropped because the buffer was full
+// Receive ring buffer, filled from an interrupt and drained by uart_read() in the main loop. Single producer, single
+// consumer on byte indices, so neither side needs to disable interrupts.
+static volatile uint8_t uartRxBuffer[UART_RX_BUFFER_SIZE];
+static volatile uint8_t uartRxHead = 0;
+static volatile uint8_t uartRxTail = 0;
+
 void uart_init(void){
+#if UART_USART
     // Set the BAUD rate
     UBRR1H = UBRRH_VALUE;
     UBRR1L = UBRRL_VALUE;
@@ -11,31 +35,106 @@ void uart_init(void){
     // Set the Mode & Frame Parameters
     UCSR1C = (1 << UCSZ11) | (1 << UCSZ10);  // Asynchronous, 8-data, No parity, 1-stop
 
-    // Enable USART0 Transmitter and Receiver
-    UCSR1B = (1<<RXEN1) | (1 << TXEN1);
-
+    // Enable USART0 Transmitter and Receiver, received bytes go to the ring buffer from the interrupt
+    UCSR1B = (1<<RXEN1) | (1 << TXEN1) | (1 << RXCIE1);
+#endif
 }
 
 void uart_transmit(unsigned char data){
-    // Wait for empty transmit buffer
-    while(!(UCSR1A & (1 << UDRE1)));
-
-    // Put data into buffer, sends the data
-    UDR1 = data;
+    // Callers run both in main context and inside interrupts, keep the enqueue short and atomic
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uint8_t next = (uartTxHead + 1) & UART_TX_BUFFER_MASK;
 
+        if (next == uartTxTail) {
+            // Never wait for the line, drop the byte instead
+            if (uartTxOverflow != 0xFFFF) {
+                uartTxOverflow++;
+            }
+        } else {
+            uartTxBuffer[uartTxHead] = data;
+            uartTxHead = next;
+#if UART_USART
+            UCSR1B |= (1 << UDRIE1); // The interrupt sends the data
+#endif
+        }
+    }
 }
 
-unsigned char uart_receive(void){
-    // Wait for data to be received
-    while(!(UCSR1A & (1 << RXC1)));
+// Take one received byte, returns zero when there is none
+uint8_t uart_read(uint8_t *data) {
+    if (uartRxTail == uartRxHead) {
+        return 0;
+    }
+    *data = uartRxBuffer[uartRxTail];
+    uartRxTail = (uartRxTail + 1) & UART_RX_BUFFER_MASK;
+    return 1;
+}
 
-    // Get and return received data from buffer
-    return UDR1;
+#if USB_CDC || UART_USART
+static void uart_rx_store(uint8_t data) {
+    uint8_t next = (uartRxHead + 1) & UART_RX_BUFFER_MASK;
 
+    if (next != uartRxTail) { // Dropped when full
+        uartRxBuffer[uartRxHead] = data;
+        uartRxHead = next;
+    }
 }
+#endif
 
 void uart_print(const char* str) {
     while (*str) {
         uart_transmit(*str++);
     }
 }
+
+// Bytes that can be queued without being dropped
+uint8_t uart_tx_free(void) {
+    return (uartTxTail - uartTxHead - 1) & UART_TX_BUFFER_MASK;
+}
+
+uint16_t uart_tx_overflow(void) {
+    uint16_t count;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        count = uartTxOverflow;
+    }
+    return count;
+}
+
+#if USB_CDC
+// Bytes waiting to be sent
+uint8_t uart_tx_pending(void) {
+    return (uartTxHead - uartTxTail) & UART_TX_BUFFER_MASK;
+}
+
+// Take the oldest byte, only when uart_tx_pending() said there is one
+uint8_t uart_tx_pop(void) {
+    uint8_t data = uartTxBuffer[uartTxTail];
+
+    uartTxTail = (uartTxTail + 1) & UART_TX_BUFFER_MASK;
+    return data;
+}
+
+uint8_t uart_rx_free(void) {
+    return (uartRxTail - uartRxHead - 1) & UART_RX_BUFFER_MASK;
+}
+
+void uart_rx_push(uint8_t data) {
+    uart_rx_store(data);
+}
+#elif UART_USART
+// USART1 Receive Complete Interrupt Service Routine
+ISR(USART1_RX_vect) {
+    uart_rx_store(UDR1);
+}
+
+// USART1 Data Register Empty Interrupt Service Routine
+ISR(USART1_UDRE_vect) {
+    if (uartTxHead == uartTxTail) {
+        UCSR1B &= ~(1 << UDRIE1); // Buffer drained, mask the interrupt until more data is queued
+        return;
+    }
+    UDR1 = uartTxBuffer[uartTxTail];
+    uartTxTail = (uartTxTail + 1) & UART_TX_BUFFER_MASK;
+}
+#endif
@@ -1,12 +1,47 @@
 #ifndef UART_H
 #define UART_H
 
+#include <stdint.h>
+#include "usb.h"
+#include "split.h"
+
+/*
+Console front-end. The bytes go out USART1 at BAUD, or with USB_CDC over the USB CDC-ACM interface, which takes
+them from the transmit buffer in 64-byte packets and fills the receive buffer from its OUT endpoint. With SPLIT and
+without USB_CDC there is no console: USART1 belongs to the link and the bytes are dropped once the buffer is full.
+*/
+
+#define UART_USART (!USB_CDC && !SPLIT) // The console owns USART1
+
 #define BAUD 38400UL
 
+#if USB_CDC
+#define UART_TX_BUFFER_SIZE 256 // Power of two, at most 256. Four full USB packets.
+#else
+#define UART_TX_BUFFER_SIZE 128 // Power of two, at most 256
+#endif
+#if USB_CDC
+#define UART_RX_BUFFER_SIZE 128 // Power of two, at most 256. Holds a whole USB packet, which is only taken in one go.
+#else
+#define UART_RX_BUFFER_SIZE 64 // Power of two, at most 256
+#endif
+
 #define xstr(s) str(s)
 #define str(s) #s
 
 void uart_init(void);
+void uart_transmit(unsigned char data);
 void uart_print(const char* str);
+uint8_t uart_tx_free(void);
+uint16_t uart_tx_overflow(void);
+uint8_t uart_read(uint8_t *data);
+
+#if USB_CDC
+// Back-end side, used by the USB interrupt
+uint8_t uart_tx_pending(void);
+uint8_t uart_tx_pop(void);
+uint8_t uart_rx_free(void);
+void uart_rx_push(uint8_t data);
+#endif
 
-#endif
\ No newline at end of file
+#endif
@@ -1,9 +1,21 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <util/atomic.h>
 #include <stddef.h>
+#include <string.h>
 #include "usb.h"
+#include "trace.h"
+#include "keyboard.h"
+#include "consumer.h"
+#include "mouse.h"
+#include "matrix.h"
+#include "profile.h"
+#include "store.h"
 #include "uart.h"
+#include "split.h"
+#include "clock.h"
+#include "bench.h"
 
 #define USB_VERSION 0x0200
 
@@ -13,8 +25,8 @@
 #define ENDPOINT_DIRECTION_MASK				0x01
 #define ENDPOINT_TYPE_CONTROL				0x00
 #define ENDPOINT_TYPE_ISOCHRONOUS			0x01
-#define ENDPOINT_TYPE_BULK					0x10
-#define ENDPOINT_TYPE_INTERRUPT				0x11
+#define ENDPOINT_TYPE_BULK					0x02
+#define ENDPOINT_TYPE_INTERRUPT				0x03 // Same values as bmAttributes of the endpoint descriptor
 #define ENDPOINT_TYPE_SHIFT					6
 #define ENDPOINT_TYPE_MASK					0xC0
 #define ENDPOINT_CONFIG_1(ENDPOINT_TYPE, ENDPOINT_DIRECTION)	(ENDPOINT_TYPE_MASK & (ENDPOINT_TYPE << ENDPOINT_TYPE_SHIFT)) | \
@@ -38,30 +50,68 @@
 #define ENDPOINT_SIZE_SHIFT					4
 #define ENDPOINT_SIZE_MASK					0x70
 #define ENDPOINT_CONFIG_2(ENDPOINT_SIZE, ENDPOINT_BANK, ENDPOINT_ALLOCATION)	(ENDPOINT_SIZE_MASK & (ENDPOINT_SIZE << ENDPOINT_SIZE_SHIFT)) | \
-																				(ENDPOINT_BANK_MASK & (ENDPOINT_BANK_SINGLE << ENDPOINT_BANK_SHIFT)) | \
-																				(ENDPOINT_ALLOCATION_MASK & (ENDPOINT_ALLOCATION_SET << ENDPOINT_ALLOCATION_SHIFT))
+																				(ENDPOINT_BANK_MASK & (ENDPOINT_BANK << ENDPOINT_BANK_SHIFT)) | \
+																				(ENDPOINT_ALLOCATION_MASK & (ENDPOINT_ALLOCATION << ENDPOINT_ALLOCATION_SHIFT))
 
 #define ENDPOINT_0_CONTROL_TRANSFER		0x00
-#define ENDPOINT_1
-#define ENDPOINT_2
+#define ENDPOINT_1_CDC_OUT				0x01
+#define ENDPOINT_2_CDC_IN				0x02
 #define ENDPOINT_3_KEYBOARD				0x03
+#define ENDPOINT_4_VENDOR				0x04
+#define ENDPOINT_4_CDC_NOTIFICATION		0x04 // Instead of the vendor interface
+#define ENDPOINT_5_CONSUMER				0x05
+#define ENDPOINT_6_MOUSE				0x06
+
+// HID interfaces have one interrupt IN endpoint each, see usbDescriptors. The optional interfaces come last.
+#define INTERFACE_KEYBOARD				0x00
+#define INTERFACE_CONSUMER				0x01 // Media keys
+#define INTERFACE_MOUSE					0x02 // Mouse keys
+#if USB_CDC
+#define INTERFACE_CDC_CONTROL			0x03 // Serial console, see uart.h
+#define INTERFACE_CDC_DATA				0x04
+#define USB_HID_INTERFACES				3
+#define USB_INTERFACES					(USB_HID_INTERFACES + 2)
+#else
+#define INTERFACE_VENDOR				0x03 // Vendor defined HID: profiler and settings feature reports
+#define USB_HID_INTERFACES				4
+#define USB_INTERFACES					USB_HID_INTERFACES
+#endif
+
+#define ENDPOINT_DIRECTION_IN_ADDRESS	0x80 // bEndpointAddress bit 7 set for IN endpoints
 
 #define ENDPOINT0_SIZE       			32 // Size has to be equal to what was programmed at the endpoint configuration register 
 
 #define DESCRIPTOR_TYPE_DEVICE  		0x01
 #define DESCRIPTOR_TYPE_CONFIGURATION  	0x02
 #define DESCRIPTOR_TYPE_INTERFACE  		0x04
+#define DESCRIPTOR_TYPE_ENDPOINT  		0x05
+#define DESCRIPTOR_TYPE_INTERFACE_ASSOCIATION	0x0B
+#define DESCRIPTOR_TYPE_CS_INTERFACE	0x24 // Class specific, see CDC 1.2 Table 12
 
+#define DESCRIPTOR_TYPE_HID				0x21
 #define DESCRIPTOR_TYPE_HID_REPORT		0x22
 
 #define USB_CLASS_NONE      			0x00
 #define USB_SUBCLASS_NONE   			0x00
 #define USB_PROTOCOL_NONE   			0x00
 #define USB_CONFIG_SELF_POWERED		 	0xC0 // Bitmap configuration, See in USB 2.0 Specification Table 9-10
+#define USB_CONFIG_REMOTE_WAKEUP		0x20
 #define USB_CONFIG_CURRENT_100mA		50 // Expressed in 2 mA units
 #define USB_DEVICE_CLASS_CODE_HID 		0x03 // See Defined Class Codes
 #define USB_DEVICE_SUBCLASS_BOOT   		0x01 // See Device Class Definition for Human Interface Devices (HID) Section 4.2 Subclass
 #define USB_DEVICE_PROTOCOL_KEYBOARD   	0x01 // See Device Class Definition for Human Interface Devices (HID) Section 4.2 Subclass
+#define USB_CLASS_MISCELLANEOUS			0xEF // Device made of functions with interface association descriptors
+#define USB_SUBCLASS_COMMON				0x02
+#define USB_PROTOCOL_INTERFACE_ASSOCIATION	0x01
+#define USB_CLASS_CDC					0x02 // See Class Definitions for Communications Devices (CDC) 1.2
+#define USB_SUBCLASS_CDC_ACM			0x02 // Abstract Control Model, see PSTN 1.2
+#define USB_CLASS_CDC_DATA				0x0A
+#define CDC_VERSION						0x0120
+#define CDC_SUBTYPE_HEADER				0x00
+#define CDC_SUBTYPE_CALL_MANAGEMENT		0x01
+#define CDC_SUBTYPE_ACM					0x02
+#define CDC_SUBTYPE_UNION				0x06
+#define CDC_ACM_LINE_REQUESTS			0x02 // Supports SET_LINE_CODING, GET_LINE_CODING and SET_CONTROL_LINE_STATE
 
 #define VENDOR_ID   		0x03EB // Atmel Corporation
 #define PRODUCT_ID  		0x2FF4 // Repurposing Product ID that corresponds to the 'atmega32u4 DFU bootloader'
@@ -76,15 +126,76 @@
 #define SET_CONFIGURATION 	0x09
 #define GET_INTERFACE 		0x0A
 #define SET_INTERFACE 		0x0B
+#define FEATURE_DEVICE_REMOTE_WAKEUP	0x01 // wValue of SET_FEATURE and CLEAR_FEATURE, see USB 2.0 Table 9-6
+#define USB_STATUS_REMOTE_WAKEUP		0x02 // GET_STATUS of the device, see USB 2.0 Figure 9-4
+#define FEATURE_ENDPOINT_HALT			0x00 // wValue of SET_FEATURE and CLEAR_FEATURE for an endpoint
+#define USB_STATUS_HALT					0x01 // GET_STATUS of an endpoint, see USB 2.0 Figure 9-6
 //Class HID Specific Request
-#define SET_IDLE			0x0A
+#define GET_REPORT			0x01
+#define GET_IDLE			0x02
+#define GET_PROTOCOL		0x03
 #define SET_REPORT			0x09
+#define SET_IDLE			0x0A
+#define SET_PROTOCOL		0x0B
+// Class CDC ACM Specific Request, see PSTN 1.2 Table 13
+#define SET_LINE_CODING			0x20
+#define GET_LINE_CODING			0x21
+#define SET_CONTROL_LINE_STATE	0x22
+#define CDC_CONTROL_LINE_DTR	0x01 // A terminal has the port open
+// HID report types, high byte of wValue in GET_REPORT and SET_REPORT
+#define REPORT_TYPE_INPUT	0x01
+#define REPORT_TYPE_OUTPUT	0x02
+#define REPORT_TYPE_FEATURE	0x03
+
+// bmRequestType values, see USB 2.0 Specification Table 9-2
+#define REQUEST_DEVICE_TO_HOST				0x80
+#define REQUEST_STANDARD_DEVICE_OUT			0x00
+#define REQUEST_STANDARD_DEVICE_IN			0x80
+#define REQUEST_STANDARD_INTERFACE_IN		0x81
+#define REQUEST_STANDARD_ENDPOINT_IN		0x82
+#define REQUEST_STANDARD_ENDPOINT_OUT		0x02
+#define REQUEST_CLASS_INTERFACE_OUT			0x21
+#define REQUEST_CLASS_INTERFACE_IN			0xA1
+
+#define USB_IDLE_RATE_DEFAULT	125 // 500 ms, the default HID recommends for keyboards
+#define USB_IDLE_FRAMES_PER_UNIT	4 // Idle rate unit is 4 ms, one frame is 1 ms
+
+// The bus has to be idle for 5 ms before a remote wakeup, the suspend is detected after 3 of them (USB 2.0 7.1.7.7)
+#define USB_REMOTE_WAKEUP_TICKS		(2000UL * CLOCK_TICKS_PER_US)
+#define USB_CLOCK_MASK				0xFFFFFFUL // clock_now() counts 24 bits
+
+#define CDC_PACKET_SIZE		64
+#if USB_CDC && UART_RX_BUFFER_SIZE <= CDC_PACKET_SIZE
+#error "The console receive buffer has to hold a full CDC packet, usb_cdc_frame() takes a packet only in one go"
+#endif
+#define CDC_FLUSH_FRAMES	4 // Frames a partial packet waits for more bytes before it goes out anyway
 
 volatile uint8_t usbConfigurationValue = 0; // When non-zero device is is configured and respective stored value holds selected configuration
-// hid related variables
-volatile uint16_t usbIdleValue = 0;
-volatile uint16_t usbIdleCounter = 0;
+// hid related variables. The idle state is only touched from the USB interrupts, which never nest, so the 16-bit
+// values need no atomic access. Anything shared with the main loop is a single byte.
+static uint8_t usbIdleRate = USB_IDLE_RATE_DEFAULT; // 4 ms units, zero sends reports only on change
+static uint16_t usbIdleCounter = 0; // Frames since the last keyboard report was loaded
 volatile uint8_t keyboard_leds = 0;
+// Suspend state, written by the USB general interrupt and by usb_remote_wakeup() with interrupts disabled
+volatile uint8_t usbSuspended = 0;
+static uint8_t usbRemoteWakeup = 0; // Enabled by the host with SET_FEATURE
+static uint32_t usbSuspendTime; // clock_now() when the suspend was detected
+static uint32_t usbWakeTime; // clock_now() when this device signalled resume
+static uint8_t usbWakeTimed = 0; // No report has been loaded since
+
+#if USB_CDC
+// See PSTN 1.2 Table 17. Only stored for GET_LINE_CODING, the console runs at whatever rate the host picks.
+typedef struct {
+	uint32_t dwDTERate;
+	uint8_t bCharFormat;
+	uint8_t bParityType;
+	uint8_t bDataBits;
+} __attribute__((packed)) cdcLineCoding_t;
+
+static cdcLineCoding_t cdcLineCoding = { BAUD, 0, 0, 8 };
+static uint8_t cdcLineState = 0; // SET_CONTROL_LINE_STATE bitmap, nothing is sent while DTR is clear
+static uint8_t cdcFlushCounter = 0; // Frames the transmit buffer has held a partial packet
+#endif
 
 // See USB 2.0 Specification Table 9-8
 typedef struct {
@@ -146,22 +257,244 @@ typedef struct {
 	uint16_t wDescriptorLength;
 } __attribute__((packed)) hidDescriptor_t;
 
+// See Interface Association Descriptor ECN
+typedef struct {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bFirstInterface;
+	uint8_t bInterfaceCount;
+	uint8_t bFunctionClass;
+	uint8_t bFunctionSubClass;
+	uint8_t bFunctionProtocol;
+	uint8_t iFunction;
+} __attribute__((packed)) interfaceAssociationDescriptor_t;
+
+// CDC functional descriptors, see CDC 1.2 Section 5.2.3 and PSTN 1.2 Section 5.3
+typedef struct {
+	uint8_t bFunctionLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint16_t bcdCDC;
+} __attribute__((packed)) cdcHeaderDescriptor_t;
+
+typedef struct {
+	uint8_t bFunctionLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint8_t bmCapabilities;
+	uint8_t bDataInterface;
+} __attribute__((packed)) cdcCallManagementDescriptor_t;
+
+typedef struct {
+	uint8_t bFunctionLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint8_t bmCapabilities;
+} __attribute__((packed)) cdcAcmDescriptor_t;
+
+typedef struct {
+	uint8_t bFunctionLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint8_t bControlInterface;
+	uint8_t bSubordinateInterface0;
+} __attribute__((packed)) cdcUnionDescriptor_t;
+
+// The two interfaces of the serial console, tied together by the association descriptor
+typedef struct {
+	interfaceAssociationDescriptor_t associationDescriptor;
+	interfaceDescriptor_t controlInterfaceDescriptor;
+	cdcHeaderDescriptor_t headerDescriptor;
+	cdcCallManagementDescriptor_t callManagementDescriptor;
+	cdcAcmDescriptor_t acmDescriptor;
+	cdcUnionDescriptor_t unionDescriptor;
+	endpointDescriptor_t notificationEndpointDescriptor;
+	interfaceDescriptor_t dataInterfaceDescriptor;
+	endpointDescriptor_t outEndpointDescriptor;
+	endpointDescriptor_t inEndpointDescriptor;
+} __attribute__((packed)) cdcDescriptors_t;
+
+// Interface, HID and endpoint descriptor in the order the HID specification (Section 7.1) asks for
+typedef struct {
+	interfaceDescriptor_t interfaceDescriptor;
+	hidDescriptor_t hidDescriptor;
+	endpointDescriptor_t endpointDescriptor;
+} __attribute__((packed)) hidInterfaceDescriptors_t;
+
+// The configuration descriptor is followed by everything GET_DESCRIPTOR returns with it
 typedef struct {
     deviceDescriptor_t deviceDescriptor;
     configurationDescriptor_t configurationDescriptor;
-    interfaceDescriptor_t interfaceDescriptor;
-    endpointDescriptor_t endpointDescriptor;
-	hidDescriptor_t hidDescriptor;
-} usbDescriptors_t;
+	hidInterfaceDescriptors_t hidInterfaces[USB_HID_INTERFACES]; // Indexed by interface number
+#if USB_CDC
+	cdcDescriptors_t cdc;
+#endif
+} __attribute__((packed)) usbDescriptors_t;
+
+// Report protocol layout (N-key rollover). In boot protocol the host ignores it and expects keyboardBootReport_t.
+static const uint8_t hidReportDescriptor[] PROGMEM = {
+    0x05, 0x01,  // Usage Page (Generic Desktop)
+    0x09, 0x06,  // Usage (Keyboard)
+    0xA1, 0x01,  // Collection (Application)
+    0x05, 0x07,  // Usage Page (Key Codes)
+    0x19, 0xE0,  // Usage Minimum (224)
+    0x29, 0xE7,  // Usage Maximum (231)
+    0x15, 0x00,  // Logical Minimum (0)
+    0x25, 0x01,  // Logical Maximum (1)
+    0x75, 0x01,  // Report Size (1)
+    0x95, 0x08,  // Report Count (8)
+    0x81, 0x02,  // Input (Data, Variables, Absolute)
+    0x95, 0x05,  // Report Count (5)
+    0x75, 0x01,  // Report Size (1)
+    0x05, 0x08,  // Usage Page (Page# for LEDs)
+    0x19, 0x01,  // Usage Minimum (1)
+    0x29, 0x05,  // Usage Maximum (5)
+    0x91, 0x02,  // Output (Data, Variables, Absolute)
+    0x95, 0x01,  // Report Count (1)
+    0x75, 0x03,  // Report Size (3)
+    0x91, 0x01,  // Output (Constant)
+    0x95, KEYBOARD_NKRO_BYTES * 8,  // Report Count (120)
+    0x75, 0x01,  // Report Size (1)
+    0x15, 0x00,  // Logical Minimum (0)
+    0x25, 0x01,  // Logical Maximum (1)
+    0x05, 0x07,  // Usage Page (Key Codes)
+    0x19, 0x00,  // Usage Minimum (0)
+    0x29, KEYBOARD_NKRO_BYTES * 8 - 1,  // Usage Maximum (119)
+    0x81, 0x02,  // Input (Data, Variables, Absolute)
+    0xC0   		 // End collection
+};
+
+#if !USB_CDC
+// Vendor interface: one byte array feature report per profiler site, the profiler counters (see profile.h for the
+// layouts) and the settings (storeData_t)
+#define VENDOR_FEATURE(reportId, length) \
+    0x85, reportId,  /* Report ID */ \
+    0x95, length,    /* Report Count */ \
+    0x09, reportId,  /* Usage */ \
+    0xB1, 0x02       /* Feature (Data, Variables, Absolute) */
+
+static const uint8_t vendorReportDescriptor[] PROGMEM = {
+    0x06, 0x00, 0xFF,  // Usage Page (Vendor Defined 0xFF00)
+    0x09, 0x01,        // Usage (1)
+    0xA1, 0x01,        // Collection (Application)
+    0x15, 0x00,        // Logical Minimum (0)
+    0x26, 0xFF, 0x00,  // Logical Maximum (255)
+    0x75, 0x08,        // Report Size (8)
+    VENDOR_FEATURE(PROFILE_REPORT_SITE(PROFILE_SITE_USB_GEN), sizeof(profileSite_t)),
+    VENDOR_FEATURE(PROFILE_REPORT_SITE(PROFILE_SITE_USB_COM), sizeof(profileSite_t)),
+    VENDOR_FEATURE(PROFILE_REPORT_SITE(PROFILE_SITE_SCAN), sizeof(profileSite_t)),
+    VENDOR_FEATURE(PROFILE_REPORT_SITE(PROFILE_SITE_LED), sizeof(profileSite_t)),
+    VENDOR_FEATURE(PROFILE_REPORT_SITE(PROFILE_SITE_MAIN_LOOP), sizeof(profileSite_t)),
+    VENDOR_FEATURE(PROFILE_REPORT_SITE(PROFILE_SITE_SOF_PHASE), sizeof(profileSite_t)),
+    VENDOR_FEATURE(PROFILE_REPORT_SITE(PROFILE_SITE_SPLIT_RTT), sizeof(profileSite_t)),
+    VENDOR_FEATURE(PROFILE_REPORT_SITE(PROFILE_SITE_WAKE), sizeof(profileSite_t)),
+    VENDOR_FEATURE(PROFILE_REPORT_COUNTERS, sizeof(profileCountersReport_t) - 1),
+    VENDOR_FEATURE(STORE_REPORT_ID, sizeof(storeData_t)),
+    0xC0               // End collection
+};
+#endif
+
+// One consumer usage at a time, see consumerReport_t
+static const uint8_t consumerReportDescriptor[] PROGMEM = {
+    0x05, 0x0C,        // Usage Page (Consumer)
+    0x09, 0x01,        // Usage (Consumer Control)
+    0xA1, 0x01,        // Collection (Application)
+    0x15, 0x00,        // Logical Minimum (0)
+    0x26, 0xFF, 0x03,  // Logical Maximum (1023)
+    0x19, 0x00,        // Usage Minimum (0)
+    0x2A, 0xFF, 0x03,  // Usage Maximum (1023)
+    0x75, 0x10,        // Report Size (16)
+    0x95, 0x01,        // Report Count (1)
+    0x81, 0x00,        // Input (Data, Array, Absolute)
+    0xC0               // End collection
+};
+
+// Three buttons, X, Y and wheel, see mouseReport_t
+static const uint8_t mouseReportDescriptor[] PROGMEM = {
+    0x05, 0x01,  // Usage Page (Generic Desktop)
+    0x09, 0x02,  // Usage (Mouse)
+    0xA1, 0x01,  // Collection (Application)
+    0x09, 0x01,  // Usage (Pointer)
+    0xA1, 0x00,  // Collection (Physical)
+    0x05, 0x09,  // Usage Page (Buttons)
+    0x19, 0x01,  // Usage Minimum (1)
+    0x29, 0x03,  // Usage Maximum (3)
+    0x15, 0x00,  // Logical Minimum (0)
+    0x25, 0x01,  // Logical Maximum (1)
+    0x95, 0x03,  // Report Count (3)
+    0x75, 0x01,  // Report Size (1)
+    0x81, 0x02,  // Input (Data, Variables, Absolute)
+    0x95, 0x01,  // Report Count (1)
+    0x75, 0x05,  // Report Size (5)
+    0x81, 0x01,  // Input (Constant)
+    0x05, 0x01,  // Usage Page (Generic Desktop)
+    0x09, 0x30,  // Usage (X)
+    0x09, 0x31,  // Usage (Y)
+    0x09, 0x38,  // Usage (Wheel)
+    0x15, 0x81,  // Logical Minimum (-127)
+    0x25, 0x7F,  // Logical Maximum (127)
+    0x75, 0x08,  // Report Size (8)
+    0x95, 0x03,  // Report Count (3)
+    0x81, 0x06,  // Input (Data, Variables, Relative)
+    0xC0,        // End collection
+    0xC0         // End collection
+};
+
+// Report descriptor of each HID interface, their lengths are in the HID descriptors
+static const uint8_t * const usbHidReportDescriptors[USB_HID_INTERFACES] PROGMEM = {
+	[INTERFACE_KEYBOARD] = hidReportDescriptor,
+	[INTERFACE_CONSUMER] = consumerReportDescriptor,
+	[INTERFACE_MOUSE] = mouseReportDescriptor,
+#if !USB_CDC
+	[INTERFACE_VENDOR] = vendorReportDescriptor,
+#endif
+};
+
+#define HID_INTERFACE_DESCRIPTORS(number, subClass, protocol, endpoint, packetSize, interval, reportDescriptor) { \
+	.interfaceDescriptor = { \
+		.bLength = sizeof(interfaceDescriptor_t), \
+		.bDescriptorType = DESCRIPTOR_TYPE_INTERFACE, \
+		.bInterfaceNumber = number, \
+		.bAlternateSetting = 0x00, \
+		.bNumEndpoints = 0x01, \
+		.bInterfaceClass = USB_DEVICE_CLASS_CODE_HID, \
+		.bInterfaceSubClass = subClass, \
+		.bInterfaceProtocol = protocol, \
+		.iInterface = 0x00, \
+	}, \
+	.hidDescriptor = { \
+		.bLength = sizeof(hidDescriptor_t), \
+		.bDescriptorType1 = DESCRIPTOR_TYPE_HID, \
+		.bcdHID = 0x0101, /* HID Class Specification release number */ \
+		.bCountryCode = 0x00, \
+		.bNumDescriptors = 0x01, \
+		.bDescriptorType2 = DESCRIPTOR_TYPE_HID_REPORT, \
+		.wDescriptorLength = sizeof(reportDescriptor), \
+	}, \
+	.endpointDescriptor = { \
+		.bLength = sizeof(endpointDescriptor_t), \
+		.bDescriptorType = DESCRIPTOR_TYPE_ENDPOINT, \
+		.bEndpointAddress = ENDPOINT_DIRECTION_IN_ADDRESS | endpoint, \
+		.bmAttributes = ENDPOINT_TYPE_INTERRUPT, \
+		.wMaxPacketSize = packetSize, \
+		.bInterval = interval, \
+	}, \
+}
 
 const usbDescriptors_t usbDescriptors PROGMEM = {
 	.deviceDescriptor = {
         .bLength = sizeof(deviceDescriptor_t), // 18 bytes
         .bDescriptorType = DESCRIPTOR_TYPE_DEVICE,
         .bcdUSB = USB_VERSION,
+#if USB_CDC
+        .bDeviceClass = USB_CLASS_MISCELLANEOUS, // The CDC function is described by an interface association
+        .bDeviceSubClass = USB_SUBCLASS_COMMON,
+        .bDeviceProtocol = USB_PROTOCOL_INTERFACE_ASSOCIATION,
+#else
         .bDeviceClass = USB_CLASS_NONE, // Set to none to indicate that the HID interface
         .bDeviceSubClass = USB_SUBCLASS_NONE,
         .bDeviceProtocol = USB_PROTOCOL_NONE,
+#endif
         .bMaxPacketSize0 = ENDPOINT0_SIZE, // Must match endpoint size. TODO: Confirm this note
         .idVendor = VENDOR_ID,
         .idProduct = PRODUCT_ID,
@@ -174,80 +507,645 @@ const usbDescriptors_t usbDescriptors PROGMEM = {
     .configurationDescriptor = {
 		.bLength = sizeof(configurationDescriptor_t),
 		.bDescriptorType = DESCRIPTOR_TYPE_CONFIGURATION,
-		.wTotalLength = (sizeof(configurationDescriptor_t) + sizeof(interfaceDescriptor_t) + sizeof(hidDescriptor_t) + sizeof(endpointDescriptor_t)), // TODO: Need to update this once HID descriptor is added
-		.bNumInterfaces = 0x01,
+		.wTotalLength = sizeof(usbDescriptors_t) - offsetof(usbDescriptors_t, configurationDescriptor),
+		.bNumInterfaces = USB_INTERFACES,
 		.bConfigurationValue = 0x01,
 		.iConfiguration = 0x00,
-		.bmAttributes = USB_CONFIG_SELF_POWERED,
+		.bmAttributes = USB_CONFIG_SELF_POWERED | USB_CONFIG_REMOTE_WAKEUP,
 		.bMaxPower = USB_CONFIG_CURRENT_100mA,
 	},
-	.interfaceDescriptor = {
-		.bLength = sizeof(interfaceDescriptor_t),
-		.bDescriptorType = DESCRIPTOR_TYPE_INTERFACE,
-		.bInterfaceNumber = 0x00,
-		.bAlternateSetting = 0x00,
-		.bNumEndpoints = 0x01,
-		.bInterfaceClass = USB_DEVICE_CLASS_CODE_HID,
-		.bInterfaceSubClass = USB_DEVICE_SUBCLASS_BOOT,
-		.bInterfaceProtocol = USB_DEVICE_PROTOCOL_KEYBOARD,
-		.iInterface = 0x00,
+	.hidInterfaces = {
+		// Every input interface is polled every frame (1 ms), so no report waits behind another one
+		[INTERFACE_KEYBOARD] = HID_INTERFACE_DESCRIPTORS(INTERFACE_KEYBOARD, USB_DEVICE_SUBCLASS_BOOT, USB_DEVICE_PROTOCOL_KEYBOARD,
+			ENDPOINT_3_KEYBOARD, sizeof(keyboardReport_t), 0x01, hidReportDescriptor),
+		[INTERFACE_CONSUMER] = HID_INTERFACE_DESCRIPTORS(INTERFACE_CONSUMER, USB_SUBCLASS_NONE, USB_PROTOCOL_NONE,
+			ENDPOINT_5_CONSUMER, sizeof(consumerReport_t), 0x01, consumerReportDescriptor),
+		[INTERFACE_MOUSE] = HID_INTERFACE_DESCRIPTORS(INTERFACE_MOUSE, USB_SUBCLASS_NONE, USB_PROTOCOL_NONE,
+			ENDPOINT_6_MOUSE, sizeof(mouseReport_t), 0x01, mouseReportDescriptor),
+#if !USB_CDC
+		// HID requires an interrupt IN endpoint even though only feature reports are used. Never loaded, the host only gets NAKs.
+		[INTERFACE_VENDOR] = HID_INTERFACE_DESCRIPTORS(INTERFACE_VENDOR, USB_SUBCLASS_NONE, USB_PROTOCOL_NONE,
+			ENDPOINT_4_VENDOR, 8, 0xFF, vendorReportDescriptor),
+#endif
 	},
-	.endpointDescriptor = {
-		.bLength = sizeof(endpointDescriptor_t),
-		.bDescriptorType = 0x5,	
-    	.bEndpointAddress = 0x81,
-		.bmAttributes = 0x03,
-		.wMaxPacketSize = 0x0008,
-		.bInterval = 0x0A,
+#if USB_CDC
+	.cdc = {
+		.associationDescriptor = {
+			.bLength = sizeof(interfaceAssociationDescriptor_t),
+			.bDescriptorType = DESCRIPTOR_TYPE_INTERFACE_ASSOCIATION,
+			.bFirstInterface = INTERFACE_CDC_CONTROL,
+			.bInterfaceCount = 2,
+			.bFunctionClass = USB_CLASS_CDC,
+			.bFunctionSubClass = USB_SUBCLASS_CDC_ACM,
+			.bFunctionProtocol = USB_PROTOCOL_NONE,
+			.iFunction = 0x00,
+		},
+		.controlInterfaceDescriptor = {
+			.bLength = sizeof(interfaceDescriptor_t),
+			.bDescriptorType = DESCRIPTOR_TYPE_INTERFACE,
+			.bInterfaceNumber = INTERFACE_CDC_CONTROL,
+			.bAlternateSetting = 0x00,
+			.bNumEndpoints = 0x01,
+			.bInterfaceClass = USB_CLASS_CDC,
+			.bInterfaceSubClass = USB_SUBCLASS_CDC_ACM,
+			.bInterfaceProtocol = USB_PROTOCOL_NONE, // No AT commands
+			.iInterface = 0x00,
+		},
+		.headerDescriptor = {
+			.bFunctionLength = sizeof(cdcHeaderDescriptor_t),
+			.bDescriptorType = DESCRIPTOR_TYPE_CS_INTERFACE,
+			.bDescriptorSubtype = CDC_SUBTYPE_HEADER,
+			.bcdCDC = CDC_VERSION,
+		},
+		.callManagementDescriptor = {
+			.bFunctionLength = sizeof(cdcCallManagementDescriptor_t),
+			.bDescriptorType = DESCRIPTOR_TYPE_CS_INTERFACE,
+			.bDescriptorSubtype = CDC_SUBTYPE_CALL_MANAGEMENT,
+			.bmCapabilities = 0x00, // No call management
+			.bDataInterface = INTERFACE_CDC_DATA,
+		},
+		.acmDescriptor = {
+			.bFunctionLength = sizeof(cdcAcmDescriptor_t),
+			.bDescriptorType = DESCRIPTOR_TYPE_CS_INTERFACE,
+			.bDescriptorSubtype = CDC_SUBTYPE_ACM,
+			.bmCapabilities = CDC_ACM_LINE_REQUESTS,
+		},
+		.unionDescriptor = {
+			.bFunctionLength = sizeof(cdcUnionDescriptor_t),
+			.bDescriptorType = DESCRIPTOR_TYPE_CS_INTERFACE,
+			.bDescriptorSubtype = CDC_SUBTYPE_UNION,
+			.bControlInterface = INTERFACE_CDC_CONTROL,
+			.bSubordinateInterface0 = INTERFACE_CDC_DATA,
+		},
+		.notificationEndpointDescriptor = {
+			.bLength = sizeof(endpointDescriptor_t),
+			.bDescriptorType = DESCRIPTOR_TYPE_ENDPOINT,
+			.bEndpointAddress = ENDPOINT_DIRECTION_IN_ADDRESS | ENDPOINT_4_CDC_NOTIFICATION,
+			.bmAttributes = ENDPOINT_TYPE_INTERRUPT,
+			.wMaxPacketSize = 8,
+			.bInterval = 0xFF, // No serial state notifications are ever sent
+		},
+		.dataInterfaceDescriptor = {
+			.bLength = sizeof(interfaceDescriptor_t),
+			.bDescriptorType = DESCRIPTOR_TYPE_INTERFACE,
+			.bInterfaceNumber = INTERFACE_CDC_DATA,
+			.bAlternateSetting = 0x00,
+			.bNumEndpoints = 0x02,
+			.bInterfaceClass = USB_CLASS_CDC_DATA,
+			.bInterfaceSubClass = USB_SUBCLASS_NONE,
+			.bInterfaceProtocol = USB_PROTOCOL_NONE,
+			.iInterface = 0x00,
+		},
+		.outEndpointDescriptor = {
+			.bLength = sizeof(endpointDescriptor_t),
+			.bDescriptorType = DESCRIPTOR_TYPE_ENDPOINT,
+			.bEndpointAddress = ENDPOINT_1_CDC_OUT,
+			.bmAttributes = ENDPOINT_TYPE_BULK,
+			.wMaxPacketSize = CDC_PACKET_SIZE,
+			.bInterval = 0x00,
+		},
+		.inEndpointDescriptor = {
+			.bLength = sizeof(endpointDescriptor_t),
+			.bDescriptorType = DESCRIPTOR_TYPE_ENDPOINT,
+			.bEndpointAddress = ENDPOINT_DIRECTION_IN_ADDRESS | ENDPOINT_2_CDC_IN,
+			.bmAttributes = ENDPOINT_TYPE_BULK,
+			.wMaxPacketSize = CDC_PACKET_SIZE,
+			.bInterval = 0x00,
+		},
 	},
-	.hidDescriptor = {
-		.bLength = sizeof(hidDescriptor_t),
-		.bDescriptorType1 = 0x21, // HID_DESCRIPTOR_TYPE
-		.bcdHID = 0x0101, //HID Class Specification release number
-		.bCountryCode = 0x00,
-		.bNumDescriptors = 0x01,
-		.bDescriptorType2 = 0x22, // Report Descriptor Type
-		.wDescriptorLength = 0x003F,
-	}
+#endif
 };
 
-static const uint8_t hidReportDescriptor[] PROGMEM = {
-    0x05, 0x01,  // Usage Page (Generic Desktop)
-    0x09, 0x06,  // Usage (Keyboard)
-    0xA1, 0x01,  // Collection (Application)
-    0x05, 0x07,  // Usage Page (Key Codes)
-    0x19, 0xE0,  // Usage Minimum (224)
-    0x29, 0xE7,  // Usage Maximum (231)
-    0x15, 0x00,  // Logical Minimum (0)
-    0x25, 0x01,  // Logical Maximum (1)
-    0x75, 0x01,  // Report Size (1)
-    0x95, 0x08,  // Report Count (8)
-    0x81, 0x02,  // Input (Data, Variables, Absolute)
-    0x95, 0x01,  // Report Count (1)
-    0x75, 0x08,  // Report Size (8)
-    0x81, 0x01,  // Input (Constant)
-    0x95, 0x05,  // Report Count (5)
-    0x75, 0x01,  // Report Size (1)
-    0x05, 0x08,  // Usage Page (Page# for LEDs)
-    0x19, 0x01,  // Usage Minimum (1)
-    0x29, 0x05,  // Usage Maximum (5)
-    0x91, 0x02,  // Output (Data, Variables, Absolute)
-    0x95, 0x01,  // Report Count (1)
-    0x75, 0x03,  // Report Size (3)
-    0x91, 0x01,  // Output (Constant)
-	0x95, 0x06,  // Report Count (6)
-    0x75, 0x08,  // Report Size (8)
-    0x15, 0x00,  // Logical Minimum (0)
-    0x25, 0x65,  // Logical Maximum (101)
-    0x05, 0x07,  // Usage Page (Key Codes)
-    0x19, 0x00,  // Usage Minimum (0)
-    0x29, 0x65,  // Usage Maximum (101)
-    0x81, 0x00,  // Input (Data, Array)
-    0xC0   		 // End collection
+// Endpoints set up by SET_CONFIGURATION, in increasing endpoint order as the controller allocates its memory in that order
+typedef struct {
+	const endpointDescriptor_t *descriptor;
+	uint8_t bank;
+} usbEndpoint_t;
+
+static const usbEndpoint_t usbEndpoints[] PROGMEM = {
+#if USB_CDC
+	{ &usbDescriptors.cdc.outEndpointDescriptor, ENDPOINT_BANK_DOUBLE },
+	{ &usbDescriptors.cdc.inEndpointDescriptor, ENDPOINT_BANK_DOUBLE },
+	{ &usbDescriptors.hidInterfaces[INTERFACE_KEYBOARD].endpointDescriptor, ENDPOINT_BANK_DOUBLE },
+	{ &usbDescriptors.cdc.notificationEndpointDescriptor, ENDPOINT_BANK_SINGLE },
+#else
+	{ &usbDescriptors.hidInterfaces[INTERFACE_KEYBOARD].endpointDescriptor, ENDPOINT_BANK_DOUBLE },
+	{ &usbDescriptors.hidInterfaces[INTERFACE_VENDOR].endpointDescriptor, ENDPOINT_BANK_SINGLE },
+#endif
+	{ &usbDescriptors.hidInterfaces[INTERFACE_CONSUMER].endpointDescriptor, ENDPOINT_BANK_DOUBLE },
+	{ &usbDescriptors.hidInterfaces[INTERFACE_MOUSE].endpointDescriptor, ENDPOINT_BANK_DOUBLE },
 };
 
 volatile uint8_t usbAddressConfig = 0;
 
+/*
+Endpoint 0 control transfers, see USB 2.0 Specification Section 8.5.3. The SETUP interrupt looks the request up in
+usbRequestHandlers and then every following endpoint interrupt moves at most one bank, so the ISR never waits on the bus:
+
+  device to host:           SETUP -> DATA_IN (one IN packet per TXINI) -> STATUS_OUT (host sends the zero length OUT)
+  host to device with data: SETUP -> DATA_OUT (one OUT packet per RXOUTI) -> STATUS_IN (we send the zero length IN)
+  host to device no data:   SETUP -> STATUS_IN
+*/
+typedef enum {
+	USB_CONTROL_IDLE,
+	USB_CONTROL_DATA_IN,
+	USB_CONTROL_DATA_OUT,
+	USB_CONTROL_STATUS_IN,
+	USB_CONTROL_STATUS_OUT,
+} usbControlStage_t;
+
+#define USB_CONTROL_FLAG_PROGMEM	0x01 // data points to flash
+#define USB_CONTROL_FLAG_ZLP		0x02 // Reply is shorter than wLength, a full last packet must be followed by a zero length one
+
+typedef struct {
+	uint8_t bmRequestType;
+	uint8_t bRequest;
+	uint16_t wValue;
+	uint16_t wIndex;
+	uint16_t wLength;
+} __attribute__((packed)) usbSetupPacket_t;
+
+// Largest reply built in RAM
+typedef union {
+	keyboardReport_t keyboard;
+	consumerReport_t consumer;
+	mouseReport_t mouse;
+	profileReport_t profile;
+	storeReport_t store;
+} usbControlBuffer_t;
+
+typedef struct {
+	usbSetupPacket_t setup;
+	uint8_t stage;
+	uint8_t flags;
+	uint8_t *data; // Reply for DATA_IN, destination for DATA_OUT
+	uint16_t length; // Bytes left in the data stage
+	void (*complete)(void); // Called once the data stage (DATA_OUT) or the status stage (no data) is over
+	uint8_t buffer[sizeof(usbControlBuffer_t)]; // Room for small replies and small OUT data
+} usbControl_t;
+
+static usbControl_t usbControl;
+
+// Answer the request with a block of memory, the handler returns right after. The length is cut to wLength.
+static void usb_control_reply(const uint8_t *data, uint16_t length, uint8_t flags) {
+	usbControl.data = (uint8_t *)data;
+	usbControl.length = length;
+	usbControl.flags = flags;
+}
+
+// Receive the data stage of a host to device request into data, complete() runs when all of it arrived
+static void usb_control_receive(uint8_t *data, uint16_t length, void (*complete)(void)) {
+	usbControl.data = data;
+	usbControl.length = length;
+	usbControl.complete = complete;
+}
+
+static uint8_t usb_request_get_descriptor(void) {
+	uint8_t descriptorType = (usbControl.setup.wValue >> 8);
+	uint16_t interface = usbControl.setup.wIndex;
+
+	TRACE_DEBUG(TRACE_USB_GET_DESCRIPTOR, descriptorType, usbControl.setup.wValue & 0xFF); // Type and index
+	switch (descriptorType) {
+		case DESCRIPTOR_TYPE_DEVICE:
+			PORTE |= (1 << PORTE6);
+			usb_control_reply((const uint8_t *)&usbDescriptors.deviceDescriptor, sizeof(deviceDescriptor_t), USB_CONTROL_FLAG_PROGMEM);
+			return 1;
+		case DESCRIPTOR_TYPE_CONFIGURATION:
+			usb_control_reply((const uint8_t *)&usbDescriptors.configurationDescriptor,
+				pgm_read_word(&usbDescriptors.configurationDescriptor.wTotalLength), USB_CONTROL_FLAG_PROGMEM);
+			return 1;
+		case DESCRIPTOR_TYPE_HID:
+			if (interface >= USB_HID_INTERFACES) {
+				return 0;
+			}
+			usb_control_reply((const uint8_t *)&usbDescriptors.hidInterfaces[interface].hidDescriptor, sizeof(hidDescriptor_t),
+				USB_CONTROL_FLAG_PROGMEM);
+			return 1;
+		case DESCRIPTOR_TYPE_HID_REPORT:
+			if (interface >= USB_HID_INTERFACES) {
+				return 0;
+			}
+			usb_control_reply(pgm_read_ptr(&usbHidReportDescriptors[interface]),
+				pgm_read_word(&usbDescriptors.hidInterfaces[interface].hidDescriptor.wDescriptorLength), USB_CONTROL_FLAG_PROGMEM);
+			return 1;
+	}
+	return 0;
+}
+
+// The new address may only be enabled once the status stage has completed with the default address
+static void usb_enable_address(void) {
+	UDADDR |= (1 << ADDEN);
+}
+
+static uint8_t usb_request_set_address(void) {
+	PORTC |= (1 << PORTC6);
+	UDADDR = usbControl.setup.wValue & 0x7F; // Record the received address, ADDEN stays cleared until the status stage
+	usbControl.complete = usb_enable_address;
+	usbAddressConfig |= (1 << 2);
+	TRACE_INFO(TRACE_USB_SET_ADDRESS, usbControl.setup.wValue);
+	return 1;
+}
+
+// Set up an endpoint as its descriptor (in flash) says
+static void usb_configure_endpoint(const endpointDescriptor_t *descriptor, uint8_t bank) {
+	uint8_t address = pgm_read_byte(&descriptor->bEndpointAddress);
+	uint16_t packetSize = pgm_read_word(&descriptor->wMaxPacketSize);
+	uint8_t size = ENDPOINT_SIZE_8;
+
+	while ((8 << size) < packetSize) {
+		size++;
+	}
+	UENUM = address & ~ENDPOINT_DIRECTION_IN_ADDRESS;
+	UECONX = (1 << EPEN);
+	UECFG0X = ENDPOINT_CONFIG_1(pgm_read_byte(&descriptor->bmAttributes),
+		(address & ENDPOINT_DIRECTION_IN_ADDRESS) ? ENDPOINT_DIRECTION_IN : ENDPOINT_DIRECTION_OUT);
+	UECFG1X = ENDPOINT_CONFIG_2(size, bank, ENDPOINT_ALLOCATION_SET);
+}
+
+static uint8_t usb_request_set_configuration(void) {
+	usbEndpoint_t endpoint;
+	uint8_t configuration = usbControl.setup.wValue & 0xFF; // Configuration in lower byte
+
+	if (configuration > 1) {
+		return 0;
+	}
+	usbConfigurationValue = configuration; // Some call it status because once this variable as a value in signals device its configured
+	keyboard_set_protocol(KEYBOARD_PROTOCOL_REPORT);
+	TRACE_INFO(TRACE_USB_SET_CONFIGURATION, configuration);
+	for (uint8_t i = 0; i < sizeof(usbEndpoints) / sizeof(usbEndpoint_t); i++) {
+		memcpy_P(&endpoint, &usbEndpoints[i], sizeof(usbEndpoint_t));
+		usb_configure_endpoint(endpoint.descriptor, endpoint.bank);
+	}
+	UERST = 0x7E;          // Reset all of the endpoints
+	UERST = 0;
+	return 1;
+}
+
+static uint8_t usb_request_get_configuration(void) {
+	usbControl.buffer[0] = usbConfigurationValue;
+	usb_control_reply(usbControl.buffer, 1, 0);
+	return 1;
+}
+
+// Endpoint number wIndex of an endpoint request addresses, direction bit included. 0xFF if the device has no such
+// endpoint, only endpoint 0 exists before SET_CONFIGURATION.
+static uint8_t usb_request_endpoint_number(void) {
+	usbEndpoint_t endpoint;
+	uint8_t address = usbControl.setup.wIndex;
+
+	if ((address & ~ENDPOINT_DIRECTION_IN_ADDRESS) == ENDPOINT_0_CONTROL_TRANSFER) {
+		return ENDPOINT_0_CONTROL_TRANSFER;
+	}
+	for (uint8_t i = 0; usbConfigurationValue && i < sizeof(usbEndpoints) / sizeof(usbEndpoint_t); i++) {
+		memcpy_P(&endpoint, &usbEndpoints[i], sizeof(usbEndpoint_t));
+		if (pgm_read_byte(&endpoint.descriptor->bEndpointAddress) == address) {
+			return address & ~ENDPOINT_DIRECTION_IN_ADDRESS;
+		}
+	}
+	return 0xFF;
+}
+
+static uint8_t usb_request_get_status(void) {
+	usbControl.buffer[0] = 0; // Not self powered (from the host point of view), not halted
+	if (usbControl.setup.bmRequestType == REQUEST_STANDARD_DEVICE_IN && usbRemoteWakeup) {
+		usbControl.buffer[0] = USB_STATUS_REMOTE_WAKEUP;
+	}
+	if (usbControl.setup.bmRequestType == REQUEST_STANDARD_ENDPOINT_IN) {
+		uint8_t number = usb_request_endpoint_number();
+		if (number == 0xFF) {
+			return 0;
+		}
+		UENUM = number;
+		if (number != ENDPOINT_0_CONTROL_TRANSFER && (UECONX & (1 << STALLRQ))) {
+			usbControl.buffer[0] = USB_STATUS_HALT;
+		}
+	}
+	usbControl.buffer[1] = 0;
+	usb_control_reply(usbControl.buffer, 2, 0);
+	return 1;
+}
+
+// SET_FEATURE and CLEAR_FEATURE, the device has no other feature than remote wakeup
+static uint8_t usb_request_feature(void) {
+	if (usbControl.setup.wValue != FEATURE_DEVICE_REMOTE_WAKEUP) {
+		return 0;
+	}
+	usbRemoteWakeup = (usbControl.setup.bRequest == SET_FEATURE);
+	return 1;
+}
+
+/*
+SET_FEATURE and CLEAR_FEATURE of ENDPOINT_HALT. Hosts clear the halt to recover an endpoint after an error, which
+also resets its data toggle (USB 2.0 Section 9.4.5). Endpoint 0 is never halted, a stall there ends with the next SETUP.
+*/
+static uint8_t usb_request_endpoint_feature(void) {
+	uint8_t number = usb_request_endpoint_number();
+
+	if (usbControl.setup.wValue != FEATURE_ENDPOINT_HALT || number == 0xFF) {
+		return 0;
+	}
+	if (number == ENDPOINT_0_CONTROL_TRANSFER) {
+		return 1;
+	}
+	UENUM = number;
+	if (usbControl.setup.bRequest == SET_FEATURE) {
+		UECONX |= (1 << STALLRQ);
+	} else {
+		UECONX |= (1 << STALLRQC) | (1 << RSTDT);
+	}
+	return 1;
+}
+
+static void usb_set_report_complete(void) {
+	keyboard_leds = usbControl.buffer[0];
+	TRACE_DEBUG(TRACE_USB_SET_REPORT, keyboard_leds);
+}
+
+#if !USB_CDC
+static void usb_store_report_complete(void) {
+	// Only a complete report replaces the settings, whatever else is in the buffer would end up in the EEPROM
+	if (!usbControl.length && usbControl.buffer[0] == STORE_REPORT_ID) {
+		store_set_report((const storeReport_t *)usbControl.buffer);
+	}
+}
+#endif
+
+static uint8_t usb_request_set_report(void) {
+#if !USB_CDC
+	if (usbControl.setup.wIndex == INTERFACE_VENDOR) {
+		if ((usbControl.setup.wValue & 0xFF) == STORE_REPORT_ID) {
+			if (usbControl.setup.wLength != sizeof(storeReport_t)) {
+				return 0; // The data stage is cut to wLength, a shorter write would still complete
+			}
+			usb_control_receive(usbControl.buffer, sizeof(storeReport_t), usb_store_report_complete);
+		} else {
+			usb_control_receive(usbControl.buffer, sizeof(usbControl.buffer), profile_reset); // Any profiler report clears the statistics
+		}
+		return 1;
+	}
+#endif
+	if (usbControl.setup.wIndex != INTERFACE_KEYBOARD) {
+		return 0; // Only the keyboard has an output report
+	}
+	usb_control_receive(usbControl.buffer, 1, usb_set_report_complete); // Output report, one byte of LED state
+	return 1;
+}
+
+static uint8_t usb_request_set_idle(void) {
+	if (usbControl.setup.wIndex != INTERFACE_KEYBOARD) {
+		return 0; // The other interfaces only report changes (and motion), there is nothing to repeat. Hosts take the stall.
+	}
+	TRACE_DEBUG(TRACE_USB_SET_IDLE, usbControl.setup.wValue >> 8, usbControl.setup.wValue);
+	usbIdleRate = usbControl.setup.wValue >> 8; // The keyboard has a single report, the report ID is ignored
+	return 1;
+}
+
+static uint8_t usb_request_get_report(void) {
+#if !USB_CDC
+	if (usbControl.setup.wIndex == INTERFACE_VENDOR) {
+		uint8_t reportId = usbControl.setup.wValue & 0xFF;
+		uint8_t length;
+
+		if ((usbControl.setup.wValue >> 8) != REPORT_TYPE_FEATURE) {
+			return 0;
+		}
+		if (reportId == STORE_REPORT_ID) {
+			length = store_copy_report((storeReport_t *)usbControl.buffer);
+		} else {
+			length = profile_copy_report(reportId, (profileReport_t *)usbControl.buffer);
+		}
+		usb_control_reply(usbControl.buffer, length, 0);
+		return length != 0;
+	}
+#endif
+	if ((usbControl.setup.wValue >> 8) != REPORT_TYPE_INPUT) {
+		return 0; // Only the input report exists
+	}
+	switch (usbControl.setup.wIndex) {
+		case INTERFACE_KEYBOARD:
+			usb_control_reply(usbControl.buffer, keyboard_copy_report((keyboardReport_t *)usbControl.buffer), 0);
+			return 1;
+		case INTERFACE_CONSUMER:
+			usb_control_reply(usbControl.buffer, consumer_copy_report((consumerReport_t *)usbControl.buffer), 0);
+			return 1;
+		case INTERFACE_MOUSE:
+			usb_control_reply(usbControl.buffer, mouse_copy_report((mouseReport_t *)usbControl.buffer), 0);
+			return 1;
+	}
+	return 0;
+}
+
+static uint8_t usb_request_get_idle(void) {
+	if (usbControl.setup.wIndex != INTERFACE_KEYBOARD) {
+		return 0; // Only the keyboard has an idle rate, see usb_request_set_idle()
+	}
+	usbControl.buffer[0] = usbIdleRate; // Duration in 4 ms units
+	usb_control_reply(usbControl.buffer, 1, 0);
+	return 1;
+}
+
+static uint8_t usb_request_get_protocol(void) {
+	if (usbControl.setup.wIndex != INTERFACE_KEYBOARD) {
+		return 0; // Only the boot interface has protocols
+	}
+	usbControl.buffer[0] = keyboardProtocol;
+	usb_control_reply(usbControl.buffer, 1, 0);
+	return 1;
+}
+
+static uint8_t usb_request_set_protocol(void) {
+	if (usbControl.setup.wIndex != INTERFACE_KEYBOARD || usbControl.setup.wValue > KEYBOARD_PROTOCOL_REPORT) {
+		return 0;
+	}
+	TRACE_INFO(TRACE_USB_SET_PROTOCOL, usbControl.setup.wValue);
+	keyboard_set_protocol(usbControl.setup.wValue);
+	return 1;
+}
+
+#if USB_CDC
+static uint8_t usb_request_set_line_coding(void) {
+	if (usbControl.setup.wIndex != INTERFACE_CDC_CONTROL) {
+		return 0;
+	}
+	usb_control_receive((uint8_t *)&cdcLineCoding, sizeof(cdcLineCoding_t), NULL);
+	return 1;
+}
+
+static uint8_t usb_request_get_line_coding(void) {
+	if (usbControl.setup.wIndex != INTERFACE_CDC_CONTROL) {
+		return 0;
+	}
+	usb_control_reply((const uint8_t *)&cdcLineCoding, sizeof(cdcLineCoding_t), 0);
+	return 1;
+}
+
+static uint8_t usb_request_set_control_line_state(void) {
+	if (usbControl.setup.wIndex != INTERFACE_CDC_CONTROL) {
+		return 0;
+	}
+	cdcLineState = usbControl.setup.wValue;
+	return 1;
+}
+#endif
+
+typedef struct {
+	uint8_t bmRequestType;
+	uint8_t bRequest;
+	uint8_t (*handler)(void); // Returns zero to stall the request
+} usbRequestHandler_t;
+
+static const usbRequestHandler_t usbRequestHandlers[] PROGMEM = {
+	{ REQUEST_STANDARD_DEVICE_IN,		GET_DESCRIPTOR,		usb_request_get_descriptor },
+	{ REQUEST_STANDARD_INTERFACE_IN,	GET_DESCRIPTOR,		usb_request_get_descriptor }, // HID report descriptor
+	{ REQUEST_STANDARD_DEVICE_OUT,		SET_ADDRESS,		usb_request_set_address },
+	{ REQUEST_STANDARD_DEVICE_OUT,		SET_CONFIGURATION,	usb_request_set_configuration },
+	{ REQUEST_STANDARD_DEVICE_IN,		GET_CONFIGURATION,	usb_request_get_configuration },
+	{ REQUEST_STANDARD_DEVICE_IN,		GET_STATUS,			usb_request_get_status },
+	{ REQUEST_STANDARD_DEVICE_OUT,		SET_FEATURE,		usb_request_feature },
+	{ REQUEST_STANDARD_DEVICE_OUT,		CLEAR_FEATURE,		usb_request_feature },
+	{ REQUEST_STANDARD_INTERFACE_IN,	GET_STATUS,			usb_request_get_status },
+	{ REQUEST_STANDARD_ENDPOINT_IN,		GET_STATUS,			usb_request_get_status },
+	{ REQUEST_STANDARD_ENDPOINT_OUT,	SET_FEATURE,		usb_request_endpoint_feature },
+	{ REQUEST_STANDARD_ENDPOINT_OUT,	CLEAR_FEATURE,		usb_request_endpoint_feature },
+	{ REQUEST_CLASS_INTERFACE_OUT,		SET_REPORT,			usb_request_set_report },
+	{ REQUEST_CLASS_INTERFACE_OUT,		SET_IDLE,			usb_request_set_idle },
+	{ REQUEST_CLASS_INTERFACE_OUT,		SET_PROTOCOL,		usb_request_set_protocol },
+	{ REQUEST_CLASS_INTERFACE_IN,		GET_REPORT,			usb_request_get_report },
+	{ REQUEST_CLASS_INTERFACE_IN,		GET_IDLE,			usb_request_get_idle },
+	{ REQUEST_CLASS_INTERFACE_IN,		GET_PROTOCOL,		usb_request_get_protocol },
+#if USB_CDC
+	{ REQUEST_CLASS_INTERFACE_OUT,		SET_LINE_CODING,	usb_request_set_line_coding },
+	{ REQUEST_CLASS_INTERFACE_IN,		GET_LINE_CODING,	usb_request_get_line_coding },
+	{ REQUEST_CLASS_INTERFACE_OUT,		SET_CONTROL_LINE_STATE,	usb_request_set_control_line_state },
+#endif
+};
+
+static void usb_control_stage(uint8_t stage) {
+	usbControl.stage = stage;
+	switch (stage) {
+		case USB_CONTROL_DATA_IN:
+			UEIENX = (1 << RXSTPE) | (1 << TXINE) | (1 << RXOUTE); // An OUT here is the host ending the data stage early
+		break;
+		case USB_CONTROL_DATA_OUT:
+		case USB_CONTROL_STATUS_OUT:
+			UEIENX = (1 << RXSTPE) | (1 << RXOUTE);
+		break;
+		case USB_CONTROL_STATUS_IN:
+			UEIENX = (1 << RXSTPE) | (1 << TXINE);
+		break;
+		default:
+			UEIENX = (1 << RXSTPE); // TXINI stays set while the bank is free, it must not be enabled when idle
+	}
+}
+
+static void usb_control_finish(void) {
+	if (usbControl.complete) {
+		usbControl.complete();
+	}
+	usb_control_stage(USB_CONTROL_IDLE);
+}
+
+static void usb_control_status_in(void) {
+	UEINTX = ~(1 << TXINI); // Zero length IN packet, TXINI comes back once the host acknowledged it
+	usb_control_stage(USB_CONTROL_STATUS_IN);
+}
+
+static void usb_control_setup(void) {
+	usbRequestHandler_t entry;
+	uint8_t *setup = (uint8_t *)&usbControl.setup;
+
+	for (uint8_t i = 0; i < sizeof(usbSetupPacket_t); i++) {
+		setup[i] = UEDATX;
+	}
+	// Acknowledge the SETUP, a new SETUP always aborts whatever was left of the previous transfer
+	UEINTX = ~((1 << RXSTPI) | (1 << RXOUTI));
+	usbControl.data = NULL;
+	usbControl.length = 0;
+	usbControl.flags = 0;
+	usbControl.complete = NULL;
+
+	TRACE_DEBUG(TRACE_USB_SETUP, usbControl.setup.bmRequestType, usbControl.setup.bRequest, usbControl.setup.wValue, usbControl.setup.wValue >> 8);
+	TRACE_DEBUG(TRACE_USB_SETUP_LENGTH, usbControl.setup.wIndex, usbControl.setup.wIndex >> 8, usbControl.setup.wLength, usbControl.setup.wLength >> 8);
+
+	uint8_t handled = 0;
+	for (uint8_t i = 0; i < sizeof(usbRequestHandlers) / sizeof(usbRequestHandler_t); i++) {
+		memcpy_P(&entry, &usbRequestHandlers[i], sizeof(usbRequestHandler_t));
+		if (entry.bmRequestType == usbControl.setup.bmRequestType && entry.bRequest == usbControl.setup.bRequest) {
+			handled = entry.handler();
+			break;
+		}
+	}
+	UENUM = ENDPOINT_0_CONTROL_TRANSFER; // Handlers may have selected another endpoint
+
+	// The data stage ends only after wLength bytes, more than the handler takes would leave the host sending
+	if (handled && !(usbControl.setup.bmRequestType & REQUEST_DEVICE_TO_HOST) && usbControl.setup.wLength > usbControl.length) {
+		handled = 0;
+	}
+	if (!handled) {
+		TRACE_INFO(TRACE_USB_STALL, usbControl.setup.bmRequestType, usbControl.setup.bRequest);
+		profile_count(PROFILE_COUNTER_STALL);
+		UECONX = (1 << STALLRQ) | (1 << EPEN); // Cleared by the hardware on the next SETUP
+		usb_control_stage(USB_CONTROL_IDLE);
+		return;
+	}
+
+	if (usbControl.setup.bmRequestType & REQUEST_DEVICE_TO_HOST) {
+		if (usbControl.length >= usbControl.setup.wLength) {
+			usbControl.length = usbControl.setup.wLength;
+		} else {
+			usbControl.flags |= USB_CONTROL_FLAG_ZLP;
+		}
+		usb_control_stage(USB_CONTROL_DATA_IN);
+	} else if (usbControl.setup.wLength) {
+		usbControl.length = usbControl.setup.wLength; // No more than the handler takes, see above
+		usb_control_stage(USB_CONTROL_DATA_OUT);
+	} else {
+		usb_control_status_in();
+	}
+}
+
+// Load one IN packet of the data stage
+static void usb_control_data_in(void) {
+	uint8_t packetLength = (usbControl.length < ENDPOINT0_SIZE) ? usbControl.length : ENDPOINT0_SIZE;
+
+	for (uint8_t i = 0; i < packetLength; i++) {
+		if (usbControl.flags & USB_CONTROL_FLAG_PROGMEM) {
+			UEDATX = pgm_read_byte(usbControl.data++);
+		} else {
+			UEDATX = *usbControl.data++;
+		}
+	}
+	usbControl.length -= packetLength;
+	UEINTX = ~(1 << TXINI); // Clear flag to send data and wipe endpoint bank
+
+	// A short packet ends the data stage, so does a full one when it is exactly what the host asked for
+	if (packetLength < ENDPOINT0_SIZE || (usbControl.length == 0 && !(usbControl.flags & USB_CONTROL_FLAG_ZLP))) {
+		usb_control_stage(USB_CONTROL_STATUS_OUT);
+	}
+}
+
+// Unload one OUT packet of the data stage
+static void usb_control_data_out(void) {
+	uint8_t packetLength = UEBCLX;
+
+	for (uint8_t i = 0; i < packetLength; i++) {
+		uint8_t data = UEDATX;
+		if (usbControl.length) {
+			*usbControl.data++ = data;
+			usbControl.length--;
+		}
+	}
+	UEINTX = ~(1 << RXOUTI); // Acknowledge the packet and free the bank
+
+	if (usbControl.length == 0 || packetLength < ENDPOINT0_SIZE) {
+		if (usbControl.complete) {
+			usbControl.complete();
+			usbControl.complete = NULL;
+		}
+		usb_control_status_in();
+	}
+}
+
 void usb_init() {
     UHWCON = (1<<UVREGE); // Power on the USB pads regulator
     USBCON = (1<<FRZCLK); // Freeze the clock prior configuration
@@ -258,18 +1156,186 @@ void usb_init() {
     USBCON |= ((1 << USBE) | (1 << OTGPADE)); // Enable the USB controller and enable the VBUS pad
     USBCON &= ~(1 << FRZCLK); // Unfreeze the USB controller clock
     UDCON = 0; // Set full speed mode and attach USB device
-    UDIEN = (1 << EORSTE) | (1 << SOFE); // Enable the USB interrupt flags for end of reset and start of frame
+    UDIEN = (1 << EORSTE) | (1 << SOFE) | (1 << SUSPE); // Enable the USB interrupt flags for end of reset, start of frame and suspend
 	usbConfigurationValue = 0; // Device is unconfigured
 	sei();
 
 	usbAddressConfig |= (1 << 0);
 }
 
+// Select an IN endpoint, returns non-zero if it has a free bank for the next report. Otherwise both banks still hold
+// reports the host has not polled yet, the caller tries again next frame.
+static uint8_t usb_endpoint_ready(uint8_t endpoint) {
+	UENUM = endpoint;
+	return (UEINTX & (1 << RWAL)) != 0;
+}
+
+// Load a report into the bank of the selected endpoint and hand it over to the controller
+static void usb_endpoint_send(const void *report, uint8_t length) {
+	const uint8_t *data = (const uint8_t *)report;
+
+	for (uint8_t i = 0; i < length; i++) {
+		UEDATX = data[i];
+	}
+	// Clear TXINI and then FIFOCON to hand the bank over to the controller, writing one to the other flags has no effect
+	UEINTX = (1 << RWAL) | (1 << NAKOUTI) | (1 << RXSTPI) | (1 << STALLEDI);
+}
+
+// Load the keyboard endpoint bank with a new report, only when the key state changed since the last one sent or a
+// repeat was asked for. Returns non-zero if a report was loaded.
+static uint8_t usb_send_keyboard_report(void) {
+	keyboardReport_t report;
+
+	if (!usb_endpoint_ready(ENDPOINT_3_KEYBOARD)) {
+		if (keyboard_report_pending()) {
+			profile_count(PROFILE_COUNTER_DROPPED_REPORT); // The change waits for a later frame
+		}
+		return 0;
+	}
+	uint8_t length = keyboard_build_report(&report, UDFNUM);
+	if (!length) {
+		return 0;
+	}
+	usb_endpoint_send(&report, length);
+	BENCH_EVENT(BENCH_SITE_REPORT);
+
+	// The first keyboard report after a wake up ends its latency measurement
+	matrix_reported();
+	if (usbWakeTimed) {
+		uint32_t ticks = (clock_now() - usbWakeTime) & USB_CLOCK_MASK;
+		TRACE_INFO(TRACE_USB_WAKE_REPORT, ticks, ticks >> 8, ticks >> 16);
+		usbWakeTimed = 0;
+	}
+	return 1;
+}
+
+// Media and mouse keys, each on its own endpoint. Built after the keyboard report, which applies the key events.
+static void usb_send_consumer_mouse_reports(void) {
+	consumerReport_t consumer;
+	mouseReport_t mouse;
+	uint8_t length;
+
+	if (usb_endpoint_ready(ENDPOINT_5_CONSUMER) && (length = consumer_build_report(&consumer))) {
+		usb_endpoint_send(&consumer, length);
+	}
+	if (usb_endpoint_ready(ENDPOINT_6_MOUSE) && (length = mouse_build_report(&mouse))) {
+		usb_endpoint_send(&mouse, length);
+	}
+}
+
+// Once per frame: send what changed, or repeat the last report when the idle period has passed without one
+static void usb_keyboard_frame(void) {
+	if (usbIdleCounter < 0xFFFF) {
+		usbIdleCounter++;
+	}
+	if (usbIdleRate && usbIdleCounter >= (uint16_t)usbIdleRate * USB_IDLE_FRAMES_PER_UNIT) {
+		keyboard_repeat_report();
+	}
+	if (usb_send_keyboard_report()) {
+		usbIdleCounter = 0;
+	}
+}
+
+#if USB_CDC
+/*
+Once per frame, move the console bytes. An OUT packet is only taken once the receive buffer has room for all of
+it, until then the host gets NAKs. The transmit buffer goes out in full packets as soon as it holds one, up to
+both banks per frame, and what is left after CDC_FLUSH_FRAMES frames in a short packet. Nothing is sent while no
+terminal has the port open (DTR clear), the bytes wait in the buffer and the newest ones are dropped once it is full.
+*/
+static void usb_cdc_frame(void) {
+	UENUM = ENDPOINT_1_CDC_OUT;
+	if (UEINTX & (1 << RXOUTI)) {
+		uint8_t length = UEBCLX;
+
+		if (uart_rx_free() >= length) {
+			UEINTX = ~(1 << RXOUTI);
+			while (length--) {
+				uart_rx_push(UEDATX);
+			}
+			UEINTX = (uint8_t)~(1 << FIFOCON); // Free the bank
+		}
+	}
+
+	uint8_t pending = uart_tx_pending();
+	if (!pending || !(cdcLineState & CDC_CONTROL_LINE_DTR)) {
+		cdcFlushCounter = 0;
+		return;
+	}
+	if (cdcFlushCounter < CDC_FLUSH_FRAMES) {
+		cdcFlushCounter++;
+	}
+	UENUM = ENDPOINT_2_CDC_IN;
+	while ((pending >= CDC_PACKET_SIZE || (pending && cdcFlushCounter >= CDC_FLUSH_FRAMES)) && (UEINTX & (1 << RWAL))) {
+		uint8_t length = (pending < CDC_PACKET_SIZE) ? pending : CDC_PACKET_SIZE;
+
+		pending -= length;
+		while (length--) {
+			UEDATX = uart_tx_pop();
+		}
+		UEINTX = (1 << RWAL) | (1 << NAKOUTI) | (1 << RXSTPI) | (1 << STALLEDI); // Clear TXINI, then FIFOCON
+		cdcFlushCounter = 0;
+	}
+}
+#endif
+
+// Start the PLL again and unfreeze the USB clock, the PLL locks within about 100 us
+static void usb_thaw_clock(void) {
+	PLLCSR = (1 << PINDIV) | (1 << PLLE);
+	while (!(PLLCSR & (1 << PLOCK))) {
+	}
+	USBCON &= ~(1 << FRZCLK);
+}
+
+// Three idle milliseconds on the bus: freeze the clock and wait for the wake up interrupt, which works without it
+static void usb_suspend(void) {
+	UDINT &= ~(1 << WAKEUPI); // Set by any earlier bus activity, and it only clears with the clock running
+	UDIEN = (UDIEN & ~(1 << SUSPE)) | (1 << WAKEUPE);
+	usbSuspended = 1;
+	usbSuspendTime = clock_now();
+	profile_sof_lost();
+	USBCON |= (1 << FRZCLK);
+	PLLCSR &= ~(1 << PLLE);
+	TRACE_INFO(TRACE_USB_SUSPEND, usbRemoteWakeup);
+}
+
+// The host resumes the bus (or resets it), or this device signals resume
+static void usb_resume(uint8_t remote) {
+	usb_thaw_clock();
+	UDINT &= ~((1 << WAKEUPI) | (1 << SUSPI));
+	UDIEN = (UDIEN & ~(1 << WAKEUPE)) | (1 << SUSPE);
+	usbSuspended = 0;
+	TRACE_INFO(TRACE_USB_RESUME, remote);
+}
+
+/*
+Called from the main loop while key events wait. Suspended with remote wakeup enabled, it restarts the clock and
+signals resume upstream. The host then resumes the bus for 20 ms and the events go out in the first frames after,
+the time from here to the first report is traced.
+*/
+void usb_remote_wakeup(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (usbSuspended && usbRemoteWakeup && ((clock_now() - usbSuspendTime) & USB_CLOCK_MASK) >= USB_REMOTE_WAKEUP_TICKS) {
+			usb_resume(1);
+			UDCON |= (1 << RMWKUP); // Cleared by the controller once the resume signalling is out
+			usbWakeTime = clock_now();
+			usbWakeTimed = 1;
+		}
+	}
+}
+
 // USB General Interrupt Service Routine
 ISR(USB_GEN_vect) {
+	BENCH_ENTER(BENCH_SITE_USB_GEN);
+	uint16_t profileStart = profile_start();
 	uint8_t udint_bits = UDINT;
 	UDINT = 0; // Clear interrupt flag register
 
+	// Wake up and suspend are only enabled in the state they end, the flags are set in the other one too
+	if ((udint_bits & (1 << WAKEUPI)) && (UDIEN & (1 << WAKEUPE))) {
+		usb_resume(0);
+	}
+
     // Check if end of reset interrupt flag as occured to begin configuration of control transfer endpoint
     if (udint_bits & (1 << EORSTI)) {
         UENUM = ENDPOINT_0_CONTROL_TRANSFER; // Select the endpoint
@@ -277,197 +1343,92 @@ ISR(USB_GEN_vect) {
         UECFG0X = ENDPOINT_CONFIG_1(ENDPOINT_TYPE_CONTROL, ENDPOINT_DIRECTION_OUT); // Configure the endpoint type and direction
 		UECFG1X = ENDPOINT_CONFIG_2(ENDPOINT_SIZE_32, ENDPOINT_BANK_SINGLE, ENDPOINT_ALLOCATION_SET); // Configure endpoint size and bank parametrization // TODO should use ENDPOINT0_SIZE macro instead
         UEIENX = (1 << RXSTPE);  // Enable the "received setup packet" interrupt flag
+		usbControl.stage = USB_CONTROL_IDLE;
+		keyboard_set_protocol(KEYBOARD_PROTOCOL_REPORT); // Devices come out of reset in report protocol
+		usbIdleRate = USB_IDLE_RATE_DEFAULT;
+		usbIdleCounter = 0;
+#if USB_CDC
+		cdcLineState = 0; // Until a terminal opens the port again
+#endif
         usbConfigurationValue = 0; // Device is unconfigured TODO why do I need to have this here?
+		usbRemoteWakeup = 0;
 		usbAddressConfig |= (1 << 1);
+		profile_sof_lost();
+		TRACE_INFO(TRACE_USB_RESET);
     }
 
     // Check if start of frame interrupt flag as occured to know when USB "Start Of Frame" PID (SOF) has been detected
     // Note here is where we would report keyword presses to the USB host   
 	if (udint_bits & (1 << SOFI)) {
+		profile_sof(UDFNUM);
+		matrix_sof(); // Before the report is built from the last scan
 		if (usbConfigurationValue) {
-            // Unsure of what I want to do here...
-            // Seems like we release the FIFO buffer for host to use when needed. With this we also flush the buffer
-            // Unknown why its 0x3A
+#if SPLIT
+			split_sof(); // Keys of the other half, in time for this report
+#endif
+			usb_keyboard_frame();
+			usb_send_consumer_mouse_reports();
+#if USB_CDC
+			usb_cdc_frame();
+#endif
 		}
 	}
+	if ((udint_bits & (1 << SUSPI)) && (UDIEN & (1 << SUSPE))) {
+		usb_suspend();
+	}
+	profile_end(PROFILE_SITE_USB_GEN, profileStart);
+	BENCH_EXIT(BENCH_SITE_USB_GEN);
 }
 
 // USB Endpoint Interrupt Service Routine
 ISR(USB_COM_vect) {
-	uint8_t bmRequestType;
-	uint8_t bRequest;
-	uint16_t wValue;
-	uint16_t wIndex;
-	uint16_t wLength;
-
-    const uint8_t *list;
-	uint16_t desc_val;
-	const uint8_t *desc_addr;
-	uint8_t	desc_length;
-
-	uint16_t packetLength;
-
+	BENCH_ENTER(BENCH_SITE_USB_COM);
+	uint16_t profileStart = profile_start();
     // Select the endpoint number so that the CPU can then access to the various endpoint registers and data
     UENUM = ENDPOINT_0_CONTROL_TRANSFER;
-    // Check if a new setup packet has been received by reading interrupt flag RXSTPI
-    if (UEINTX & (1 << RXSTPI)) {
-        bmRequestType = UEDATX; // Determine the direction of the request
-        bRequest = UEDATX; // Determine what is the particular request being made
-        wValue = UEDATX;
-        wValue |= (UEDATX << 8);
-        wIndex = UEDATX;
-        wIndex |= (UEDATX << 8);
-        wLength = UEDATX; // Specify the number of bytes to be transferred should there be a data phase
-        wLength |= (UEDATX << 8);
-
-		char buffer[4];
-		uart_print("bmRequestType bRequest ");
-		itoa(bmRequestType, buffer, 10);  // Convert uint8_t to string (base 10)
-		uart_print(buffer);
-		uart_print(" ");
-		itoa(bRequest, buffer, 10);  // Convert uint8_t to string (base 10)
-		uart_print(buffer);
-		uart_print(" wValue ");
-		itoa((wValue >> 8), buffer, 10);  // Convert uint8_t to string (base 10)
-		uart_print(buffer);
-		uart_print(" ");
-		itoa((wValue & 0xFF), buffer, 10);  // Convert uint8_t to string (base 10)
-		uart_print(buffer);
-		uart_print(" ");
-		uart_print(" Wlength ");
-		itoa((wLength >> 8), buffer, 10);  // Convert uint8_t to string (base 10)
-		uart_print(buffer);
-		uart_print(" ");
-		itoa((wLength & 0xFF), buffer, 10);  // Convert uint8_t to string (base 10)
-		uart_print(buffer);
-		uart_print(" sizeof hidReportDescriptor: ");
-		itoa(sizeof(hidReportDescriptor), buffer, 10);  // Convert uint8_t to string (base 10)
-		uart_print(buffer);
-		uart_print("\r\n");
-
-        /* 
-        RXSTPI is set when a new SETUP is received. It shall be cleared by firmware to acknowledge the packet
-        and to clear the endpoint bank.
-        RXOUTI is set when a new OUT data is received. It shall be cleared by firmware to acknowledge the
-        packet and to clear the endpoint bank.
-        TXINI is set when the bank is ready to accept a new IN packet. It shall be cleared by firmware to send the
-        packet and to clear the endpoint bank.
-        */
-        UEINTX = ~((1<<RXSTPI) | (1<<RXOUTI) | (1<<TXINI)); // Clear flags. Why am I clearing these out and in flags?
-
-        if (bRequest == GET_DESCRIPTOR && (bmRequestType == 0x80 || bmRequestType == 0x82)) {
-			uart_print("GET_DESCRIPTOR\t");
-			uint8_t descriptorType = (wValue >> 8);
-	        uint8_t descriptorIndex = (wValue & 0xFF);
-			uint16_t transferLength = 0;
-			uint16_t descriptorLength = 0;
-			uint8_t *descriptorAddr = NULL;
-            switch (descriptorType) {
-                case DESCRIPTOR_TYPE_DEVICE:
-					uart_print("Selecting DESCRIPTOR_TYPE_DEVICE\r\n");
-					PORTE |= (1 << PORTE6);
-                    descriptorLength = sizeof(deviceDescriptor_t);
-					descriptorAddr = (uint8_t*)&usbDescriptors.deviceDescriptor;
-                break;
-                case DESCRIPTOR_TYPE_CONFIGURATION:
-					uart_print("Selecting DESCRIPTOR_TYPE_CONFIGURATION\r\n");
-                    descriptorLength = (sizeof(configurationDescriptor_t) + sizeof(interfaceDescriptor_t) + sizeof(hidDescriptor_t) + sizeof(endpointDescriptor_t));
-					descriptorAddr = (uint8_t*)&usbDescriptors.configurationDescriptor;
-                break;
-                case DESCRIPTOR_TYPE_HID_REPORT:
-					uart_print("Selecting DESCRIPTOR_TYPE_HID_REPORT\r\n");
-					descriptorLength = sizeof(hidReportDescriptor);
-					descriptorAddr = hidReportDescriptor;
-                break;
-                default:
-					uart_print("Stalling...\r\n");
-                    UECONX = (1 << STALLRQ) | (1 << EPEN); //stall
-            }
-
-			transferLength = (wLength < 256) ? wLength : 255; // Maximum payload size is the endpoint size // This is rather the size of uint8
-			if (transferLength > descriptorLength) {
-				transferLength = descriptorLength;
-			}
 
-			while (transferLength) {
-				while (!(UEINTX & (1 << TXINI))) {
-					// Wait until bank signals its ready to accept a new IN packet
+    /*
+    RXSTPI is set when a new SETUP is received. It shall be cleared by firmware to acknowledge the packet
+    and to clear the endpoint bank.
+    RXOUTI is set when a new OUT data is received. It shall be cleared by firmware to acknowledge the
+    packet and to clear the endpoint bank.
+    TXINI is set when the bank is ready to accept a new IN packet. It shall be cleared by firmware to send the
+    packet and to clear the endpoint bank.
+    */
+	uint8_t flags = UEINTX;
+
+	if (flags & (1 << RXSTPI)) {
+		usb_control_setup();
+	} else {
+		switch (usbControl.stage) {
+			case USB_CONTROL_DATA_IN:
+				if (flags & (1 << RXOUTI)) {
+					UEINTX = ~(1 << RXOUTI); // The host got what it needed and moved on to the status stage
+					usb_control_finish();
+				} else if (flags & (1 << TXINI)) {
+					usb_control_data_in();
 				}
-				packetLength = (transferLength < ENDPOINT0_SIZE) ? transferLength : ENDPOINT0_SIZE;
-				for (uint8_t i = 0; i < packetLength; i++) {
-					UEDATX = pgm_read_byte(descriptorAddr++);
+			break;
+			case USB_CONTROL_STATUS_OUT:
+				if (flags & (1 << RXOUTI)) {
+					UEINTX = ~(1 << RXOUTI);
+					usb_control_finish();
 				}
-				transferLength -= packetLength;
-				UEINTX = ~(1<<TXINI); // Clear flag to send data and wipe endpoint bank
-			}
-
-			return;
-        }
-		if (bRequest == SET_ADDRESS && bmRequestType == 0x00) {
-			PORTC |= (1 << PORTC6);
-			UEINTX = ~(1<<TXINI); // Firmware to sends an IN command of 0 bytes 
-			while (!(UEINTX & (1<<TXINI))) {
-				// Wait until bank signals its ready to accept a new IN packet. 
-				// We should be at status stage now?
-			}
-			// Apperantly you are not suppose to do this at the same time. RIP
-			UDADDR = wValue | (1<<ADDEN); // Record the received address and enable the USB device address
-			usbAddressConfig |= (1 << 2);
-			return;
-		}
-		if (bRequest == SET_CONFIGURATION && bmRequestType == 0x00) {
-			usbConfigurationValue = wValue & 0xFF; // Configuration in lower byte. Some call it status because once this variable as a value in signals device its configured
-			UEINTX = ~(1<<TXINI); // Clear flag to send data and wipe endpoint bank
-			UENUM = ENDPOINT_3_KEYBOARD;
-			UECONX = 1;
-			UECFG0X = 0b11000001;  // EPTYPE Interrupt IN
-			UECFG1X = 0b00000110;  // Dual Bank Endpoint, 8 Bytes, allocate memory
-			UERST = 0x1E;          // Reset all of the endpoints
-			UERST = 0;
-			return;
-		} // Do a survey of what we actually need to get started.  
-		if (bRequest == GET_CONFIGURATION && bmRequestType == 0x80) {
-			while (!(UEINTX & (1<<TXINI))) {
-				// Wait until bank signals its ready to accept a new IN packet. 
-				// We should be at status stage now?
-			}
-			UEDATX = usbConfigurationValue;
-			UEINTX &= ~(1 << TXINI);
-			return;
-		}
-        if (bRequest == SET_REPORT && bmRequestType == 0x22) {
-			uart_print("SET_REPORT\r\n");
-			//   while (!(UEINTX & (1 << RXOUTI)));
-				// This is the opposite of the TXINI one, we are waiting until
-				// the banks are ready for reading instead of for writing
-			keyboard_leds = UEDATX;
-
-			UEINTX &= ~(1 << TXINI);  // Send ACK and clear TX bit
-			UEINTX &= ~(1 << RXOUTI);
-			return;
-        }
-		if (bRequest == SET_IDLE && bmRequestType == 0x22xxxx) {
-			uart_print("SET_IDLE\r\n");
-			usbIdleValue = wValue;
-			usbIdleCounter = 0;
-
-			UEINTX &= ~(1 << TXINI);  // Send ACK and clear TX bit
-			return;
-		}
-		if (bRequest == GET_STATUS) {
-			while (!(UEINTX & (1 << TXINI)));
-			UEDATX = 0;
-			UEDATX = 0;
-			UEINTX &= ~(1 << TXINI);
-			return;
+			break;
+			case USB_CONTROL_DATA_OUT:
+				if (flags & (1 << RXOUTI)) {
+					usb_control_data_out();
+				}
+			break;
+			case USB_CONTROL_STATUS_IN:
+				if (flags & (1 << TXINI)) {
+					usb_control_finish();
+				}
+			break;
+			default:
+				usb_control_stage(USB_CONTROL_IDLE);
 		}
-        UECONX = (1<<STALLRQ) | (1<<EPEN);	// stall
-    }
-
-
-
-    // Clear RXSTPI the to acknowledge the setup packet and to clear the endpoint bank
-
-    // Free the bank by clearing FIFOCON when all the data is read. 
-    // The FIFOCON and RWAL fields are irrelevant with CONTROL endpoints
-}
\ No newline at end of file
+	}
+	profile_end(PROFILE_SITE_USB_COM, profileStart);
+	BENCH_EXIT(BENCH_SITE_USB_COM);
+}
@@ -1,8 +1,18 @@
 #ifndef USB_H
 #define USB_H
 
+#include <stdint.h>
+
+// 1: a CDC-ACM serial console (see uart.h) takes the place of the vendor HID interface, the ATmega32U4 has no
+// endpoints left for both. The profiler and the keymap are then reached through the console commands of console.c.
+#ifndef USB_CDC
+#define USB_CDC 0
+#endif
+
 extern volatile uint8_t usbAddressConfig;
+extern volatile uint8_t usbSuspended; // The host suspended the bus, see usb_remote_wakeup()
 
 void usb_init();
+void usb_remote_wakeup(void);
 
-#endif
\ No newline at end of file
+#endif